@@ -1,3 +1,4 @@
+#include <atomic>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
@@ -6,6 +7,7 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <libcamera/camera.h>
@@ -18,10 +20,12 @@
 #include <libcamera/transform.h>
 #include <libcamera/version.h>
 #include <linux/dma-buf.h>
-#include <linux/dma-heap.h>
 #include <linux/videodev2.h>
 
 #include "camera.h"
+#include "camera_state.h"
+#include "dma_heap.h"
+#include "stats.h"
 
 using libcamera::Camera;
 using libcamera::CameraConfiguration;
@@ -57,35 +61,10 @@ static void set_error(const char *format, ...) {
 
 const char *camera_get_error() { return errbuf; }
 
-static long timespec_sub(struct timespec *a, struct timespec *b) {
-    return ((a->tv_sec * 1000000000L) + a->tv_nsec) -
-           ((b->tv_sec * 1000000000L) + b->tv_nsec);
-}
-
-static void timespec_add(struct timespec *a, long nanosecs) {
-    a->tv_nsec += nanosecs;
-
-    while (a->tv_nsec > 1000000000L) {
-        a->tv_sec++;
-        a->tv_nsec -= 1000000000L;
-    }
-};
-
-// https://github.com/raspberrypi/rpicam-apps/blob/6de1ab6a899df35f929b2a15c0831780bd8e750e/core/dma_heaps.cpp
-static int create_dma_allocator() {
-    static const char *heap_positions[] = {
-        "/dev/dma_heap/vidbuf_cached",
-        "/dev/dma_heap/linux,cma",
-    };
-
-    for (unsigned int i = 0; i < sizeof(heap_positions) / sizeof(const char *);
-         i++) {
-        int fd = open(heap_positions[i], O_RDWR | O_CLOEXEC, 0);
-        if (fd >= 0) {
-            return fd;
-        }
-    }
-    return -1;
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 // https://github.com/raspberrypi/libcamera-apps/blob/dd97618a25523c2c4aa58f87af5f23e49aa6069c/core/libcamera_app.cpp#L42
@@ -147,91 +126,471 @@ get_cameras(const CameraManager *camera_manager) {
     return cameras;
 }
 
+// the camera manager is shared by all the cameras of the process, since
+// starting it enumerates sensors and loads IPA modules, that is slow.
+static std::weak_ptr<CameraManager> shared_camera_manager;
+
+static std::shared_ptr<CameraManager> get_camera_manager() {
+    std::shared_ptr<CameraManager> manager = shared_camera_manager.lock();
+    if (manager != NULL) {
+        return manager;
+    }
+
+    manager = std::shared_ptr<CameraManager>(new CameraManager(),
+                                             [](CameraManager *m) {
+                                                 m->stop();
+                                                 delete m;
+                                             });
+    if (manager->start() != 0) {
+        return NULL;
+    }
+
+    shared_camera_manager = manager;
+    return manager;
+}
+
+// recoveries that can be attempted without receiving any frame.
+#define MAX_FAILED_RECOVERIES 3
+
+// microseconds. Maximum time to wait for consumers to release frames before
+// reconfiguring.
+#define RECONFIGURE_TIMEOUT 1000000
+
+// limits of the buffer count in adaptive mode.
+#define ADAPTIVE_MIN_BUFFER_COUNT 2
+#define ADAPTIVE_MAX_BUFFER_COUNT 6
+
+// frame period of a stream is computed as this value divided by the frame
+// rate of the stream in mHz, in order to obtain nanoseconds.
+#define STREAM_PERIOD_NUM 1000000000000LL
+
+// reference held by the camera while frame_cb is running.
+#define CAMERA_CONSUMER_CAMERA (1 << 7)
+
+struct CameraPriv;
+
+// a request and its buffers. Frames are indexed like requests, and each
+// request points to its frame through its cookie.
+struct CameraFrame {
+    CameraPriv *camp;
+    Request *request;
+    // mapped buffers, indexed by stream ID.
+    camera_buffer_t outputs[PARAMETERS_MAX_STREAMS];
+    // buffers, indexed like streams.
+    std::vector<FrameBuffer *> buffers;
+    // predicted sensor timestamp, before correction.
+    int64_t predicted_ts;
+    // bitmask of the consumers that are using the buffers.
+    std::atomic<unsigned int> consumers;
+    // whether the request has been given to libcamera or is waiting in
+    // idle_requests. Protected by stopped_mutex.
+    bool queued;
+};
+
+// decides which frames include an output stream, in order to obtain the
+// frame rate of the stream. Protected by stopped_mutex, except fps.
+struct StreamSchedule {
+    // mHz. Zero means every frame.
+    std::atomic<uint64_t> fps;
+    int64_t next;
+    int64_t rem;
+};
+
+// buffers of a stream, indexed like requests. They are allocated one by one,
+// or are sliced out of an arena, that is a single DMA buffer per stream.
+// Arenas avoid fragmenting the CMA pool and require a single mapping.
+struct StreamBuffers {
+    // stream ID, -1 for the raw stream.
+    int id;
+    unsigned int frame_size;
+    // whether the stream has buffers at all.
+    bool enabled;
+    bool mapped;
+    std::vector<std::unique_ptr<FrameBuffer>> buffers;
+    std::vector<camera_buffer_t> outputs;
+    // the size of the arena is zero when buffers are allocated one by one.
+    SharedFD arena_fd;
+    uint8_t *arena_mapped;
+    size_t arena_size;
+    // distance between the buffers of two consecutive requests.
+    size_t slot_size;
+};
+
 struct CameraPriv {
     camera_frame_cb frame_cb;
     camera_error_cb error_cb;
-    long secondary_deltat;
-    std::unique_ptr<CameraManager> camera_manager;
+    std::shared_ptr<CameraManager> camera_manager;
     std::shared_ptr<Camera> camera;
-    Stream *video_stream;
-    Stream *secondary_stream;
+    // output streams, indexed by stream ID. NULL when disabled.
+    Stream *output_streams[PARAMETERS_MAX_STREAMS];
+    // IDs of streams in the pipe, indexed by stream ID. They differ from
+    // stream IDs when the process drives several cameras.
+    int pipe_ids[PARAMETERS_MAX_STREAMS];
+    // all streams, raw stream included.
+    std::vector<Stream *> streams;
+    // stream ID of each entry of streams, -1 for the raw stream.
+    std::vector<int> stream_ids;
     std::vector<std::unique_ptr<Request>> requests;
-    std::mutex ctrls_mutex;
-    std::unique_ptr<ControlList> ctrls;
-    std::vector<std::unique_ptr<FrameBuffer>> frame_buffers;
-    std::map<FrameBuffer *, uint8_t *> mapped_buffers;
-    struct timespec last_secondary_frame_time;
-    bool in_error;
+    std::unique_ptr<CameraFrame[]> frames;
+    unsigned int max_buffer_count;
+    std::atomic<uint64_t> sequence_gaps;
+    uint32_t last_sequence;
+    bool last_sequence_set;
+    // controls that are waiting to be attached to a request. They are
+    // written by the main thread and picked up by the thread that queues the
+    // next request, through atomic pointer swaps.
+    std::atomic<ControlList *> pending_ctrls;
+    // an empty list that can be reused by the main thread.
+    std::atomic<ControlList *> spare_ctrls;
+    // buffers, indexed like streams.
+    std::vector<std::unique_ptr<StreamBuffers>> stream_buffers;
+    // whether the raw stream has buffers. In low memory mode, the pipeline
+    // handler uses its internal buffers instead, since raw frames are never
+    // read.
+    bool raw_buffers;
+    // whether the buffers of a stream are read by the CPU and therefore
+    // mapped, indexed by stream ID.
+    bool mapped_streams[PARAMETERS_MAX_STREAMS];
+    std::atomic<bool> in_error;
+    bool thread_registered;
     std::mutex stopped_mutex;
     bool stopped;
+    bool paused;
+    // request scheduler, protected by stopped_mutex.
+    // Sensor timestamps are predicted by adding frame durations, and
+    // predictions are corrected with actual timestamps.
+    int64_t next_ts;
+    int64_t ts_offset;
+    int64_t frame_duration;
+    StreamSchedule schedules[PARAMETERS_MAX_STREAMS];
+    std::vector<Request *> idle_requests;
+    std::atomic<uint64_t> resume_time;
+    bool recovering;
+    int failed_recoveries;
+    std::atomic<uint64_t> recovery_start;
+    std::atomic<uint64_t> last_frame_time;
+    // whether the converged AE/AWB state is recorded.
+    bool state_enabled;
+    // time of the last recording, used by the camera thread only.
+    uint64_t state_time;
+    // last converged state, recorded by the camera thread and saved by the
+    // main thread.
+    std::mutex state_mutex;
+    camera_state_t state;
+    bool state_changed;
+    // controls that give AE/AWB back to the algorithms after the first
+    // requests, that are seeded with a saved state. Protected by
+    // stopped_mutex.
+    std::unique_ptr<ControlList> auto_ctrls;
 };
 
-bool camera_create(const parameters_t *params, camera_frame_cb frame_cb,
-                   camera_error_cb error_cb, camera_t **cam) {
-    std::unique_ptr<CameraPriv> camp = std::make_unique<CameraPriv>();
+// maximum number of requests. In adaptive mode, it depends on the memory
+// budget and on the size of the buffers of a request.
+static unsigned int max_buffer_count(CameraPriv *camp,
+                                     const parameters_t *params) {
+    if (params->buffer_count != 0) {
+        return params->buffer_count;
+    }
 
-    set_hdr(params->hdr);
+    if (params->buffer_memory_budget == 0) {
+        return ADAPTIVE_MAX_BUFFER_COUNT;
+    }
 
-    if (strcmp(params->log_level, "debug") == 0) {
-        setenv("LIBCAMERA_LOG_LEVELS", "*:DEBUG", 1);
-    } else if (strcmp(params->log_level, "info") == 0) {
-        setenv("LIBCAMERA_LOG_LEVELS", "*:INFO", 1);
-    } else if (strcmp(params->log_level, "warn") == 0) {
-        setenv("LIBCAMERA_LOG_LEVELS", "*:WARN", 1);
-    } else { // error
-        setenv("LIBCAMERA_LOG_LEVELS", "*:ERROR", 1);
+    uint64_t request_size = 0;
+    for (unsigned int i = 0; i < camp->streams.size(); i++) {
+        if (camp->stream_ids[i] >= 0 || camp->raw_buffers) {
+            request_size += camp->streams[i]->configuration().frameSize;
+        }
     }
 
-    // We make sure to set the environment variable before libcamera init
-    setenv("LIBCAMERA_RPI_TUNING_FILE", params->tuning_file, 1);
+    uint64_t count =
+        (uint64_t)params->buffer_memory_budget * 1024 * 1024 / request_size;
+    if (count < ADAPTIVE_MIN_BUFFER_COUNT) {
+        return ADAPTIVE_MIN_BUFFER_COUNT;
+    }
+    if (count > ADAPTIVE_MAX_BUFFER_COUNT) {
+        return ADAPTIVE_MAX_BUFFER_COUNT;
+    }
+    return count;
+}
 
-    camp->camera_manager = std::make_unique<CameraManager>();
-    int ret = camp->camera_manager->start();
-    if (ret != 0) {
-        set_error("CameraManager.start() failed");
-        return false;
+static void free_stream_buffers(StreamBuffers *sb) {
+    if (sb->arena_size != 0) {
+        if (sb->arena_mapped != NULL) {
+            munmap(sb->arena_mapped, sb->arena_size);
+        }
+    } else {
+        for (const camera_buffer_t &output : sb->outputs) {
+            if (output.mapped != NULL) {
+                munmap(output.mapped, sb->frame_size);
+            }
+        }
     }
 
-    std::vector<std::shared_ptr<Camera>> cameras =
-        get_cameras(camp->camera_manager.get());
-    if (params->camera_id >= cameras.size()) {
-        set_error("selected camera is not available");
+    sb->buffers.clear();
+    sb->outputs.clear();
+}
+
+// allocate an arena that can hold the buffers of all the requests that may
+// be created, including the ones added in adaptive mode. Slots are aligned
+// to pages, in order to start each buffer on a page boundary.
+static bool alloc_arena(CameraPriv *camp, StreamBuffers *sb,
+                        int allocator_fd) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t slot_size = (sb->frame_size + page_size - 1) & ~(page_size - 1);
+    size_t size = slot_size * camp->max_buffer_count;
+
+    int arena_fd = dma_heap_alloc(allocator_fd, size);
+    if (arena_fd < 0) {
         return false;
     }
+    SharedFD fd = SharedFD(UniqueFD(arena_fd));
 
-    camp->camera = camp->camera_manager->get(cameras[params->camera_id]->id());
-    if (camp->camera == NULL) {
-        set_error("CameraManager.get() failed");
+    uint8_t *mapped = NULL;
+    if (sb->mapped) {
+        void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd.get(), 0);
+        if (ptr == MAP_FAILED) {
+            return false;
+        }
+        mapped = (uint8_t *)ptr;
+    }
+
+    sb->arena_fd = fd;
+    sb->arena_mapped = mapped;
+    sb->arena_size = size;
+    sb->slot_size = slot_size;
+    return true;
+}
+
+// add a buffer to a stream, by slicing it out of the arena or by
+// allocating it.
+static bool add_stream_buffer(StreamBuffers *sb, int allocator_fd) {
+    unsigned int index = sb->buffers.size();
+    camera_buffer_t output = {NULL, -1, 0};
+    std::vector<FrameBuffer::Plane> plane(1);
+
+    if (sb->arena_size != 0) {
+        size_t offset = index * sb->slot_size;
+        if (offset + sb->frame_size > sb->arena_size) {
+            set_error("buffer arena is full");
+            return false;
+        }
+
+        plane[0].fd = sb->arena_fd;
+        plane[0].offset = offset;
+        if (sb->arena_mapped != NULL) {
+            output.mapped = sb->arena_mapped + offset;
+        }
+        output.offset = offset;
+    } else {
+        int buffer_fd = dma_heap_alloc(allocator_fd, sb->frame_size);
+        if (buffer_fd < 0) {
+            set_error("failed to allocate buffer in dma heap");
+            return false;
+        }
+
+        plane[0].fd = SharedFD(UniqueFD(buffer_fd));
+        plane[0].offset = 0;
+        if (sb->mapped) {
+            void *ptr = mmap(NULL, sb->frame_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, plane[0].fd.get(), 0);
+            if (ptr == MAP_FAILED) {
+                set_error("mmap() failed");
+                return false;
+            }
+            output.mapped = (uint8_t *)ptr;
+        }
+    }
+
+    plane[0].length = sb->frame_size;
+    output.fd = plane[0].fd.get();
+
+    sb->buffers.push_back(std::make_unique<FrameBuffer>(plane));
+    sb->outputs.push_back(output);
+    return true;
+}
+
+// whether buffers of a previous configuration can be used by a stream.
+static bool can_reuse(const StreamBuffers *prev, const StreamBuffers *sb,
+                      const CameraPriv *camp, const parameters_t *params) {
+    if (prev->id != sb->id || prev->frame_size != sb->frame_size ||
+        prev->enabled != sb->enabled || prev->mapped != sb->mapped ||
+        (prev->arena_size != 0) != params->buffer_arena) {
         return false;
     }
 
-    ret = camp->camera->acquire();
-    if (ret != 0) {
-        set_error("Camera.acquire() failed");
+    // the arena must hold the buffers of all the requests.
+    return (prev->arena_size == 0 ||
+            prev->arena_size >= prev->slot_size * camp->max_buffer_count);
+}
+
+// set up the buffers of each stream. Buffers of a previous configuration are
+// kept when the stream has the same ID, size and mapping; the other ones are
+// released before allocating new ones, in order to limit memory usage.
+static void init_stream_buffers(
+    CameraPriv *camp, const parameters_t *params,
+    std::vector<std::unique_ptr<StreamBuffers>> *prev, int allocator_fd) {
+    std::vector<std::unique_ptr<StreamBuffers>> sbs;
+
+    for (unsigned int i = 0; i < camp->streams.size(); i++) {
+        std::unique_ptr<StreamBuffers> sb = std::make_unique<StreamBuffers>();
+        sb->id = camp->stream_ids[i];
+        sb->frame_size = camp->streams[i]->configuration().frameSize;
+        sb->enabled = (sb->id >= 0 || camp->raw_buffers);
+        sb->mapped = (sb->id >= 0 && camp->mapped_streams[sb->id]);
+        sb->arena_mapped = NULL;
+        sb->arena_size = 0;
+        sb->slot_size = 0;
+
+        for (std::unique_ptr<StreamBuffers> &p : *prev) {
+            if (p != NULL && can_reuse(p.get(), sb.get(), camp, params)) {
+                sb = std::move(p);
+                break;
+            }
+        }
+
+        sbs.push_back(std::move(sb));
+    }
+
+    for (std::unique_ptr<StreamBuffers> &p : *prev) {
+        if (p != NULL) {
+            free_stream_buffers(p.get());
+        }
+    }
+    prev->clear();
+
+    // when an arena cannot be allocated, the CMA pool may still have room
+    // for smaller allocations.
+    for (std::unique_ptr<StreamBuffers> &sb : sbs) {
+        if (sb->enabled && sb->buffers.empty() && params->buffer_arena &&
+            !alloc_arena(camp, sb.get(), allocator_fd)) {
+            fprintf(stderr, "unable to allocate a buffer arena, allocating "
+                            "buffers one by one\n");
+        }
+    }
+
+    camp->stream_buffers = std::move(sbs);
+}
+
+// create a request and attach buffers to it, allocating them when needed.
+static bool add_request(CameraPriv *camp, int allocator_fd) {
+    unsigned int index = camp->requests.size();
+    CameraFrame *frame = &camp->frames[index];
+    frame->camp = camp;
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        frame->outputs[i].mapped = NULL;
+        frame->outputs[i].fd = -1;
+        frame->outputs[i].offset = 0;
+    }
+    frame->buffers.clear();
+    frame->consumers = 0;
+    frame->queued = false;
+
+    std::unique_ptr<Request> request =
+        camp->camera->createRequest((uint64_t)frame);
+    if (request == NULL) {
+        set_error("createRequest() failed");
         return false;
     }
+    frame->request = request.get();
+
+    for (std::unique_ptr<StreamBuffers> &sb : camp->stream_buffers) {
+        if (!sb->enabled) {
+            frame->buffers.push_back(NULL);
+            continue;
+        }
+
+        if (index >= sb->buffers.size() &&
+            !add_stream_buffer(sb.get(), allocator_fd)) {
+            return false;
+        }
+
+        frame->buffers.push_back(sb->buffers[index].get());
+        if (sb->id >= 0) {
+            frame->outputs[sb->id] = sb->outputs[index];
+        }
+    }
+
+    camp->requests.push_back(std::move(request));
+    return true;
+}
+
+// whether buffers of a stream must be mapped. In low memory mode, only
+// streams that are read by the CPU are mapped: the ones with an overlay, a
+// software encoder or scaled streams. Since the overlay can only be drawn on
+// mapped buffers, enabling it requires the camera to be reconfigured.
+static bool is_stream_mapped(const parameters_t *params, int id) {
+    if (!params->low_memory) {
+        return true;
+    }
+
+    const char *codec = params->streams[id].codec;
+    if (codec == NULL || strcmp(codec, "hardwareH264") != 0) {
+        return true;
+    }
+
+    if (id == 0 && params->text_overlay_enable) {
+        return true;
+    }
+
+    for (unsigned int i = 0; i < params->stream_count; i++) {
+        if (params->streams[i].scale_levels != 0 &&
+            (int)params->streams[i].scale_source == id) {
+            return true;
+        }
+    }
 
+    return false;
+}
+
+// configure the camera and its streams. It can be called again when the
+// camera is stopped and its requests have been freed.
+static bool configure(CameraPriv *camp, const parameters_t *params) {
+    camp->streams.clear();
+    camp->stream_ids.clear();
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        camp->output_streams[i] = NULL;
+        camp->pipe_ids[i] = ((unsigned int)i < params->stream_count)
+                                ? params->streams[i].id
+                                : i;
+    }
+
+    // the ISP has a limited number of outputs, therefore configurations with
+    // too many streams are rejected by libcamera.
     std::vector<StreamRole> stream_roles = {StreamRole::VideoRecording};
     if (params->mode != NULL) {
         stream_roles.push_back(StreamRole::Raw);
     }
-    if (params->secondary_width != 0) {
-        stream_roles.push_back(StreamRole::Viewfinder);
+    unsigned int output_count = 1;
+    // scaled streams are produced by the CPU and are not outputs of the ISP.
+    for (unsigned int i = 1; i < params->stream_count; i++) {
+        if (params->streams[i].width != 0 &&
+            params->streams[i].scale_levels == 0) {
+            stream_roles.push_back(StreamRole::Viewfinder);
+            output_count++;
+        }
     }
 
     std::unique_ptr<CameraConfiguration> conf =
         camp->camera->generateConfiguration(stream_roles);
     if (conf == NULL) {
-        set_error("Camera.generateConfiguration() failed");
+        set_error("Camera.generateConfiguration() failed, the camera may not "
+                  "support %u output streams", output_count);
         return false;
     }
 
     int cur_stream = 0;
 
     StreamConfiguration &video_stream_conf = conf->at(cur_stream++);
+    camp->stream_ids.push_back(0);
     video_stream_conf.size = Size(params->width, params->height);
     video_stream_conf.pixelFormat = formats::YUV420;
-    video_stream_conf.bufferCount = params->buffer_count;
+    // in adaptive mode, libcamera must be able to handle all the buffers
+    // that may be added later.
+    video_stream_conf.bufferCount = (params->buffer_count != 0)
+                                        ? params->buffer_count
+                                        : ADAPTIVE_MAX_BUFFER_COUNT;
     if (params->width >= 1280 || params->height >= 720) {
         video_stream_conf.colorSpace = ColorSpace::Rec709;
     } else {
@@ -242,15 +601,24 @@ bool camera_create(const parameters_t *params, camera_frame_cb frame_cb,
         StreamConfiguration &raw_stream_conf = conf->at(cur_stream++);
         raw_stream_conf.size = Size(params->mode->width, params->mode->height);
         raw_stream_conf.pixelFormat = mode_to_pixel_format(params->mode);
-        raw_stream_conf.bufferCount = video_stream_conf.bufferCount;
+        // in low memory mode, raw frames are written into internal buffers
+        // of the pipeline handler, whose number depends on this value.
+        raw_stream_conf.bufferCount =
+            params->low_memory ? 1 : video_stream_conf.bufferCount;
+        camp->stream_ids.push_back(-1);
     }
 
-    if (params->secondary_width != 0) {
-        StreamConfiguration &secondary_stream_conf = conf->at(cur_stream++);
-        secondary_stream_conf.size =
-            Size(params->secondary_width, params->secondary_height);
-        secondary_stream_conf.bufferCount = video_stream_conf.bufferCount;
-        secondary_stream_conf.pixelFormat = formats::YUV420;
+    for (unsigned int i = 1; i < params->stream_count; i++) {
+        const parameters_stream_t *stream = &params->streams[i];
+        if (stream->width == 0 || stream->scale_levels != 0) {
+            continue;
+        }
+
+        StreamConfiguration &stream_conf = conf->at(cur_stream++);
+        stream_conf.size = Size(stream->width, stream->height);
+        stream_conf.bufferCount = video_stream_conf.bufferCount;
+        stream_conf.pixelFormat = formats::YUV420;
+        camp->stream_ids.push_back(i);
     }
 
     conf->orientation = Orientation::Rotate0;
@@ -273,291 +641,653 @@ bool camera_create(const parameters_t *params, camera_frame_cb frame_cb,
         return false;
     }
 
-    camp->video_stream = video_stream_conf.stream();
-
-    if (params->secondary_width != 0) {
-        StreamConfiguration &secondary_stream_conf = conf->at(cur_stream - 1);
-        camp->secondary_stream = secondary_stream_conf.stream();
+    for (unsigned int i = 0; i < conf->size(); i++) {
+        Stream *stream = conf->at(i).stream();
+        camp->streams.push_back(stream);
+        if (camp->stream_ids[i] >= 0) {
+            camp->output_streams[camp->stream_ids[i]] = stream;
+        }
     }
 
-    for (unsigned int i = 0; i < params->buffer_count; i++) {
-        std::unique_ptr<Request> request =
-            camp->camera->createRequest((uint64_t)camp.get());
-        if (request == NULL) {
-            set_error("createRequest() failed");
-            return false;
-        }
-        camp->requests.push_back(std::move(request));
+    camp->raw_buffers = !params->low_memory;
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        camp->mapped_streams[i] = is_stream_mapped(params, i);
     }
 
+    camp->max_buffer_count = max_buffer_count(camp, params);
+    return true;
+}
+
+// create buffer_count requests and their buffers, reusing the buffers in
+// prev when possible.
+static bool allocate(CameraPriv *camp, const parameters_t *params,
+                     unsigned int buffer_count,
+                     std::vector<std::unique_ptr<StreamBuffers>> *prev) {
+    camp->frames = std::make_unique<CameraFrame[]>(camp->max_buffer_count);
+
     // allocate DMA buffers manually instead of using default buffers provided
     // by libcamera. this improves performance by a lot.
     // https://forums.raspberrypi.com/viewtopic.php?t=352554
     // https://github.com/raspberrypi/rpicam-apps/blob/6de1ab6a899df35f929b2a15c0831780bd8e750e/core/rpicam_app.cpp#L1012
 
-    int allocator_fd = create_dma_allocator();
+    int allocator_fd = dma_heap_open();
     if (allocator_fd < 0) {
         set_error("failed to open dma heap allocator");
         return false;
     }
 
-    for (StreamConfiguration &stream_conf : *conf) {
-        Stream *stream = stream_conf.stream();
+    init_stream_buffers(camp, params, prev, allocator_fd);
 
-        for (unsigned int i = 0; i < params->buffer_count; i++) {
-            struct dma_heap_allocation_data alloc = {};
-            alloc.len = stream_conf.frameSize;
-            alloc.fd_flags = O_CLOEXEC | O_RDWR;
-            int ret = ioctl(allocator_fd, DMA_HEAP_IOCTL_ALLOC, &alloc);
-            if (ret < 0) {
-                set_error("failed to allocate buffer in dma heap");
-                return false;
-            }
-            UniqueFD fd(alloc.fd);
-
-            std::vector<FrameBuffer::Plane> plane(1);
-            plane[0].fd = SharedFD(std::move(fd));
-            plane[0].offset = 0;
-            plane[0].length = stream_conf.frameSize;
-
-            camp->frame_buffers.push_back(std::make_unique<FrameBuffer>(plane));
-            FrameBuffer *fb = camp->frame_buffers.back().get();
-
-            if (stream == camp->video_stream ||
-                stream == camp->secondary_stream) {
-                camp->mapped_buffers[fb] = (uint8_t *)mmap(
-                    NULL, stream_conf.frameSize, PROT_READ | PROT_WRITE,
-                    MAP_SHARED, plane[0].fd.get(), 0);
-            }
-
-            res = camp->requests.at(i)->addBuffer(stream, fb);
-            if (res != 0) {
-                set_error("addBuffer() failed");
-                return false;
-            }
+    for (unsigned int i = 0; i < buffer_count; i++) {
+        if (!add_request(camp, allocator_fd)) {
+            close(allocator_fd);
+            return false;
         }
     }
 
     close(allocator_fd);
-
-    camp->frame_cb = frame_cb;
-    camp->error_cb = error_cb;
-    camp->secondary_deltat = (long)(1000000000.0 / params->secondary_fps);
-    clock_gettime(CLOCK_MONOTONIC, &camp->last_secondary_frame_time);
-    *cam = camp.release();
-
     return true;
 }
 
-static void on_request_complete(Request *request) {
-    CameraPriv *camp = (CameraPriv *)request->cookie();
+bool camera_create(const parameters_t *params, camera_frame_cb frame_cb,
+                   camera_error_cb error_cb, camera_t **cam) {
+    std::unique_ptr<CameraPriv> camp = std::make_unique<CameraPriv>();
 
-    if (camp->in_error) {
-        return;
-    }
+    set_hdr(params->hdr);
 
-    if (request->status() == Request::RequestCancelled) {
-        camp->in_error = true;
-        camp->error_cb();
-        return;
+    if (strcmp(params->log_level, "debug") == 0) {
+        setenv("LIBCAMERA_LOG_LEVELS", "*:DEBUG", 1);
+    } else if (strcmp(params->log_level, "info") == 0) {
+        setenv("LIBCAMERA_LOG_LEVELS", "*:INFO", 1);
+    } else if (strcmp(params->log_level, "warn") == 0) {
+        setenv("LIBCAMERA_LOG_LEVELS", "*:WARN", 1);
+    } else { // error
+        setenv("LIBCAMERA_LOG_LEVELS", "*:ERROR", 1);
     }
 
-    FrameBuffer *buffer = request->buffers().at(camp->video_stream);
-
-    uint8_t *secondary_buffer_mapped = NULL;
-    int secondary_buffer_fd = 0;
-
-    if (camp->secondary_stream != NULL) {
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
+    // We make sure to set the environment variable before libcamera init
+    setenv("LIBCAMERA_RPI_TUNING_FILE", params->tuning_file, 1);
 
-        long diff = timespec_sub(&now, &camp->last_secondary_frame_time);
+    camp->camera_manager = get_camera_manager();
+    if (camp->camera_manager == NULL) {
+        set_error("CameraManager.start() failed");
+        return false;
+    }
 
-        if (diff >= camp->secondary_deltat) {
-            timespec_add(&camp->last_secondary_frame_time,
-                         camp->secondary_deltat);
-            FrameBuffer *secondary_buffer =
-                request->buffers().at(camp->secondary_stream);
-            secondary_buffer_mapped = camp->mapped_buffers.at(secondary_buffer);
-            secondary_buffer_fd = secondary_buffer->planes()[0].fd.get();
-        }
+    std::vector<std::shared_ptr<Camera>> cameras =
+        get_cameras(camp->camera_manager.get());
+    if (params->camera_id >= cameras.size()) {
+        set_error("selected camera is not available");
+        return false;
     }
 
-    uint64_t dts = buffer->metadata().timestamp / 1000;
+    camp->camera = camp->camera_manager->get(cameras[params->camera_id]->id());
+    if (camp->camera == NULL) {
+        set_error("CameraManager.get() failed");
+        return false;
+    }
 
-    struct timespec dts_now_ts;
-    clock_gettime(CLOCK_MONOTONIC, &dts_now_ts);
-    uint64_t dts_now =
-        (uint64_t)dts_now_ts.tv_sec * 1000000 + dts_now_ts.tv_nsec / 1000;
+    int ret = camp->camera->acquire();
+    if (ret != 0) {
+        set_error("Camera.acquire() failed");
+        return false;
+    }
 
-    struct timespec ntp_ts;
-    clock_gettime(CLOCK_REALTIME, &ntp_ts);
-    uint64_t ntp = (uint64_t)ntp_ts.tv_sec * 1000000 + ntp_ts.tv_nsec / 1000;
+    if (!configure(camp.get(), params)) {
+        return false;
+    }
 
-    // improve NTP precision by subtracting the difference between now and the
-    // moment the frame was taken
-    ntp -= dts_now - dts;
+    // no buffers are reused, hence the list is empty.
+    std::vector<std::unique_ptr<StreamBuffers>> prev;
+    unsigned int buffer_count = (params->buffer_count != 0)
+                                    ? params->buffer_count
+                                    : ADAPTIVE_MIN_BUFFER_COUNT;
+    if (!allocate(camp.get(), params, buffer_count, &prev)) {
+        return false;
+    }
 
-    camp->frame_cb(camp->mapped_buffers.at(buffer),
-                   buffer->planes()[0].fd.get(), dts, ntp,
-                   secondary_buffer_mapped, secondary_buffer_fd);
+    camp->frame_cb = frame_cb;
+    camp->error_cb = error_cb;
+    camp->state_enabled = (params->state_file != NULL);
+    camp->frame_duration = (int64_t)(1000000000.0 / params->fps);
+    for (unsigned int i = 1; i < params->stream_count; i++) {
+        camp->schedules[i].fps = (uint64_t)(params->streams[i].fps * 1000);
+    }
+    *cam = camp.release();
 
-    request->reuse(Request::ReuseFlag::ReuseBuffers);
+    return true;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(camp->ctrls_mutex);
-        request->controls().merge(
-            *camp->ctrls,
-            libcamera::ControlList::MergePolicy::OverwriteExisting);
-        camp->ctrls->clear();
+// get a list where control changes can be written. It contains changes that
+// have not been picked up yet. Must be followed by publish_controls().
+// Called by the main thread only.
+static ControlList *begin_controls(CameraPriv *camp) {
+    ControlList *ctrls = camp->pending_ctrls.exchange(nullptr);
+    if (ctrls != nullptr) {
+        return ctrls;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(camp->stopped_mutex);
-        if (!camp->stopped) {
-            camp->camera->queueRequest(request);
-        }
+    ctrls = camp->spare_ctrls.exchange(nullptr);
+    if (ctrls != nullptr) {
+        return ctrls;
     }
-}
 
-int camera_get_frame_size(camera_t *cam) {
-    CameraPriv *camp = (CameraPriv *)cam;
-    return camp->video_stream->configuration().frameSize;
+    return new ControlList(controls::controls);
 }
 
-int camera_get_secondary_frame_size(camera_t *cam) {
-    CameraPriv *camp = (CameraPriv *)cam;
-    return camp->secondary_stream->configuration().frameSize;
+static void publish_controls(CameraPriv *camp, ControlList *ctrls) {
+    camp->pending_ctrls.store(ctrls, std::memory_order_release);
 }
 
-int camera_get_stride(camera_t *cam) {
-    CameraPriv *camp = (CameraPriv *)cam;
-    return camp->video_stream->configuration().stride;
-}
+// move pending control changes into dest. When nothing changed, it costs an
+// atomic load and never blocks.
+static void take_controls(CameraPriv *camp, ControlList *dest) {
+    if (camp->pending_ctrls.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
 
-int camera_get_secondary_stride(camera_t *cam) {
-    CameraPriv *camp = (CameraPriv *)cam;
-    return camp->secondary_stream->configuration().stride;
-}
+    ControlList *ctrls = camp->pending_ctrls.exchange(nullptr);
+    if (ctrls == nullptr) {
+        return;
+    }
 
-int camera_get_colorspace(camera_t *cam) {
-    CameraPriv *camp = (CameraPriv *)cam;
-    return get_v4l2_colorspace(camp->video_stream->configuration().colorSpace);
-}
+    dest->merge(*ctrls, libcamera::ControlList::MergePolicy::OverwriteExisting);
+    ctrls->clear();
 
-int camera_get_secondary_colorspace(camera_t *cam) {
-    CameraPriv *camp = (CameraPriv *)cam;
-    return get_v4l2_colorspace(
-        camp->secondary_stream->configuration().colorSpace);
+    delete camp->spare_ctrls.exchange(ctrls);
 }
 
-static void fill_dynamic_controls(ControlList *ctrls,
-                                  const parameters_t *params) {
-    ctrls->set(controls::Brightness, params->brightness);
-    ctrls->set(controls::Contrast, params->contrast);
-    ctrls->set(controls::Saturation, params->saturation);
-    ctrls->set(controls::Sharpness, params->sharpness);
-
-    int exposure_mode;
-    if (strcmp(params->exposure, "short") == 0) {
-        exposure_mode = controls::ExposureShort;
-    } else if (strcmp(params->exposure, "long") == 0) {
-        exposure_mode = controls::ExposureLong;
-    } else if (strcmp(params->exposure, "custom") == 0) {
-        exposure_mode = controls::ExposureCustom;
-    } else {
-        exposure_mode = controls::ExposureNormal;
-    }
-    ctrls->set(controls::AeExposureMode, exposure_mode);
-
-    if (params->flicker_period != 0) {
-        ctrls->set(controls::AeFlickerMode, controls::FlickerManual);
-        ctrls->set(controls::AeFlickerPeriod, params->flicker_period);
-    } else {
-        ctrls->set(controls::AeFlickerMode, controls::FlickerOff);
-    }
-
-    int awb_mode;
-    if (strcmp(params->awb, "incandescent") == 0) {
-        awb_mode = controls::AwbIncandescent;
-    } else if (strcmp(params->awb, "tungsten") == 0) {
-        awb_mode = controls::AwbTungsten;
-    } else if (strcmp(params->awb, "fluorescent") == 0) {
-        awb_mode = controls::AwbFluorescent;
-    } else if (strcmp(params->awb, "indoor") == 0) {
-        awb_mode = controls::AwbIndoor;
-    } else if (strcmp(params->awb, "daylight") == 0) {
-        awb_mode = controls::AwbDaylight;
-    } else if (strcmp(params->awb, "cloudy") == 0) {
-        awb_mode = controls::AwbCloudy;
-    } else if (strcmp(params->awb, "custom") == 0) {
-        awb_mode = controls::AwbCustom;
-    } else {
-        awb_mode = controls::AwbAuto;
+// decide whether the frame with the given sensor timestamp must include a
+// stream. The schedule is advanced by the frame period of the stream, and
+// the remainder of the division is accumulated, so that it doesn't drift.
+// stopped_mutex must be held.
+static bool schedule_stream(CameraPriv *camp, StreamSchedule *sched,
+                            int64_t ts) {
+    uint64_t fps = sched->fps;
+    if (fps == 0) {
+        return true;
     }
-    ctrls->set(controls::AwbMode, awb_mode);
 
-    ctrls->set(
-        controls::ColourGains,
-        Span<const float, 2>({params->awb_gain_red, params->awb_gain_blue}));
+    int64_t period = STREAM_PERIOD_NUM / fps;
+    int64_t tolerance = camp->frame_duration / 2;
 
-    int denoise_mode;
-    if (strcmp(params->denoise, "cdn_off") == 0) {
-        denoise_mode = controls::draft::NoiseReductionModeMinimal;
-    } else if (strcmp(params->denoise, "cdn_hq") == 0) {
-        denoise_mode = controls::draft::NoiseReductionModeHighQuality;
-    } else if (strcmp(params->denoise, "cdn_fast") == 0) {
-        denoise_mode = controls::draft::NoiseReductionModeFast;
-    } else {
-        denoise_mode = controls::draft::NoiseReductionModeOff;
+    // the schedule is too far in the future after a change of frame rate.
+    if (sched->next > ts + period + tolerance) {
+        sched->next = ts;
+        sched->rem = 0;
     }
-    ctrls->set(controls::draft::NoiseReductionMode, denoise_mode);
 
-    if (params->shutter != 0.f) {
-        ctrls->set(controls::ExposureTimeMode,
-                   controls::ExposureTimeModeManual);
-        ctrls->set(controls::ExposureTime, params->shutter);
-    } else {
-        ctrls->set(controls::ExposureTimeMode, controls::ExposureTimeModeAuto);
+    if (ts + tolerance < sched->next) {
+        return false;
     }
 
-    int metering_mode;
-    if (strcmp(params->metering, "spot") == 0) {
-        metering_mode = controls::MeteringSpot;
-    } else if (strcmp(params->metering, "matrix") == 0) {
-        metering_mode = controls::MeteringMatrix;
-    } else if (strcmp(params->metering, "custom") == 0) {
-        metering_mode = controls::MeteringCustom;
-    } else {
-        metering_mode = controls::MeteringCentreWeighted;
+    sched->next += period;
+    sched->rem += STREAM_PERIOD_NUM % fps;
+    if (sched->rem >= (int64_t)fps) {
+        sched->next++;
+        sched->rem -= fps;
     }
-    ctrls->set(controls::AeMeteringMode, metering_mode);
 
-    if (params->gain != 0.f) {
-        ctrls->set(controls::AnalogueGainMode,
-                   controls::AnalogueGainModeManual);
-        ctrls->set(controls::AnalogueGain, params->gain);
-    } else {
-        ctrls->set(controls::AnalogueGainMode, controls::AnalogueGainModeAuto);
+    // the schedule is in the past after a pause or a frame drop.
+    if (sched->next + tolerance <= ts) {
+        sched->next = ts + period;
+        sched->rem = 0;
     }
 
-    ctrls->set(controls::ExposureValue, params->ev);
-
-    int64_t frame_time = (int64_t)(((float)1000000) / params->fps);
-    ctrls->set(controls::FrameDurationLimits,
-               Span<const int64_t, 2>({frame_time, frame_time}));
+    return true;
 }
 
-bool camera_start(camera_t *cam, parameters_t *params) {
-    CameraPriv *camp = (CameraPriv *)cam;
+// give a request back to libcamera, or keep it aside while paused.
+// Buffers of streams other than the primary one are added only when the
+// frame is going to be encoded, in order not to waste ISP time and memory
+// bandwidth.
+// stopped_mutex must be held.
+static bool requeue(CameraPriv *camp, CameraFrame *frame) {
+    if (camp->stopped || camp->recovering || frame->queued) {
+        return true;
+    }
 
-    camp->ctrls = std::make_unique<ControlList>(controls::controls);
+    frame->predicted_ts = camp->next_ts;
+    camp->next_ts += camp->frame_duration;
 
-    fill_dynamic_controls(camp->ctrls.get(), params);
+    int64_t ts = frame->predicted_ts + camp->ts_offset;
 
-    if (camp->camera->controls().count(&controls::AfMode) > 0) {
-        if (params->af_window != NULL) {
-            std::optional<Rectangle> opt =
+    Request *request = frame->request;
+    request->reuse();
+
+    for (unsigned int i = 0; i < camp->streams.size(); i++) {
+        int id = camp->stream_ids[i];
+        if (id >= 1 && !schedule_stream(camp, &camp->schedules[id], ts)) {
+            continue;
+        }
+        if (frame->buffers[i] == NULL) {
+            continue;
+        }
+        request->addBuffer(camp->streams[i], frame->buffers[i]);
+    }
+
+    if (camp->auto_ctrls != nullptr) {
+        request->controls().merge(*camp->auto_ctrls);
+        camp->auto_ctrls.reset();
+    }
+
+    take_controls(camp, &request->controls());
+
+    frame->queued = true;
+
+    if (camp->paused) {
+        camp->idle_requests.push_back(request);
+        return true;
+    }
+
+    return (camp->camera->queueRequest(request) == 0);
+}
+
+// record the AE/AWB state once AE has converged, at most once per second.
+static void record_state(CameraPriv *camp, const ControlList &metadata) {
+    uint64_t now = monotonic_us();
+    if ((now - camp->state_time) < 1000000) {
+        return;
+    }
+
+    std::optional<int32_t> ae_state = metadata.get(controls::AeState);
+    if (!ae_state || *ae_state != controls::AeStateConverged) {
+        return;
+    }
+
+    std::optional<int32_t> exposure_time = metadata.get(controls::ExposureTime);
+    std::optional<float> analogue_gain = metadata.get(controls::AnalogueGain);
+    auto colour_gains = metadata.get(controls::ColourGains);
+    if (!exposure_time || !analogue_gain || !colour_gains) {
+        return;
+    }
+    std::optional<float> lux = metadata.get(controls::Lux);
+
+    camp->state_time = now;
+
+    std::lock_guard<std::mutex> lock(camp->state_mutex);
+    camp->state.exposure_time = *exposure_time;
+    camp->state.analogue_gain = *analogue_gain;
+    camp->state.colour_gains[0] = (*colour_gains)[0];
+    camp->state.colour_gains[1] = (*colour_gains)[1];
+    camp->state.lux = lux ? *lux : 0.0f;
+    camp->state_changed = true;
+}
+
+static void on_request_complete(Request *request) {
+    CameraFrame *frame = (CameraFrame *)request->cookie();
+    CameraPriv *camp = frame->camp;
+
+    {
+        std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+        frame->queued = false;
+
+        // requests are cancelled when the camera is stopped on purpose.
+        if (request->status() == Request::RequestCancelled &&
+            (camp->stopped || camp->recovering)) {
+            return;
+        }
+
+        if (request->status() == Request::RequestComplete) {
+            int64_t ts = request->buffers()
+                             .at(camp->output_streams[0])
+                             ->metadata()
+                             .timestamp;
+            camp->ts_offset = ts - frame->predicted_ts;
+
+            std::optional<int64_t> duration =
+                request->metadata().get(controls::FrameDuration);
+            if (duration) {
+                camp->frame_duration = *duration * 1000;
+            }
+        }
+    }
+
+    if (camp->in_error) {
+        return;
+    }
+
+    if (request->status() == Request::RequestCancelled) {
+        camp->in_error = true;
+        camp->error_cb((camera_t *)camp);
+        return;
+    }
+
+    if (!camp->thread_registered) {
+        stats_register_thread("camera");
+        camp->thread_registered = true;
+    }
+
+    FrameBuffer *buffer = request->buffers().at(camp->output_streams[0]);
+    stats_frame_captured(camp->pipe_ids[0], buffer->metadata().sequence);
+
+    if (camp->state_enabled) {
+        record_state(camp, request->metadata());
+    }
+
+    camp->last_frame_time = monotonic_us();
+
+    uint64_t recovery_start = camp->recovery_start.exchange(0);
+    if (recovery_start != 0) {
+        uint64_t recovery_time = monotonic_us() - recovery_start;
+        fprintf(stderr, "camera recovered in %llu us\n",
+                (unsigned long long)recovery_time);
+        stats_recovered(recovery_time);
+        camp->failed_recoveries = 0;
+        camp->last_sequence_set = false;
+    }
+
+    uint64_t resume_time = camp->resume_time.exchange(0);
+    if (resume_time != 0) {
+        uint64_t ttff = monotonic_us() - resume_time;
+        fprintf(stderr, "first frame received %llu us after resume\n",
+                (unsigned long long)ttff);
+        stats_resumed(ttff);
+        camp->last_sequence_set = false;
+    }
+
+    // frames that are dropped because no request is available cause gaps in
+    // sequence numbers.
+    uint32_t sequence = buffer->metadata().sequence;
+    if (camp->last_sequence_set && sequence > camp->last_sequence + 1) {
+        camp->sequence_gaps += sequence - camp->last_sequence - 1;
+    }
+    camp->last_sequence = sequence;
+    camp->last_sequence_set = true;
+
+    // buffers are passed to consumers indexed by pipe ID.
+    camera_buffer_t buffers[PARAMETERS_MAX_STREAMS];
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        buffers[i].mapped = NULL;
+        buffers[i].fd = -1;
+        buffers[i].offset = 0;
+    }
+
+    buffers[camp->pipe_ids[0]] = frame->outputs[0];
+
+    for (int i = 1; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (camp->output_streams[i] != NULL &&
+            request->findBuffer(camp->output_streams[i]) != NULL) {
+            buffers[camp->pipe_ids[i]] = frame->outputs[i];
+            stats_frame_captured(camp->pipe_ids[i], 0);
+        }
+    }
+
+    uint64_t dts = buffer->metadata().timestamp / 1000;
+
+    struct timespec dts_now_ts;
+    clock_gettime(CLOCK_MONOTONIC, &dts_now_ts);
+    uint64_t dts_now =
+        (uint64_t)dts_now_ts.tv_sec * 1000000 + dts_now_ts.tv_nsec / 1000;
+
+    struct timespec ntp_ts;
+    clock_gettime(CLOCK_REALTIME, &ntp_ts);
+    uint64_t ntp = (uint64_t)ntp_ts.tv_sec * 1000000 + ntp_ts.tv_nsec / 1000;
+
+    // improve NTP precision by subtracting the difference between now and the
+    // moment the frame was taken
+    ntp -= dts_now - dts;
+
+    // the request is queued again when the last consumer releases the frame,
+    // that may happen in this thread or in a consumer thread.
+    frame->consumers = CAMERA_CONSUMER_CAMERA;
+
+    camp->frame_cb(frame, dts, ntp, buffers);
+
+    camera_frame_release(frame, CAMERA_CONSUMER_CAMERA);
+}
+
+// register a consumer of a frame. It must be called inside frame_cb.
+void camera_frame_acquire(camera_frame_t *frame, int consumer) {
+    CameraFrame *f = (CameraFrame *)frame;
+    f->consumers.fetch_or(consumer);
+}
+
+// unregister a consumer of a frame. Can be called by any thread.
+void camera_frame_release(camera_frame_t *frame, int consumer) {
+    CameraFrame *f = (CameraFrame *)frame;
+
+    unsigned int prev = f->consumers.fetch_and(~(unsigned int)consumer);
+    if (prev != (unsigned int)consumer) {
+        return;
+    }
+
+    CameraPriv *camp = f->camp;
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+    requeue(camp, f);
+}
+
+// find the output stream that has the given pipe ID.
+static int stream_id(CameraPriv *camp, int pipe_id) {
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (camp->output_streams[i] != NULL && camp->pipe_ids[i] == pipe_id) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+int camera_get_frame_size(camera_t *cam, int stream) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    Stream *s = camp->output_streams[stream_id(camp, stream)];
+    return s->configuration().frameSize;
+}
+
+int camera_get_stride(camera_t *cam, int stream) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    Stream *s = camp->output_streams[stream_id(camp, stream)];
+    return s->configuration().stride;
+}
+
+int camera_get_colorspace(camera_t *cam, int stream) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    Stream *s = camp->output_streams[stream_id(camp, stream)];
+    return get_v4l2_colorspace(s->configuration().colorSpace);
+}
+
+// set the controls that correspond to the parameters in diff.
+static void fill_dynamic_controls(ControlList *ctrls,
+                                  const parameters_t *params, uint64_t diff) {
+    if ((diff & PARAMETERS_BRIGHTNESS) != 0) {
+        ctrls->set(controls::Brightness, params->brightness);
+    }
+    if ((diff & PARAMETERS_CONTRAST) != 0) {
+        ctrls->set(controls::Contrast, params->contrast);
+    }
+    if ((diff & PARAMETERS_SATURATION) != 0) {
+        ctrls->set(controls::Saturation, params->saturation);
+    }
+    if ((diff & PARAMETERS_SHARPNESS) != 0) {
+        ctrls->set(controls::Sharpness, params->sharpness);
+    }
+
+    if ((diff & PARAMETERS_EXPOSURE) != 0) {
+        int exposure_mode;
+        if (strcmp(params->exposure, "short") == 0) {
+            exposure_mode = controls::ExposureShort;
+        } else if (strcmp(params->exposure, "long") == 0) {
+            exposure_mode = controls::ExposureLong;
+        } else if (strcmp(params->exposure, "custom") == 0) {
+            exposure_mode = controls::ExposureCustom;
+        } else {
+            exposure_mode = controls::ExposureNormal;
+        }
+        ctrls->set(controls::AeExposureMode, exposure_mode);
+    }
+
+    if ((diff & PARAMETERS_FLICKER_PERIOD) != 0) {
+        if (params->flicker_period != 0) {
+            ctrls->set(controls::AeFlickerMode, controls::FlickerManual);
+            ctrls->set(controls::AeFlickerPeriod, params->flicker_period);
+        } else {
+            ctrls->set(controls::AeFlickerMode, controls::FlickerOff);
+        }
+    }
+
+    if ((diff & PARAMETERS_AWB) != 0) {
+        int awb_mode;
+        if (strcmp(params->awb, "incandescent") == 0) {
+            awb_mode = controls::AwbIncandescent;
+        } else if (strcmp(params->awb, "tungsten") == 0) {
+            awb_mode = controls::AwbTungsten;
+        } else if (strcmp(params->awb, "fluorescent") == 0) {
+            awb_mode = controls::AwbFluorescent;
+        } else if (strcmp(params->awb, "indoor") == 0) {
+            awb_mode = controls::AwbIndoor;
+        } else if (strcmp(params->awb, "daylight") == 0) {
+            awb_mode = controls::AwbDaylight;
+        } else if (strcmp(params->awb, "cloudy") == 0) {
+            awb_mode = controls::AwbCloudy;
+        } else if (strcmp(params->awb, "custom") == 0) {
+            awb_mode = controls::AwbCustom;
+        } else {
+            awb_mode = controls::AwbAuto;
+        }
+        ctrls->set(controls::AwbMode, awb_mode);
+    }
+
+    if ((diff & PARAMETERS_AWB_GAINS) != 0) {
+        ctrls->set(controls::ColourGains,
+                   Span<const float, 2>(
+                       {params->awb_gain_red, params->awb_gain_blue}));
+    }
+
+    if ((diff & PARAMETERS_DENOISE) != 0) {
+        int denoise_mode;
+        if (strcmp(params->denoise, "cdn_off") == 0) {
+            denoise_mode = controls::draft::NoiseReductionModeMinimal;
+        } else if (strcmp(params->denoise, "cdn_hq") == 0) {
+            denoise_mode = controls::draft::NoiseReductionModeHighQuality;
+        } else if (strcmp(params->denoise, "cdn_fast") == 0) {
+            denoise_mode = controls::draft::NoiseReductionModeFast;
+        } else {
+            denoise_mode = controls::draft::NoiseReductionModeOff;
+        }
+        ctrls->set(controls::draft::NoiseReductionMode, denoise_mode);
+    }
+
+    if ((diff & PARAMETERS_SHUTTER) != 0) {
+        if (params->shutter != 0.f) {
+            ctrls->set(controls::ExposureTimeMode,
+                       controls::ExposureTimeModeManual);
+            ctrls->set(controls::ExposureTime, params->shutter);
+        } else {
+            ctrls->set(controls::ExposureTimeMode,
+                       controls::ExposureTimeModeAuto);
+        }
+    }
+
+    if ((diff & PARAMETERS_METERING) != 0) {
+        int metering_mode;
+        if (strcmp(params->metering, "spot") == 0) {
+            metering_mode = controls::MeteringSpot;
+        } else if (strcmp(params->metering, "matrix") == 0) {
+            metering_mode = controls::MeteringMatrix;
+        } else if (strcmp(params->metering, "custom") == 0) {
+            metering_mode = controls::MeteringCustom;
+        } else {
+            metering_mode = controls::MeteringCentreWeighted;
+        }
+        ctrls->set(controls::AeMeteringMode, metering_mode);
+    }
+
+    if ((diff & PARAMETERS_GAIN) != 0) {
+        if (params->gain != 0.f) {
+            ctrls->set(controls::AnalogueGainMode,
+                       controls::AnalogueGainModeManual);
+            ctrls->set(controls::AnalogueGain, params->gain);
+        } else {
+            ctrls->set(controls::AnalogueGainMode,
+                       controls::AnalogueGainModeAuto);
+        }
+    }
+
+    if ((diff & PARAMETERS_EV) != 0) {
+        ctrls->set(controls::ExposureValue, params->ev);
+    }
+
+    if ((diff & PARAMETERS_FPS) != 0) {
+        int64_t frame_time = (int64_t)(((float)1000000) / params->fps);
+        ctrls->set(controls::FrameDurationLimits,
+                   Span<const int64_t, 2>({frame_time, frame_time}));
+    }
+}
+
+// convert a normalized window into a rectangle of the sensor area.
+static bool window_to_rectangle(CameraPriv *camp, const window_t *window,
+                                Rectangle *rect) {
+    std::optional<Rectangle> opt =
+        camp->camera->properties().get(properties::ScalerCropMaximum);
+    Rectangle sensor_area;
+    try {
+        sensor_area = opt.value();
+    } catch (const std::bad_optional_access &exc) {
+        set_error("get(ScalerCropMaximum) failed");
+        return false;
+    }
+
+    *rect = Rectangle(window->x * sensor_area.width,
+                      window->y * sensor_area.height,
+                      window->width * sensor_area.width,
+                      window->height * sensor_area.height);
+    rect->translateBy(sensor_area.topLeft());
+    return true;
+}
+
+// crop each output stream independently. ScalerCrops takes a rectangle for
+// each output stream, in the order of stream configurations, and is
+// available on Raspberry Pi 5 only.
+static bool fill_stream_crops(CameraPriv *camp, ControlList *ctrls,
+                              const parameters_t *params) {
+    bool has_crops = false;
+    for (unsigned int i = 0; i < params->stream_count; i++) {
+        if (params->streams[i].width != 0 && params->streams[i].crop != NULL) {
+            has_crops = true;
+        }
+    }
+    if (!has_crops) {
+        return true;
+    }
+
+    if (camp->camera->controls().count(&controls::rpi::ScalerCrops) == 0) {
+        fprintf(stderr, "per-stream crops are not supported by the camera, "
+                        "ignoring them\n");
+        return true;
+    }
+
+    // streams without a crop use the ROI, or the full sensor area.
+    window_t full = {0, 0, 1, 1};
+    const window_t *fallback = (params->roi != NULL) ? params->roi : &full;
+
+    std::vector<Rectangle> crops;
+    for (unsigned int i = 0; i < camp->streams.size(); i++) {
+        int id = camp->stream_ids[i];
+        if (id < 0) {
+            continue;
+        }
+
+        const window_t *window = (params->streams[id].crop != NULL)
+                                     ? params->streams[id].crop
+                                     : fallback;
+        Rectangle rect;
+        if (!window_to_rectangle(camp, window, &rect)) {
+            return false;
+        }
+        crops.push_back(rect);
+    }
+
+    ctrls->set(controls::rpi::ScalerCrops, Span<const Rectangle>(crops));
+    return true;
+}
+
+// set all the controls that are passed to Camera::start().
+static bool fill_start_controls(CameraPriv *camp, ControlList *ctrls,
+                                const parameters_t *params) {
+    fill_dynamic_controls(ctrls, params, PARAMETERS_ALL);
+
+    if (camp->camera->controls().count(&controls::AfMode) > 0) {
+        if (params->af_window != NULL) {
+            std::optional<Rectangle> opt =
                 camp->camera->properties().get(properties::ScalerCropMaximum);
             Rectangle sensor_area;
             try {
@@ -576,8 +1306,8 @@ bool camera_start(camera_t *cam, parameters_t *params) {
                           params->af_window->height * sensor_area.height);
 
             afwindows_rectangle[0].translateBy(sensor_area.topLeft());
-            camp->ctrls->set(controls::AfMetering, controls::AfMeteringWindows);
-            camp->ctrls->set(controls::AfWindows, afwindows_rectangle);
+            ctrls->set(controls::AfMetering, controls::AfMeteringWindows);
+            ctrls->set(controls::AfWindows, afwindows_rectangle);
         }
 
         int af_mode;
@@ -588,7 +1318,7 @@ bool camera_start(camera_t *cam, parameters_t *params) {
         } else {
             af_mode = controls::AfModeAuto;
         }
-        camp->ctrls->set(controls::AfMode, af_mode);
+        ctrls->set(controls::AfMode, af_mode);
 
         int af_range;
         if (strcmp(params->af_range, "macro") == 0) {
@@ -598,7 +1328,7 @@ bool camera_start(camera_t *cam, parameters_t *params) {
         } else {
             af_range = controls::AfRangeNormal;
         }
-        camp->ctrls->set(controls::AfRange, af_range);
+        ctrls->set(controls::AfRange, af_range);
 
         int af_speed;
         if (strcmp(params->af_range, "fast") == 0) {
@@ -606,60 +1336,471 @@ bool camera_start(camera_t *cam, parameters_t *params) {
         } else {
             af_speed = controls::AfSpeedNormal;
         }
-        camp->ctrls->set(controls::AfSpeed, af_speed);
+        ctrls->set(controls::AfSpeed, af_speed);
 
         if (strcmp(params->af_mode, "auto") == 0) {
-            camp->ctrls->set(controls::AfTrigger, controls::AfTriggerStart);
+            ctrls->set(controls::AfTrigger, controls::AfTriggerStart);
         } else if (strcmp(params->af_mode, "manual") == 0) {
-            camp->ctrls->set(controls::LensPosition, params->lens_position);
+            ctrls->set(controls::LensPosition, params->lens_position);
         }
     }
 
     if (params->roi != NULL) {
-        std::optional<Rectangle> opt =
-            camp->camera->properties().get(properties::ScalerCropMaximum);
-        Rectangle sensor_area;
-        try {
-            sensor_area = opt.value();
-        } catch (const std::bad_optional_access &exc) {
-            set_error("get(ScalerCropMaximum) failed");
+        Rectangle crop;
+        if (!window_to_rectangle(camp, params->roi, &crop)) {
             return false;
         }
+        ctrls->set(controls::ScalerCrop, crop);
+    }
+
+    return fill_stream_crops(camp, ctrls, params);
+}
 
-        Rectangle crop(params->roi->x * sensor_area.width,
-                       params->roi->y * sensor_area.height,
-                       params->roi->width * sensor_area.width,
-                       params->roi->height * sensor_area.height);
-        crop.translateBy(sensor_area.topLeft());
-        camp->ctrls->set(controls::ScalerCrop, crop);
+// describe the camera, tuning file and sensor mode that AE/AWB state
+// belongs to. The tuning file is identified by its path and modification
+// time. The sensor mode is identified by the configuration of the raw
+// stream or, when there is none, by the size of the primary stream, that
+// is used by libcamera to select the mode, and by the frame rate.
+static void fill_state_identity(CameraPriv *camp, const parameters_t *params,
+                                camera_state_t *state) {
+    std::optional<std::string> model =
+        camp->camera->properties().get(properties::Model);
+    snprintf(state->camera, sizeof(state->camera), "%s",
+             model ? model->c_str() : "");
+
+    const char *tuning_file =
+        (params->tuning_file != NULL) ? params->tuning_file : "";
+    struct stat st;
+    long long mtime = (stat(tuning_file, &st) == 0) ? st.st_mtime : 0;
+    snprintf(state->tuning_file, sizeof(state->tuning_file), "%s@%lld",
+             tuning_file, mtime);
+
+    std::string mode =
+        std::to_string(params->width) + "x" + std::to_string(params->height);
+    for (unsigned int i = 0; i < camp->streams.size(); i++) {
+        if (camp->stream_ids[i] < 0) {
+            mode = camp->streams[i]->configuration().toString();
+        }
+    }
+    snprintf(state->mode, sizeof(state->mode), "%s@%.2f%s", mode.c_str(),
+             params->fps, params->hdr ? "-hdr" : "");
+}
+
+// seed AE/AWB with the state saved by a previous run, if it was recorded
+// with the same camera, tuning file and sensor mode. Algorithms that are
+// not in auto mode are left alone. Returns whether controls were added.
+static bool fill_seed_controls(CameraPriv *camp, ControlList *ctrls,
+                               const parameters_t *params) {
+    if (access(params->state_file, F_OK) != 0) {
+        return false;
+    }
+
+    camera_state_t saved;
+    if (!camera_state_load(params->state_file, &saved)) {
+        fprintf(stderr, "unable to load AE/AWB state: %s\n",
+                camera_state_get_error());
+        return false;
+    }
+
+    if (strcmp(saved.camera, camp->state.camera) != 0 ||
+        strcmp(saved.tuning_file, camp->state.tuning_file) != 0 ||
+        strcmp(saved.mode, camp->state.mode) != 0) {
+        fprintf(stderr, "AE/AWB state ignored since it was saved with a "
+                        "different camera, tuning file or sensor mode\n");
+        return false;
     }
 
-    int res = camp->camera->start(camp->ctrls.get());
+    bool ae = (params->shutter == 0 && params->gain == 0.0f);
+    bool awb = (strcmp(params->awb, "auto") == 0 &&
+                params->awb_gain_red == 0.0f && params->awb_gain_blue == 0.0f);
+
+    if (ae) {
+        ctrls->set(controls::ExposureTimeMode,
+                   controls::ExposureTimeModeManual);
+        ctrls->set(controls::ExposureTime, saved.exposure_time);
+        ctrls->set(controls::AnalogueGainMode,
+                   controls::AnalogueGainModeManual);
+        ctrls->set(controls::AnalogueGain, saved.analogue_gain);
+    }
+
+    if (awb) {
+        ctrls->set(controls::ColourGains,
+                   Span<const float, 2>(
+                       {saved.colour_gains[0], saved.colour_gains[1]}));
+    }
+
+    if (ae || awb) {
+        fprintf(stderr,
+                "seeding AE/AWB with exposure time %d, analogue gain %.2f, "
+                "colour gains %.2f,%.2f (%.0f lux)\n",
+                (int)saved.exposure_time, saved.analogue_gain,
+                saved.colour_gains[0], saved.colour_gains[1], saved.lux);
+    }
+
+    return (ae || awb);
+}
+
+bool camera_start(camera_t *cam, parameters_t *params) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    ControlList ctrls(controls::controls);
+    if (!fill_start_controls(camp, &ctrls, params)) {
+        return false;
+    }
+
+    bool seeded = false;
+    if (camp->state_enabled) {
+        {
+            std::lock_guard<std::mutex> lock(camp->state_mutex);
+            fill_state_identity(camp, params, &camp->state);
+        }
+        seeded = fill_seed_controls(camp, &ctrls, params);
+    }
+
+    int res = camp->camera->start(&ctrls);
     if (res != 0) {
         set_error("Camera.start() failed");
         return false;
     }
 
-    camp->ctrls->clear();
-
     camp->camera->requestCompleted.connect(on_request_complete);
 
-    for (std::unique_ptr<Request> &request : camp->requests) {
-        int res = camp->camera->queueRequest(request.get());
-        if (res != 0) {
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+
+    // in standby, the camera is started but requests are queued only when
+    // camera_resume() is called.
+    if (params->standby) {
+        camp->paused = true;
+    } else {
+        camp->last_frame_time = monotonic_us();
+    }
+
+    for (unsigned int i = 0; i < camp->requests.size(); i++) {
+        if (!requeue(camp, &camp->frames[i])) {
             set_error("Camera.queueRequest() failed");
             return false;
         }
     }
 
+    // the following requests give AE/AWB back to the algorithms, that
+    // continue from the seeded state.
+    if (seeded) {
+        camp->auto_ctrls = std::make_unique<ControlList>(controls::controls);
+        fill_dynamic_controls(camp->auto_ctrls.get(), params,
+                              PARAMETERS_SHUTTER | PARAMETERS_GAIN |
+                                  PARAMETERS_AWB_GAINS);
+    }
+
     return true;
 }
 
-void camera_reload_params(camera_t *cam, const parameters_t *params) {
+// save the last converged AE/AWB state, if it changed since the previous
+// call.
+bool camera_save_state(camera_t *cam, const char *path) {
     CameraPriv *camp = (CameraPriv *)cam;
 
-    std::lock_guard<std::mutex> lock(camp->ctrls_mutex);
-    fill_dynamic_controls(camp->ctrls.get(), params);
+    camera_state_t state;
+    {
+        std::lock_guard<std::mutex> lock(camp->state_mutex);
+        if (!camp->state_changed) {
+            return true;
+        }
+        state = camp->state;
+        camp->state_changed = false;
+    }
+
+    if (!camera_state_save(path, &state)) {
+        set_error("%s", camera_state_get_error());
+        return false;
+    }
+
+    return true;
+}
+
+// stop queueing requests. Requests that are in flight complete normally.
+void camera_pause(camera_t *cam) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+    camp->paused = true;
+}
+
+void camera_resume(camera_t *cam) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+    if (camp->stopped || !camp->paused) {
+        return;
+    }
+
+    camp->paused = false;
+    camp->resume_time = monotonic_us();
+    camp->last_frame_time = camp->resume_time.load();
+
+    for (Request *request : camp->idle_requests) {
+        take_controls(camp, &request->controls());
+        camp->camera->queueRequest(request);
+    }
+    camp->idle_requests.clear();
+}
+
+void camera_reload_params(camera_t *cam, const parameters_t *params,
+                          uint64_t diff) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    ControlList *ctrls = begin_controls(camp);
+    fill_dynamic_controls(ctrls, params, diff);
+    publish_controls(camp, ctrls);
+}
+
+void camera_set_fps(camera_t *cam, float fps) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    int64_t frame_time = (int64_t)(((float)1000000) / fps);
+
+    ControlList *ctrls = begin_controls(camp);
+    ctrls->set(controls::FrameDurationLimits,
+               Span<const int64_t, 2>({frame_time, frame_time}));
+    publish_controls(camp, ctrls);
+}
+
+// set the frame rate of a stream other than the primary one, that must be
+// lower than the frame rate of the camera.
+void camera_set_stream_fps(camera_t *cam, int stream, float fps) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    camp->schedules[stream_id(camp, stream)].fps = (uint64_t)(fps * 1000);
+}
+
+unsigned int camera_get_buffer_count(camera_t *cam) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    return camp->requests.size();
+}
+
+unsigned int camera_get_max_buffer_count(camera_t *cam) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    return camp->max_buffer_count;
+}
+
+// number of frames that were dropped by the camera since the start.
+uint64_t camera_get_sequence_gaps(camera_t *cam) {
+    CameraPriv *camp = (CameraPriv *)cam;
+    return camp->sequence_gaps;
+}
+
+// add a request and its buffers while the camera is running.
+// Returns false when the maximum buffer count has been reached.
+bool camera_add_buffer(camera_t *cam) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    if (camp->requests.size() >= camp->max_buffer_count) {
+        set_error("maximum buffer count reached");
+        return false;
+    }
+
+    int allocator_fd = dma_heap_open();
+    if (allocator_fd < 0) {
+        set_error("failed to open dma heap allocator");
+        return false;
+    }
+
+    bool ok = add_request(camp, allocator_fd);
+    close(allocator_fd);
+    if (!ok) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+    requeue(camp, &camp->frames[camp->requests.size() - 1]);
+
+    return true;
+}
+
+// whether no frame has been received for longer than timeout microseconds.
+bool camera_is_stalled(camera_t *cam, uint64_t timeout) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    {
+        std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+        if (camp->stopped || camp->paused || camp->recovering) {
+            return false;
+        }
+    }
+
+    // recoveries are not attempted anymore and the error has been reported.
+    if (camp->failed_recoveries >= MAX_FAILED_RECOVERIES) {
+        return false;
+    }
+
+    return (monotonic_us() - camp->last_frame_time) > timeout;
+}
+
+// the camera stays stopped and is detected as stalled by the watchdog, that
+// attempts another recovery.
+static void abort_recovery(CameraPriv *camp) {
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+    camp->recovering = false;
+}
+
+// restart the camera without releasing buffers, in order to recover from
+// errors and stalls without restarting the process.
+bool camera_recover(camera_t *cam, const parameters_t *params) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    if (camp->failed_recoveries >= MAX_FAILED_RECOVERIES) {
+        set_error("camera did not recover after %d attempts",
+                  camp->failed_recoveries);
+        return false;
+    }
+    camp->failed_recoveries++;
+
+    uint64_t recovery_start = monotonic_us();
+
+    {
+        std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+        if (camp->stopped) {
+            return true;
+        }
+        camp->recovering = true;
+    }
+
+    // requests in flight are returned as cancelled and are ignored.
+    camp->camera->stop();
+
+    ControlList ctrls(controls::controls);
+    if (!fill_start_controls(camp, &ctrls, params)) {
+        abort_recovery(camp);
+        return false;
+    }
+
+    take_controls(camp, &ctrls);
+
+    int res = camp->camera->start(&ctrls);
+    if (res != 0) {
+        set_error("Camera.start() failed");
+        abort_recovery(camp);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+
+    camp->recovering = false;
+    camp->in_error = false;
+    camp->recovery_start = recovery_start;
+    camp->last_frame_time = monotonic_us();
+    camp->idle_requests.clear();
+
+    // frames that are still used by consumers are queued once released.
+    for (unsigned int i = 0; i < camp->requests.size(); i++) {
+        CameraFrame *frame = &camp->frames[i];
+        frame->queued = false;
+
+        if (frame->consumers == 0) {
+            requeue(camp, frame);
+        }
+    }
+
+    return true;
+}
+
+// apply parameters that require the camera to be reconfigured, without
+// releasing it. It must be called after camera_stop() and followed by
+// camera_restart(). When streams_changed is set, streams are configured
+// again and buffers are reallocated, except the ones that can be reused.
+bool camera_reconfigure(camera_t *cam, const parameters_t *params,
+                        bool streams_changed) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    // frames in use by consumers refer to buffers that may be freed.
+    uint64_t wait_start = monotonic_us();
+    for (unsigned int i = 0; i < camp->requests.size(); i++) {
+        while (camp->frames[i].consumers != 0) {
+            if ((monotonic_us() - wait_start) > RECONFIGURE_TIMEOUT) {
+                set_error("frames are still in use by consumers");
+                return false;
+            }
+            usleep(1000);
+        }
+    }
+
+    if (streams_changed) {
+        unsigned int buffer_count = camp->requests.size();
+
+        std::vector<std::unique_ptr<StreamBuffers>> prev =
+            std::move(camp->stream_buffers);
+        camp->stream_buffers.clear();
+        camp->idle_requests.clear();
+        camp->requests.clear();
+
+        if (!configure(camp, params)) {
+            return false;
+        }
+
+        if (params->buffer_count != 0) {
+            buffer_count = params->buffer_count;
+        } else if (buffer_count > camp->max_buffer_count) {
+            buffer_count = camp->max_buffer_count;
+        }
+
+        if (!allocate(camp, params, buffer_count, &prev)) {
+            return false;
+        }
+    }
+
+    camp->frame_duration = (int64_t)(1000000000.0 / params->fps);
+    for (unsigned int i = 1; i < params->stream_count; i++) {
+        camp->schedules[i].fps = (uint64_t)(params->streams[i].fps * 1000);
+        camp->schedules[i].next = 0;
+        camp->schedules[i].rem = 0;
+    }
+
+    return true;
+}
+
+// start the camera again after camera_reconfigure(). Consumers must be ready
+// to receive frames of the new configuration.
+bool camera_restart(camera_t *cam, const parameters_t *params) {
+    CameraPriv *camp = (CameraPriv *)cam;
+
+    // the sensor mode may have changed, therefore a state recorded with the
+    // previous configuration is not saved.
+    if (camp->state_enabled) {
+        std::lock_guard<std::mutex> lock(camp->state_mutex);
+        fill_state_identity(camp, params, &camp->state);
+        camp->state_changed = false;
+    }
+
+    ControlList ctrls(controls::controls);
+    if (!fill_start_controls(camp, &ctrls, params)) {
+        return false;
+    }
+
+    take_controls(camp, &ctrls);
+
+    int res = camp->camera->start(&ctrls);
+    if (res != 0) {
+        set_error("Camera.start() failed");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(camp->stopped_mutex);
+
+    camp->stopped = false;
+    camp->in_error = false;
+    camp->last_frame_time = monotonic_us();
+    camp->last_sequence_set = false;
+    camp->idle_requests.clear();
+
+    for (unsigned int i = 0; i < camp->requests.size(); i++) {
+        CameraFrame *frame = &camp->frames[i];
+        frame->queued = false;
+
+        if (!requeue(camp, frame)) {
+            set_error("Camera.queueRequest() failed");
+            return false;
+        }
+    }
+
+    return true;
 }
 
 void camera_stop(camera_t *cam) {
@@ -678,15 +1819,15 @@ void camera_destroy(camera_t *cam) {
     camp->camera->release();
     camp->camera.reset();
 
-    for (auto &pair : camp->mapped_buffers) {
-        size_t buffer_size = 0;
-        for (const auto &plane : pair.first->planes()) {
-            buffer_size += plane.length;
-        }
-        munmap(pair.second, buffer_size);
+    camp->requests.clear();
+    for (std::unique_ptr<StreamBuffers> &sb : camp->stream_buffers) {
+        free_stream_buffers(sb.get());
     }
 
-    camp->camera_manager->stop();
+    // the manager is stopped when its last camera is destroyed.
+    camp->camera_manager.reset();
 
+    delete camp->pending_ctrls.load();
+    delete camp->spare_ctrls.load();
     delete camp;
 }
@@ -5,29 +5,65 @@
 
 typedef void camera_t;
 
-typedef void (*camera_frame_cb)(uint8_t *buffer_mapped, int buffer_fd,
-                                uint64_t dts, uint64_t ntp,
-                                uint8_t *secondary_buffer_mapped,
-                                int secondary_buffer_fd);
+typedef void camera_frame_t;
 
-typedef void (*camera_error_cb)();
+// consumers of a frame. Buffers of a frame are given back to the camera once
+// all consumers have released them.
+#define CAMERA_CONSUMER_ENCODER(stream) (1 << (stream))
+#define CAMERA_CONSUMER_OVERLAY (1 << 6)
+#define CAMERA_CONSUMER_SCALER(stream) (1 << (8 + (stream)))
+
+// buffer of an output stream. fd is -1 when the stream is not part of the
+// frame. mapped is NULL in that case too, or when the buffer is not read by
+// the CPU. offset is the position of the frame inside the DMA buffer fd,
+// that may be shared by several frames.
+typedef struct {
+    uint8_t *mapped;
+    int fd;
+    unsigned int offset;
+} camera_buffer_t;
+
+// buffers are indexed by the ID of streams in the pipe, and there are
+// PARAMETERS_MAX_STREAMS of them. Consumers must acquire the frame before
+// frame_cb returns.
+typedef void (*camera_frame_cb)(camera_frame_t *frame, uint64_t dts,
+                                uint64_t ntp, const camera_buffer_t *buffers);
+
+typedef void (*camera_error_cb)(camera_t *cam);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 const char *camera_get_error();
+// params are the parameters of a single camera, as returned by
+// parameters_camera_view(). Functions that take a stream expect its ID in
+// the pipe.
 bool camera_create(const parameters_t *params, camera_frame_cb frame_cb,
                    camera_error_cb error_cb, camera_t **cam);
-int camera_get_frame_size(camera_t *cam);
-int camera_get_secondary_frame_size(camera_t *cam);
-int camera_get_stride(camera_t *cam);
-int camera_get_secondary_stride(camera_t *cam);
-int camera_get_colorspace(camera_t *cam);
-int camera_get_secondary_colorspace(camera_t *cam);
+int camera_get_frame_size(camera_t *cam, int stream);
+int camera_get_stride(camera_t *cam, int stream);
+int camera_get_colorspace(camera_t *cam, int stream);
 bool camera_start(camera_t *cam, parameters_t *params);
-void camera_reload_params(camera_t *cam, const parameters_t *params);
+void camera_reload_params(camera_t *cam, const parameters_t *params,
+                          uint64_t diff);
+void camera_set_fps(camera_t *cam, float fps);
+void camera_set_stream_fps(camera_t *cam, int stream, float fps);
+unsigned int camera_get_buffer_count(camera_t *cam);
+unsigned int camera_get_max_buffer_count(camera_t *cam);
+uint64_t camera_get_sequence_gaps(camera_t *cam);
+bool camera_add_buffer(camera_t *cam);
+void camera_pause(camera_t *cam);
+void camera_resume(camera_t *cam);
+bool camera_is_stalled(camera_t *cam, uint64_t timeout);
+bool camera_recover(camera_t *cam, const parameters_t *params);
+void camera_frame_acquire(camera_frame_t *frame, int consumer);
+void camera_frame_release(camera_frame_t *frame, int consumer);
 void camera_stop(camera_t *cam);
+bool camera_reconfigure(camera_t *cam, const parameters_t *params,
+                        bool streams_changed);
+bool camera_restart(camera_t *cam, const parameters_t *params);
+bool camera_save_state(camera_t *cam, const char *path);
 void camera_destroy(camera_t *cam);
 
 #ifdef __cplusplus
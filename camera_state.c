@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "camera_state.h"
+
+#define FIELD_CAMERA (1 << 0)
+#define FIELD_TUNING_FILE (1 << 1)
+#define FIELD_MODE (1 << 2)
+#define FIELD_EXPOSURE_TIME (1 << 3)
+#define FIELD_ANALOGUE_GAIN (1 << 4)
+#define FIELD_COLOUR_GAINS (1 << 5)
+#define FIELD_LUX (1 << 6)
+#define FIELD_ALL ((1 << 7) - 1)
+
+static char errbuf[256];
+
+static void set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errbuf, 256, format, args);
+}
+
+const char *camera_state_get_error() { return errbuf; }
+
+// the file contains a "Key=value" entry per line.
+bool camera_state_load(const char *path, camera_state_t *state) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        set_error("unable to open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    memset(state, 0, sizeof(camera_state_t));
+    int fields = 0;
+    char line[1024];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = 0x00;
+
+        char *val = line;
+        char *key = strsep(&val, "=");
+        if (val == NULL) {
+            continue;
+        }
+
+        if (strcmp(key, "Camera") == 0) {
+            snprintf(state->camera, sizeof(state->camera), "%s", val);
+            fields |= FIELD_CAMERA;
+        } else if (strcmp(key, "TuningFile") == 0) {
+            snprintf(state->tuning_file, sizeof(state->tuning_file), "%s",
+                     val);
+            fields |= FIELD_TUNING_FILE;
+        } else if (strcmp(key, "Mode") == 0) {
+            snprintf(state->mode, sizeof(state->mode), "%s", val);
+            fields |= FIELD_MODE;
+        } else if (strcmp(key, "ExposureTime") == 0) {
+            state->exposure_time = atoi(val);
+            fields |= FIELD_EXPOSURE_TIME;
+        } else if (strcmp(key, "AnalogueGain") == 0) {
+            state->analogue_gain = atof(val);
+            fields |= FIELD_ANALOGUE_GAIN;
+        } else if (strcmp(key, "ColourGains") == 0) {
+            if (sscanf(val, "%f,%f", &state->colour_gains[0],
+                       &state->colour_gains[1]) == 2) {
+                fields |= FIELD_COLOUR_GAINS;
+            }
+        } else if (strcmp(key, "Lux") == 0) {
+            state->lux = atof(val);
+            fields |= FIELD_LUX;
+        }
+    }
+
+    fclose(f);
+
+    if (fields != FIELD_ALL) {
+        set_error("%s is incomplete", path);
+        return false;
+    }
+
+    if (state->exposure_time <= 0 || state->analogue_gain < 1.0f ||
+        state->colour_gains[0] <= 0.0f || state->colour_gains[1] <= 0.0f) {
+        set_error("%s contains invalid values", path);
+        return false;
+    }
+
+    return true;
+}
+
+// the file is replaced atomically, in order not to leave a truncated file
+// behind when the process is killed.
+bool camera_state_save(const char *path, const camera_state_t *state) {
+    size_t tmp_size = strlen(path) + 5;
+    char *tmp = malloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        set_error("unable to open %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return false;
+    }
+
+    fprintf(f,
+            "Camera=%s\n"
+            "TuningFile=%s\n"
+            "Mode=%s\n"
+            "ExposureTime=%d\n"
+            "AnalogueGain=%f\n"
+            "ColourGains=%f,%f\n"
+            "Lux=%f\n",
+            state->camera, state->tuning_file, state->mode,
+            (int)state->exposure_time, state->analogue_gain,
+            state->colour_gains[0], state->colour_gains[1], state->lux);
+
+    if (fclose(f) != 0) {
+        set_error("unable to write %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return false;
+    }
+
+    if (rename(tmp, path) != 0) {
+        set_error("unable to rename %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return false;
+    }
+
+    free(tmp);
+    return true;
+}
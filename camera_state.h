@@ -0,0 +1,33 @@
+#ifndef __CAMERA_STATE_H__
+#define __CAMERA_STATE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// converged AE/AWB state of a camera. It is saved into a file and used to
+// seed the next start of the camera, in order to skip convergence.
+typedef struct {
+    // the state is valid only with the camera, tuning file and sensor mode
+    // that it was recorded with.
+    char camera[64];
+    char tuning_file[512];
+    char mode[64];
+    int32_t exposure_time;
+    float analogue_gain;
+    float colour_gains[2];
+    float lux;
+} camera_state_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char *camera_state_get_error();
+bool camera_state_load(const char *path, camera_state_t *state);
+bool camera_state_save(const char *path, const camera_state_t *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+
+#include "dma_heap.h"
+
+// open the heap that DMA buffers are allocated from, or return -1.
+// When no heap is available, as in desktop machines, udmabuf is used
+// instead, that exports memory of a memfd as DMA buffers.
+// https://github.com/raspberrypi/rpicam-apps/blob/6de1ab6a899df35f929b2a15c0831780bd8e750e/core/dma_heaps.cpp
+int dma_heap_open() {
+    static const char *heap_positions[] = {
+        "/dev/dma_heap/vidbuf_cached",
+        "/dev/dma_heap/linux,cma",
+        "/dev/udmabuf",
+    };
+
+    for (unsigned int i = 0; i < sizeof(heap_positions) / sizeof(const char *);
+         i++) {
+        int fd = open(heap_positions[i], O_RDWR | O_CLOEXEC, 0);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static int udmabuf_alloc(int udmabuf_fd, size_t size) {
+    // udmabuf exports whole pages only.
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    int memfd = memfd_create("dma_heap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        return -1;
+    }
+
+    // memory of a udmabuf must not be removed from the memfd.
+    if (ftruncate(memfd, size) != 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+        close(memfd);
+        return -1;
+    }
+
+    struct udmabuf_create create = {0};
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = size;
+    int fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+    close(memfd);
+
+    return (fd >= 0) ? fd : -1;
+}
+
+// allocate a DMA buffer and return its file descriptor, or -1.
+int dma_heap_alloc(int heap_fd, size_t size) {
+    struct dma_heap_allocation_data alloc = {0};
+    alloc.len = size;
+    alloc.fd_flags = O_CLOEXEC | O_RDWR;
+    if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+        // heap_fd is udmabuf, that does not support DMA_HEAP_IOCTL_ALLOC.
+        if (errno == ENOTTY) {
+            return udmabuf_alloc(heap_fd, size);
+        }
+        return -1;
+    }
+    return alloc.fd;
+}
@@ -0,0 +1,17 @@
+#ifndef __DMA_HEAP_H__
+#define __DMA_HEAP_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int dma_heap_open();
+int dma_heap_alloc(int heap_fd, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
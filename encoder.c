@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,11 +13,21 @@
 #include "encoder_hardware_h264.h"
 #include "encoder_mjpeg.h"
 #include "encoder_software_h264.h"
+#include "stats.h"
 
 #define ENCODER_HARDWARE_H264 0
 #define ENCODER_SOFTWARE_H264 1
 #define ENCODER_MJPEG 2
 
+// fixed-point unit of shares and credits.
+#define SHARE_ONE 65536
+
+// lower limit of the share of frames encoded by hardware encoders.
+#define SHARE_MIN (SHARE_ONE / 4)
+
+// increase of the share after each frame that is queued successfully.
+#define SHARE_RECOVERY (SHARE_ONE / 1024)
+
 static char errbuf[256];
 
 static void set_error(const char *format, ...) {
@@ -28,29 +39,95 @@ static void set_error(const char *format, ...) {
 const char *encoder_get_error() { return errbuf; }
 
 typedef void (*encode_cb)(void *enc, uint8_t *mapped_buffer, int buffer_fd,
-                          uint64_t dts, uint64_t ntp);
+                          int buffer_offset, uint64_t dts, uint64_t ntp,
+                          void *input);
 
 typedef void (*reload_params_cb)(void *enc, const parameters_t *params);
 
+typedef void (*set_bitrate_cb)(void *enc, unsigned int bitrate);
+
+typedef void (*set_fps_cb)(void *enc, float fps);
+
+typedef void (*force_idr_cb)(void *enc);
+
+typedef uint64_t (*get_input_errors_cb)(void *enc);
+
+typedef void (*release_output_cb)(void *enc, const uint8_t *buffer);
+
 typedef void (*destroy_cb)(void *enc);
 
 typedef struct {
     void *implementation;
     encode_cb encode;
     reload_params_cb reload_params;
+    set_bitrate_cb set_bitrate;
+    set_fps_cb set_fps;
+    force_idr_cb force_idr;
+    get_input_errors_cb get_input_errors;
+    release_output_cb release_output;
     destroy_cb destroy;
+    int stream;
+    encoder_input_release_cb input_release_cb;
+    // true for hardware encoders, that share the hardware.
+    bool hardware;
+    uint64_t input_errors;
+    uint32_t credit;
 } encoder_priv_t;
 
-bool encoder_create(bool is_secondary, const parameters_t *params,
-                    int frame_size, int stride, int colorspace,
-                    encoder_output_cb output_cb, encoder_t **enc) {
+// when the hardware cannot keep up with hardware encoders, frames cannot be
+// queued into it anymore. In that case, each hardware encoder encodes the
+// same fraction of its frames, instead of letting the hardware drop frames
+// of random streams. The fraction decreases at every frame that cannot be
+// queued and recovers slowly while frames are queued successfully, therefore
+// frames are never skipped while the hardware keeps up.
+static _Atomic uint32_t hardware_share = SHARE_ONE;
+
+static void hardware_update_share(encoder_priv_t *encp) {
+    uint64_t errors = encp->get_input_errors(encp->implementation);
+    bool saturated = (errors != encp->input_errors);
+    encp->input_errors = errors;
+
+    uint32_t share = atomic_load(&hardware_share);
+    uint32_t next;
+
+    do {
+        if (saturated) {
+            next = share - share / 8;
+            if (next < SHARE_MIN) {
+                next = SHARE_MIN;
+            }
+        } else {
+            next = share + SHARE_RECOVERY;
+            if (next > SHARE_ONE) {
+                next = SHARE_ONE;
+            }
+        }
+        if (next == share) {
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&hardware_share, &share, next));
+
+    if (saturated && share == SHARE_ONE) {
+        fprintf(stderr, "hardware H264 encoders cannot keep up, frames will "
+                        "be skipped\n");
+    }
+}
+
+bool encoder_create(int stream, const parameters_t *params, int frame_size,
+                    int stride, int colorspace, int buffer_count,
+                    encoder_output_cb output_cb,
+                    encoder_input_release_cb input_release_cb,
+                    encoder_t **enc) {
     *enc = malloc(sizeof(encoder_priv_t));
     encoder_priv_t *encp = (encoder_priv_t *)(*enc);
     memset(encp, 0, sizeof(encoder_priv_t));
 
+    encp->stream = stream;
+    encp->input_release_cb = input_release_cb;
+    encp->credit = SHARE_ONE;
+
     int variant;
-    const char *codec =
-        (!is_secondary) ? params->codec : params->secondary_codec;
+    const char *codec = params->streams[stream].codec;
 
     if (codec != NULL && strcmp(codec, "hardwareH264") == 0) {
         variant = ENCODER_HARDWARE_H264;
@@ -64,9 +141,9 @@ bool encoder_create(bool is_secondary, const parameters_t *params,
         fprintf(stderr, "using hardware H264 encoder\n");
 
         encoder_hardware_h264_t *hardware_h264;
-        bool res = encoder_hardware_h264_create(is_secondary, params,
-                                                frame_size, stride, colorspace,
-                                                output_cb, &hardware_h264);
+        bool res = encoder_hardware_h264_create(
+            stream, params, frame_size, stride, colorspace, buffer_count,
+            output_cb, input_release_cb, &hardware_h264);
         if (!res) {
             set_error(encoder_hardware_h264_get_error());
             goto failed;
@@ -75,15 +152,22 @@ bool encoder_create(bool is_secondary, const parameters_t *params,
         encp->implementation = hardware_h264;
         encp->encode = encoder_hardware_h264_encode;
         encp->reload_params = encoder_hardware_h264_reload_params;
+        encp->set_bitrate = encoder_hardware_h264_set_bitrate;
+        encp->set_fps = encoder_hardware_h264_set_fps;
+        encp->force_idr = encoder_hardware_h264_force_idr;
+        encp->get_input_errors = encoder_hardware_h264_get_input_errors;
+        encp->release_output = encoder_hardware_h264_release_output;
         encp->destroy = encoder_hardware_h264_destroy;
+        encp->hardware = true;
 
     } else if (variant == ENCODER_SOFTWARE_H264) {
         fprintf(stderr, "using software H264 encoder\n");
 
         encoder_software_h264_t *software_h264;
-        bool res =
-            encoder_software_h264_create(is_secondary, params, stride,
-                                         colorspace, output_cb, &software_h264);
+        bool res = encoder_software_h264_create(stream, params, stride,
+                                                colorspace, output_cb,
+                                                input_release_cb,
+                                                &software_h264);
         if (!res) {
             set_error(encoder_software_h264_get_error());
             goto failed;
@@ -92,13 +176,17 @@ bool encoder_create(bool is_secondary, const parameters_t *params,
         encp->implementation = software_h264;
         encp->encode = encoder_software_h264_encode;
         encp->reload_params = encoder_software_h264_reload_params;
+        encp->set_bitrate = encoder_software_h264_set_bitrate;
+        encp->set_fps = encoder_software_h264_set_fps;
+        encp->force_idr = encoder_software_h264_force_idr;
+        encp->destroy = encoder_software_h264_destroy;
 
     } else {
         fprintf(stderr, "using MJPEG encoder\n");
 
         encoder_mjpeg_t *mjpeg;
-        bool res = encoder_mjpeg_create(is_secondary, params, stride, output_cb,
-                                        &mjpeg);
+        bool res = encoder_mjpeg_create(stream, params, stride, output_cb,
+                                        input_release_cb, &mjpeg);
         if (!res) {
             set_error(encoder_mjpeg_get_error());
             goto failed;
@@ -107,6 +195,7 @@ bool encoder_create(bool is_secondary, const parameters_t *params,
         encp->implementation = mjpeg;
         encp->encode = encoder_mjpeg_encode;
         encp->reload_params = encoder_mjpeg_reload_params;
+        encp->destroy = encoder_mjpeg_destroy;
     }
 
     return true;
@@ -116,10 +205,29 @@ failed:
     return false;
 }
 
+// buffer_offset is the offset of the frame inside the DMA buffer.
 void encoder_encode(encoder_t *enc, uint8_t *mapped_buffer, int buffer_fd,
-                    uint64_t dts, uint64_t ntp) {
+                    int buffer_offset, uint64_t dts, uint64_t ntp,
+                    void *input) {
     encoder_priv_t *encp = (encoder_priv_t *)enc;
-    encp->encode(encp->implementation, mapped_buffer, buffer_fd, dts, ntp);
+
+    if (encp->hardware) {
+        encp->credit += atomic_load(&hardware_share);
+        if (encp->credit < SHARE_ONE) {
+            encp->input_release_cb(encp->stream, input);
+            stats_frame_dropped(encp->stream);
+            return;
+        }
+        encp->credit -= SHARE_ONE;
+    }
+
+    stats_encode_start(encp->stream, dts);
+    encp->encode(encp->implementation, mapped_buffer, buffer_fd,
+                 buffer_offset, dts, ntp, input);
+
+    if (encp->hardware) {
+        hardware_update_share(encp);
+    }
 }
 
 void encoder_reload_params(encoder_t *enc, const parameters_t *params) {
@@ -127,6 +235,49 @@ void encoder_reload_params(encoder_t *enc, const parameters_t *params) {
     encp->reload_params(encp->implementation, params);
 }
 
+void encoder_set_bitrate(encoder_t *enc, unsigned int bitrate) {
+    encoder_priv_t *encp = (encoder_priv_t *)enc;
+
+    if (encp->set_bitrate != NULL) {
+        encp->set_bitrate(encp->implementation, bitrate);
+    }
+}
+
+void encoder_set_fps(encoder_t *enc, float fps) {
+    encoder_priv_t *encp = (encoder_priv_t *)enc;
+
+    if (encp->set_fps != NULL) {
+        encp->set_fps(encp->implementation, fps);
+    }
+}
+
+// every MJPEG frame is a keyframe, therefore this is a no-op for MJPEG.
+void encoder_force_idr(encoder_t *enc) {
+    encoder_priv_t *encp = (encoder_priv_t *)enc;
+
+    if (encp->force_idr != NULL) {
+        encp->force_idr(encp->implementation);
+    }
+}
+
+// number of input buffers that could not be queued.
+uint64_t encoder_get_input_errors(encoder_t *enc) {
+    encoder_priv_t *encp = (encoder_priv_t *)enc;
+
+    if (encp->get_input_errors == NULL) {
+        return 0;
+    }
+    return encp->get_input_errors(encp->implementation);
+}
+
+void encoder_release_output(encoder_t *enc, const uint8_t *buffer) {
+    encoder_priv_t *encp = (encoder_priv_t *)enc;
+
+    if (encp->release_output != NULL) {
+        encp->release_output(encp->implementation, buffer);
+    }
+}
+
 void encoder_destroy(encoder_t *enc) {
     encoder_priv_t *encp = (encoder_priv_t *)enc;
 
@@ -5,16 +5,40 @@
 
 typedef void encoder_t;
 
-typedef void (*encoder_output_cb)(const uint8_t *buffer, uint64_t size,
-                                  uint64_t dts, uint64_t ntp);
+// flags attached to each encoded frame.
+#define ENCODER_OUTPUT_KEYFRAME (1 << 0)
+#define ENCODER_OUTPUT_PARAMETER_SETS (1 << 1)
+// the buffer belongs to the encoder and must be given back with
+// encoder_release_output() once it is not needed anymore.
+#define ENCODER_OUTPUT_BORROWED (1 << 2)
+
+// stream is the ID of the stream that the encoder was created for.
+// nal_sizes contains the size of each NAL unit of the access unit, start codes
+// included. It is empty when the encoder doesn't produce NAL units.
+typedef void (*encoder_output_cb)(int stream, const uint8_t *buffer,
+                                  uint64_t size, uint64_t dts, uint64_t ntp,
+                                  uint32_t flags, const uint32_t *nal_sizes,
+                                  int nal_count);
+
+// called when the encoder doesn't need an input buffer anymore. input is the
+// pointer that was passed to encoder_encode().
+typedef void (*encoder_input_release_cb)(int stream, void *input);
 
 const char *encoder_get_error();
-bool encoder_create(bool is_secondary, const parameters_t *params,
-                    int frame_size, int stride, int colorspace,
-                    encoder_output_cb output_cb, encoder_t **enc);
+bool encoder_create(int stream, const parameters_t *params, int frame_size,
+                    int stride, int colorspace, int buffer_count,
+                    encoder_output_cb output_cb,
+                    encoder_input_release_cb input_release_cb,
+                    encoder_t **enc);
 void encoder_encode(encoder_t *enc, uint8_t *buffer_mapped, int buffer_fd,
-                    uint64_t dts, uint64_t ntp);
+                    int buffer_offset, uint64_t dts, uint64_t ntp,
+                    void *input);
 void encoder_reload_params(encoder_t *enc, const parameters_t *params);
+void encoder_set_bitrate(encoder_t *enc, unsigned int bitrate);
+void encoder_set_fps(encoder_t *enc, float fps);
+void encoder_force_idr(encoder_t *enc);
+uint64_t encoder_get_input_errors(encoder_t *enc);
+void encoder_release_output(encoder_t *enc, const uint8_t *buffer);
 void encoder_destroy(encoder_t *enc);
 
 #endif
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,12 +12,25 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 
+#include "dma_heap.h"
+#include "encoder.h"
 #include "encoder_hardware_h264.h"
+#include "h264.h"
+#include "pipe.h"
+#include "stats.h"
 
 #define DEVICE "/dev/video11"
 
+#define CAPTURE_BUFFER_SIZE (512 << 10)
+
+// in low memory mode, capture buffers are sized to hold keyframes that are
+// this many times larger than the average frame.
+#define LOW_MEMORY_KEYFRAME_RATIO 8
+#define LOW_MEMORY_MIN_CAPTURE_SIZE (64 << 10)
+
 static char errbuf[256];
 
 static void set_error(const char *format, ...) {
@@ -30,15 +44,40 @@ const char *encoder_hardware_h264_get_error() { return errbuf; }
 typedef struct {
     int fd;
     void **capture_buffers;
+    int *capture_fds;
+    int capture_count;
+    int capture_size;
+    bool zero_copy;
+    unsigned int idr_period;
+    unsigned int bitrate;
+    // timestamps of queued frames, indexed like output buffers.
+    uint64_t *dts_timestamps;
     uint64_t *ntp_timestamps;
+    // timestamps of frames whose output buffer has been dequeued, used to
+    // find the NTP timestamp of capture buffers. Accessed by the output
+    // thread only.
+    uint64_t *done_dts;
+    uint64_t *done_ntp;
+    int done_pos;
+    void **inputs;
     int frame_size;
     int buffer_count;
     int cur_buffer;
+    _Atomic uint64_t input_errors;
     encoder_hardware_h264_output_cb output_cb;
+    encoder_hardware_h264_input_release_cb input_release_cb;
     pthread_t output_thread;
     pthread_mutex_t destroyed_mutex;
     bool destroyed;
-    bool is_secondary;
+    int stream;
+    // frame that didn't fit into a capture buffer, whose fragments are
+    // joined here. Accessed by the output thread only.
+    uint8_t *overflow_buf;
+    size_t overflow_alloc;
+    size_t overflow_size;
+    uint64_t overflow_dts;
+    uint64_t overflow_ntp;
+    uint32_t overflow_flags;
 } encoder_hardware_h264_priv_t;
 
 static bool is_destroyed_safe(encoder_hardware_h264_priv_t *encp) {
@@ -48,19 +87,139 @@ static bool is_destroyed_safe(encoder_hardware_h264_priv_t *encp) {
     return is_destroyed;
 }
 
+static bool queue_capture_dmabuf(encoder_hardware_h264_priv_t *encp,
+                                 int index) {
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
+    struct v4l2_buffer buf = {0};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.index = index;
+    buf.length = 1;
+    buf.m.planes = planes;
+    buf.m.planes[0].m.fd = encp->capture_fds[index];
+    buf.m.planes[0].length = encp->capture_size;
+    return (ioctl(encp->fd, VIDIOC_QBUF, &buf) == 0);
+}
+
+static void requeue_capture(encoder_hardware_h264_priv_t *encp,
+                            struct v4l2_buffer *buf) {
+    if (encp->zero_copy) {
+        struct dma_buf_sync dma_sync = {0};
+        dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(encp->capture_fds[buf->index], DMA_BUF_IOCTL_SYNC, &dma_sync);
+
+        if (!queue_capture_dmabuf(encp, buf->index)) {
+            fprintf(stderr, "output_thread(): ioctl(VIDIOC_QBUF) failed\n");
+        }
+        return;
+    }
+
+    if (ioctl(encp->fd, VIDIOC_QBUF, buf) != 0) {
+        fprintf(stderr, "output_thread(): ioctl(VIDIOC_QBUF) failed\n");
+    }
+}
+
+// a frame that fills a capture buffer may continue into the next buffer,
+// that has the same timestamp. Fragments are joined and the frame is
+// emitted once the last fragment is received. When the next buffer has
+// another timestamp, the frame has been truncated and is dropped.
+static void handle_overflow(encoder_hardware_h264_priv_t *encp,
+                            struct v4l2_buffer *buf, const uint8_t *mapped,
+                            int size, uint64_t dts, uint64_t ntp,
+                            uint32_t flags, bool full) {
+    if (encp->overflow_size != 0 && dts != encp->overflow_dts) {
+        fprintf(stderr, "encoded frame is larger than capture buffers, "
+                        "dropping it\n");
+        stats_encode_dropped(encp->stream);
+        encp->overflow_size = 0;
+
+        // following frames may reference the dropped one.
+        encoder_hardware_h264_force_idr(encp);
+    }
+
+    if (encp->overflow_size == 0) {
+        encp->overflow_dts = dts;
+        encp->overflow_ntp = ntp;
+        encp->overflow_flags = 0;
+    }
+    encp->overflow_flags |= flags;
+
+    if (encp->overflow_size + size > encp->overflow_alloc) {
+        encp->overflow_alloc = (encp->overflow_size + size) * 2;
+        encp->overflow_buf = realloc(encp->overflow_buf, encp->overflow_alloc);
+    }
+    memcpy(&encp->overflow_buf[encp->overflow_size], mapped, size);
+    encp->overflow_size += size;
+
+    requeue_capture(encp, buf);
+
+    if (full) {
+        return;
+    }
+
+    uint32_t nal_sizes[PIPE_MAX_NALS];
+    int nal_count = h264_find_nals(encp->overflow_buf, encp->overflow_size,
+                                   nal_sizes, PIPE_MAX_NALS);
+
+    encp->output_cb(encp->stream, encp->overflow_buf, encp->overflow_size,
+                    encp->overflow_dts, encp->overflow_ntp,
+                    encp->overflow_flags, nal_sizes, nal_count);
+    encp->overflow_size = 0;
+}
+
+// dequeue the output buffer of the next frame, that has been read by the
+// encoder, and give the input back, since it can be reused by the camera
+// before the encoded frame is ready.
+static bool dequeue_output(encoder_hardware_h264_priv_t *encp) {
+    struct v4l2_buffer buf = {0};
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    buf.length = 1;
+    buf.m.planes = planes;
+    if (ioctl(encp->fd, VIDIOC_DQBUF, &buf) != 0) {
+        return false;
+    }
+
+    encp->done_dts[encp->done_pos] = encp->dts_timestamps[buf.index];
+    encp->done_ntp[encp->done_pos] = encp->ntp_timestamps[buf.index];
+    encp->done_pos = (encp->done_pos + 1) % encp->buffer_count;
+
+    encp->input_release_cb(encp->stream, encp->inputs[buf.index]);
+    encp->inputs[buf.index] = NULL;
+    return true;
+}
+
+// find the NTP timestamp of a frame from its capture timestamp.
+static uint64_t find_ntp(encoder_hardware_h264_priv_t *encp, uint64_t dts) {
+    for (int i = 0; i < encp->buffer_count; i++) {
+        if (encp->done_dts[i] == dts) {
+            return encp->done_ntp[i];
+        }
+    }
+
+    int last = (encp->done_pos + encp->buffer_count - 1) % encp->buffer_count;
+    return encp->done_ntp[last];
+}
+
 static void *output_thread(void *userdata) {
     encoder_hardware_h264_priv_t *encp =
         (encoder_hardware_h264_priv_t *)userdata;
 
+    char name[16];
+    if (encp->stream == 0) {
+        snprintf(name, sizeof(name), "encoder");
+    } else {
+        snprintf(name, sizeof(name), "encoder_%d", encp->stream);
+    }
+    stats_register_thread(name);
+
     struct v4l2_buffer buf = {0};
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
 
     while (true) {
-        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        buf.length = 1;
-        buf.m.planes = planes;
-        int res = ioctl(encp->fd, VIDIOC_DQBUF, &buf);
-        if (res != 0) {
+        // the fragments of a frame that is split across capture buffers
+        // share a single output buffer, that has already been dequeued.
+        if (encp->overflow_size == 0 && !dequeue_output(encp)) {
             if (is_destroyed_safe(encp)) {
                 break;
             }
@@ -71,7 +230,9 @@ static void *output_thread(void *userdata) {
         }
 
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        res = ioctl(encp->fd, VIDIOC_DQBUF, &buf);
+        buf.length = 1;
+        buf.m.planes = planes;
+        int res = ioctl(encp->fd, VIDIOC_DQBUF, &buf);
         if (res != 0) {
             if (is_destroyed_safe(encp)) {
                 break;
@@ -87,9 +248,49 @@ static void *output_thread(void *userdata) {
         int size = buf.m.planes[0].bytesused;
         uint64_t dts = ((uint64_t)buf.timestamp.tv_sec * (uint64_t)1000000) +
                        (uint64_t)buf.timestamp.tv_usec;
-        uint64_t ntp = encp->ntp_timestamps[buf.index];
 
-        encp->output_cb(mapped, size, dts, ntp);
+        // a split frame has been truncated and the buffer belongs to the
+        // next frame, whose output buffer has not been dequeued yet.
+        if (encp->overflow_size != 0 && dts != encp->overflow_dts &&
+            !dequeue_output(encp)) {
+            fprintf(stderr, "output_thread(): ioctl(VIDIOC_DQBUF, "
+                            "V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) failed\n");
+        }
+
+        uint64_t ntp = find_ntp(encp, dts);
+
+        // SPS and PPS are repeated before every IDR frame.
+        uint32_t flags = 0;
+        if ((buf.flags & V4L2_BUF_FLAG_KEYFRAME) != 0) {
+            flags |= ENCODER_OUTPUT_KEYFRAME | ENCODER_OUTPUT_PARAMETER_SETS;
+        }
+
+        if (encp->zero_copy) {
+            struct dma_buf_sync dma_sync = {0};
+            dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+            ioctl(encp->capture_fds[buf.index], DMA_BUF_IOCTL_SYNC, &dma_sync);
+        }
+
+        bool full = ((uint32_t)size >= buf.m.planes[0].length);
+        if (full || encp->overflow_size != 0) {
+            handle_overflow(encp, &buf, mapped, size, dts, ntp, flags, full);
+            continue;
+        }
+
+        uint32_t nal_sizes[PIPE_MAX_NALS];
+        int nal_count = h264_find_nals(mapped, size, nal_sizes, PIPE_MAX_NALS);
+
+        if (encp->zero_copy) {
+            // the buffer is queued again by
+            // encoder_hardware_h264_release_output().
+            encp->output_cb(encp->stream, mapped, size, dts, ntp,
+                            flags | ENCODER_OUTPUT_BORROWED, nal_sizes,
+                            nal_count);
+            continue;
+        }
+
+        encp->output_cb(encp->stream, mapped, size, dts, ntp, flags, nal_sizes,
+                        nal_count);
 
         res = ioctl(encp->fd, VIDIOC_QBUF, &buf);
         if (res != 0) {
@@ -98,15 +299,164 @@ static void *output_thread(void *userdata) {
         }
     }
 
+    stats_unregister_thread();
     return NULL;
 }
 
-static bool fill_dynamic_params(int fd, bool is_secondary,
-                                const parameters_t *params) {
+static bool setup_capture_mmap(encoder_hardware_h264_priv_t *encp,
+                               int count) {
+    struct v4l2_requestbuffers reqbufs = {0};
+    reqbufs.count = count;
+    reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    reqbufs.memory = V4L2_MEMORY_MMAP;
+    int res = ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
+    if (res != 0) {
+        set_error("unable to set capture buffers");
+        return false;
+    }
+
+    encp->capture_count = reqbufs.count;
+    encp->capture_buffers = malloc(sizeof(void *) * reqbufs.count);
+
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    struct v4l2_buffer buffer = {0};
+
+    for (unsigned int i = 0; i < reqbufs.count; i++) {
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = i;
+        buffer.length = 1;
+        buffer.m.planes = planes;
+        int res = ioctl(encp->fd, VIDIOC_QUERYBUF, &buffer);
+        if (res != 0) {
+            set_error("unable to query buffer");
+            return false;
+        }
+
+        encp->capture_buffers[i] =
+            mmap(0, buffer.m.planes[0].length, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, encp->fd, buffer.m.planes[0].m.mem_offset);
+        if (encp->capture_buffers[i] == MAP_FAILED) {
+            set_error("mmap() failed");
+            return false;
+        }
+
+        res = ioctl(encp->fd, VIDIOC_QBUF, &buffer);
+        if (res != 0) {
+            set_error("ioctl(VIDIOC_QBUF) failed");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void free_capture_dmabuf(encoder_hardware_h264_priv_t *encp) {
+    for (int i = 0; i < encp->capture_count; i++) {
+        if (encp->capture_buffers[i] != NULL) {
+            munmap(encp->capture_buffers[i], encp->capture_size);
+        }
+        if (encp->capture_fds[i] >= 0) {
+            close(encp->capture_fds[i]);
+        }
+    }
+
+    free(encp->capture_buffers);
+    free(encp->capture_fds);
+    encp->capture_buffers = NULL;
+    encp->capture_fds = NULL;
+    encp->capture_count = 0;
+}
+
+// capture buffers are allocated from a DMA heap instead of being provided by
+// the driver. Unlike driver buffers, the mapping of these buffers is backed
+// by regular pages, that can be passed to vmsplice().
+static bool setup_capture_dmabuf(encoder_hardware_h264_priv_t *encp,
+                                 int count) {
+    int allocator_fd = dma_heap_open();
+    if (allocator_fd < 0) {
+        return false;
+    }
+
+    struct v4l2_requestbuffers reqbufs = {0};
+    reqbufs.count = count;
+    reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    reqbufs.memory = V4L2_MEMORY_DMABUF;
+    int res = ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
+    if (res != 0) {
+        close(allocator_fd);
+        return false;
+    }
+
+    encp->capture_count = reqbufs.count;
+    encp->capture_buffers = calloc(reqbufs.count, sizeof(void *));
+    encp->capture_fds = malloc(sizeof(int) * reqbufs.count);
+    for (unsigned int i = 0; i < reqbufs.count; i++) {
+        encp->capture_fds[i] = -1;
+    }
+
+    for (unsigned int i = 0; i < reqbufs.count; i++) {
+        int fd = dma_heap_alloc(allocator_fd, encp->capture_size);
+        if (fd < 0) {
+            goto failed;
+        }
+        encp->capture_fds[i] = fd;
+
+        void *mapped = mmap(NULL, encp->capture_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            goto failed;
+        }
+        encp->capture_buffers[i] = mapped;
+
+        if (!queue_capture_dmabuf(encp, i)) {
+            goto failed;
+        }
+    }
+
+    close(allocator_fd);
+    return true;
+
+failed:
+    reqbufs.count = 0;
+    ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
+    free_capture_dmabuf(encp);
+    close(allocator_fd);
+    return false;
+}
+
+// in low memory mode, capture buffers are sized from the bitrate and the
+// frame size, instead of using a size that fits all configurations. The
+// bitrate may be raised later; frames that don't fit are handled by
+// handle_overflow().
+static unsigned int capture_buffer_size(const parameters_t *params,
+                                        const parameters_stream_t *stream,
+                                        int frame_size) {
+    if (!params->low_memory || stream->fps <= 0) {
+        return CAPTURE_BUFFER_SIZE;
+    }
+
+    uint64_t size = (uint64_t)(stream->bitrate / 8 / stream->fps) *
+                    LOW_MEMORY_KEYFRAME_RATIO;
+
+    // keyframes of complex scenes are large even at low bitrates.
+    if (size < (uint64_t)frame_size / 16) {
+        size = frame_size / 16;
+    }
+
+    if (size < LOW_MEMORY_MIN_CAPTURE_SIZE) {
+        size = LOW_MEMORY_MIN_CAPTURE_SIZE;
+    } else if (size > CAPTURE_BUFFER_SIZE) {
+        size = CAPTURE_BUFFER_SIZE;
+    }
+
+    return (size + 4095) & ~4095;
+}
+
+static bool fill_dynamic_params(int fd, const parameters_stream_t *stream) {
     struct v4l2_control ctrl = {0};
     ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
-    ctrl.value =
-        (!is_secondary) ? params->idr_period : params->secondary_idr_period;
+    ctrl.value = stream->idr_period;
     int res = ioctl(fd, VIDIOC_S_CTRL, &ctrl);
     if (res != 0) {
         set_error("unable to set IDR period");
@@ -114,7 +464,7 @@ static bool fill_dynamic_params(int fd, bool is_secondary,
     }
 
     ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
-    ctrl.value = (!is_secondary) ? params->bitrate : params->secondary_bitrate;
+    ctrl.value = stream->bitrate;
     res = ioctl(fd, VIDIOC_S_CTRL, &ctrl);
     if (res != 0) {
         set_error("unable to set bitrate");
@@ -124,9 +474,12 @@ static bool fill_dynamic_params(int fd, bool is_secondary,
     return true;
 }
 
-bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
+bool encoder_hardware_h264_create(int stream, const parameters_t *params,
                                   int frame_size, int stride, int colorspace,
+                                  int buffer_count,
                                   encoder_hardware_h264_output_cb output_cb,
+                                  encoder_hardware_h264_input_release_cb
+                                      input_release_cb,
                                   encoder_hardware_h264_t **enc) {
     *enc = malloc(sizeof(encoder_hardware_h264_priv_t));
     encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)(*enc);
@@ -138,20 +491,18 @@ bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
         goto failed;
     }
 
-    bool res2 = fill_dynamic_params(encp->fd, is_secondary, params);
+    const parameters_stream_t *stream_params = &params->streams[stream];
+
+    bool res2 = fill_dynamic_params(encp->fd, stream_params);
     if (!res2) {
         goto failed;
     }
 
-    const char *h264_profile =
-        (!is_secondary) ? params->h264_profile : params->secondary_h264_profile;
-    const char *h264_level =
-        (!is_secondary) ? params->h264_level : params->secondary_h264_level;
-    unsigned int width =
-        (!is_secondary) ? params->width : params->secondary_width;
-    unsigned int height =
-        (!is_secondary) ? params->height : params->secondary_height;
-    float fps = (!is_secondary) ? params->fps : params->secondary_fps;
+    const char *h264_profile = stream_params->h264_profile;
+    const char *h264_level = stream_params->h264_level;
+    unsigned int width = stream_params->width;
+    unsigned int height = stream_params->height;
+    float fps = stream_params->fps;
 
     struct v4l2_control ctrl = {0};
     ctrl.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
@@ -216,7 +567,8 @@ bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
     fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
     fmt.fmt.pix_mp.num_planes = 1;
     fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
-    fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 512 << 10;
+    fmt.fmt.pix_mp.plane_fmt[0].sizeimage =
+        capture_buffer_size(params, stream_params, frame_size);
     res = ioctl(encp->fd, VIDIOC_S_FMT, &fmt);
     if (res != 0) {
         set_error("unable to set capture format");
@@ -234,7 +586,7 @@ bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
     }
 
     struct v4l2_requestbuffers reqbufs = {0};
-    reqbufs.count = params->buffer_count;
+    reqbufs.count = buffer_count;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     reqbufs.memory = V4L2_MEMORY_DMABUF;
     res = ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
@@ -243,48 +595,32 @@ bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
         goto failed;
     }
 
-    reqbufs.count = params->buffer_count;
-    reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    reqbufs.memory = V4L2_MEMORY_MMAP;
-    res = ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
-    if (res != 0) {
-        set_error("unable to set capture buffers");
-        goto failed;
-    }
-
-    encp->capture_buffers = malloc(sizeof(void *) * reqbufs.count);
-    encp->ntp_timestamps = malloc(sizeof(uint64_t) * reqbufs.count);
-
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-    struct v4l2_buffer buffer = {0};
+    encp->capture_size = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
 
-    for (unsigned int i = 0; i < reqbufs.count; i++) {
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        buffer.index = i;
-        buffer.length = 1;
-        buffer.m.planes = planes;
-        int res = ioctl(encp->fd, VIDIOC_QUERYBUF, &buffer);
-        if (res != 0) {
-            set_error("unable to query buffer");
-            goto failed;
-        }
-
-        encp->capture_buffers[i] =
-            mmap(0, buffer.m.planes[0].length, PROT_READ | PROT_WRITE,
-                 MAP_SHARED, encp->fd, buffer.m.planes[0].m.mem_offset);
-        if (encp->capture_buffers[i] == MAP_FAILED) {
-            set_error("mmap() failed");
-            goto failed;
+    if (params->output_zero_copy) {
+        // buffers are kept by the pipe until the reader consumes them,
+        // therefore more buffers are needed.
+        encp->zero_copy =
+            setup_capture_dmabuf(encp, buffer_count * 2);
+        if (!encp->zero_copy) {
+            fprintf(stderr, "unable to allocate DMA-BUF capture buffers, "
+                            "zero-copy output is disabled\n");
         }
+    }
 
-        res = ioctl(encp->fd, VIDIOC_QBUF, &buffer);
-        if (res != 0) {
-            set_error("ioctl(VIDIOC_QBUF) failed");
+    if (!encp->zero_copy) {
+        bool ok = setup_capture_mmap(encp, buffer_count);
+        if (!ok) {
             goto failed;
         }
     }
 
+    encp->dts_timestamps = malloc(sizeof(uint64_t) * buffer_count);
+    encp->ntp_timestamps = malloc(sizeof(uint64_t) * buffer_count);
+    encp->done_dts = calloc(buffer_count, sizeof(uint64_t));
+    encp->done_ntp = calloc(buffer_count, sizeof(uint64_t));
+    encp->inputs = calloc(buffer_count, sizeof(void *));
+
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     res = ioctl(encp->fd, VIDIOC_STREAMON, &type);
     if (res != 0) {
@@ -299,10 +635,13 @@ bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
     }
 
     encp->frame_size = frame_size;
-    encp->buffer_count = params->buffer_count;
+    encp->buffer_count = buffer_count;
     encp->cur_buffer = 0;
-    encp->is_secondary = is_secondary;
+    encp->stream = stream;
+    encp->idr_period = stream_params->idr_period;
+    encp->bitrate = stream_params->bitrate;
     encp->output_cb = output_cb;
+    encp->input_release_cb = input_release_cb;
     pthread_mutex_init(&encp->destroyed_mutex, NULL);
     encp->destroyed = false;
 
@@ -311,7 +650,9 @@ bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
     return true;
 
 failed:
-    if (encp->capture_buffers != NULL) {
+    if (encp->zero_copy) {
+        free_capture_dmabuf(encp);
+    } else if (encp->capture_buffers != NULL) {
         free(encp->capture_buffers);
     }
     if (encp->fd >= 0) {
@@ -323,13 +664,16 @@ failed:
 
 void encoder_hardware_h264_encode(encoder_hardware_h264_t *enc,
                                   uint8_t *buffer_mapped, int buffer_fd,
-                                  uint64_t dts, uint64_t ntp) {
+                                  int buffer_offset, uint64_t dts,
+                                  uint64_t ntp, void *input) {
     encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
 
     int index = encp->cur_buffer++;
     encp->cur_buffer %= encp->buffer_count;
 
+    encp->dts_timestamps[index] = dts;
     encp->ntp_timestamps[index] = ntp;
+    encp->inputs[index] = input;
 
     struct v4l2_buffer buf = {0};
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
@@ -341,21 +685,108 @@ void encoder_hardware_h264_encode(encoder_hardware_h264_t *enc,
     buf.timestamp.tv_sec = dts / 1000000;
     buf.timestamp.tv_usec = dts % 1000000;
     buf.m.planes = planes;
+    // frames that are slices of a larger buffer are located with
+    // data_offset, that is part of bytesused.
     buf.m.planes[0].m.fd = buffer_fd;
-    buf.m.planes[0].bytesused = encp->frame_size;
-    buf.m.planes[0].length = encp->frame_size;
+    buf.m.planes[0].data_offset = buffer_offset;
+    buf.m.planes[0].bytesused = buffer_offset + encp->frame_size;
+    buf.m.planes[0].length = buffer_offset + encp->frame_size;
     int res = ioctl(encp->fd, VIDIOC_QBUF, &buf);
     if (res != 0) {
         fprintf(stderr,
                 "encoder_hardware_h264_encode(): ioctl(VIDIOC_QBUF) failed\n");
         // it happens when the raspberry is under pressure. do not exit.
+        atomic_fetch_add(&encp->input_errors, 1);
+        encp->inputs[index] = NULL;
+        encp->input_release_cb(encp->stream, input);
     }
 }
 
 void encoder_hardware_h264_reload_params(encoder_hardware_h264_t *enc,
                                          const parameters_t *params) {
     encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
-    fill_dynamic_params(encp->fd, encp->is_secondary, params);
+
+    unsigned int idr_period = params->streams[encp->stream].idr_period;
+    unsigned int bitrate = params->streams[encp->stream].bitrate;
+
+    if (idr_period != encp->idr_period) {
+        struct v4l2_control ctrl = {0};
+        ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+        ctrl.value = idr_period;
+        int res = ioctl(encp->fd, VIDIOC_S_CTRL, &ctrl);
+        if (res != 0) {
+            fprintf(stderr, "unable to set IDR period\n");
+        }
+        encp->idr_period = idr_period;
+    }
+
+    if (bitrate != encp->bitrate) {
+        encoder_hardware_h264_set_bitrate(enc, bitrate);
+    }
+}
+
+void encoder_hardware_h264_set_bitrate(encoder_hardware_h264_t *enc,
+                                       unsigned int bitrate) {
+    encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
+
+    struct v4l2_control ctrl = {0};
+    ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+    ctrl.value = bitrate;
+    int res = ioctl(encp->fd, VIDIOC_S_CTRL, &ctrl);
+    if (res != 0) {
+        fprintf(stderr, "unable to set bitrate\n");
+    }
+    encp->bitrate = bitrate;
+}
+
+void encoder_hardware_h264_set_fps(encoder_hardware_h264_t *enc, float fps) {
+    encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
+
+    // the frame rate is only used by the rate control.
+    struct v4l2_streamparm parm = {0};
+    parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    parm.parm.output.timeperframe.numerator = 1;
+    parm.parm.output.timeperframe.denominator = fps;
+    int res = ioctl(encp->fd, VIDIOC_S_PARM, &parm);
+    if (res != 0) {
+        fprintf(stderr, "unable to set fps\n");
+    }
+}
+
+void encoder_hardware_h264_force_idr(encoder_hardware_h264_t *enc) {
+    encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
+
+    struct v4l2_control ctrl = {0};
+    ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    ctrl.value = 1;
+    int res = ioctl(encp->fd, VIDIOC_S_CTRL, &ctrl);
+    if (res != 0) {
+        fprintf(stderr, "unable to force IDR\n");
+    }
+}
+
+uint64_t encoder_hardware_h264_get_input_errors(encoder_hardware_h264_t *enc) {
+    encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
+    return atomic_load(&encp->input_errors);
+}
+
+void encoder_hardware_h264_release_output(encoder_hardware_h264_t *enc,
+                                          const uint8_t *buffer) {
+    encoder_hardware_h264_priv_t *encp = (encoder_hardware_h264_priv_t *)enc;
+
+    for (int i = 0; i < encp->capture_count; i++) {
+        if (encp->capture_buffers[i] == buffer) {
+            struct dma_buf_sync dma_sync = {0};
+            dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+            ioctl(encp->capture_fds[i], DMA_BUF_IOCTL_SYNC, &dma_sync);
+
+            if (!queue_capture_dmabuf(encp, i) && !is_destroyed_safe(encp)) {
+                fprintf(stderr, "encoder_hardware_h264_release_output(): "
+                                "ioctl(VIDIOC_QBUF) failed\n");
+            }
+            return;
+        }
+    }
 }
 
 void encoder_hardware_h264_destroy(encoder_hardware_h264_t *enc) {
@@ -376,6 +807,15 @@ void encoder_hardware_h264_destroy(encoder_hardware_h264_t *enc) {
     pthread_join(encp->output_thread, NULL);
     pthread_mutex_destroy(&encp->destroyed_mutex);
 
+    // inputs that were still owned by the encoder are returned by
+    // VIDIOC_STREAMOFF and must be given back, in order to allow the camera
+    // to reuse them.
+    for (int i = 0; i < encp->buffer_count; i++) {
+        if (encp->inputs[i] != NULL) {
+            encp->input_release_cb(encp->stream, encp->inputs[i]);
+        }
+    }
+
     struct v4l2_requestbuffers reqbufs = {0};
     reqbufs.count = 0;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -383,12 +823,21 @@ void encoder_hardware_h264_destroy(encoder_hardware_h264_t *enc) {
     ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
 
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    reqbufs.memory = V4L2_MEMORY_MMAP;
+    reqbufs.memory = (encp->zero_copy) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
     ioctl(encp->fd, VIDIOC_REQBUFS, &reqbufs);
 
     close(encp->fd);
 
-    free(encp->capture_buffers);
+    if (encp->zero_copy) {
+        free_capture_dmabuf(encp);
+    } else {
+        free(encp->capture_buffers);
+    }
+    free(encp->dts_timestamps);
     free(encp->ntp_timestamps);
+    free(encp->done_dts);
+    free(encp->done_ntp);
+    free(encp->inputs);
+    free(encp->overflow_buf);
     free(encp);
 }
@@ -5,20 +5,34 @@
 
 typedef void encoder_hardware_h264_t;
 
-typedef void (*encoder_hardware_h264_output_cb)(const uint8_t *buffer,
-                                                uint64_t size, uint64_t dts,
-                                                uint64_t ntp);
+typedef void (*encoder_hardware_h264_output_cb)(
+    int stream, const uint8_t *buffer, uint64_t size, uint64_t dts,
+    uint64_t ntp, uint32_t flags, const uint32_t *nal_sizes, int nal_count);
+
+typedef void (*encoder_hardware_h264_input_release_cb)(int stream,
+                                                       void *input);
 
 const char *encoder_hardware_h264_get_error();
-bool encoder_hardware_h264_create(bool is_secondary, const parameters_t *params,
+bool encoder_hardware_h264_create(int stream, const parameters_t *params,
                                   int frame_size, int stride, int colorspace,
+                                  int buffer_count,
                                   encoder_hardware_h264_output_cb output_cb,
+                                  encoder_hardware_h264_input_release_cb
+                                      input_release_cb,
                                   encoder_hardware_h264_t **enc);
 void encoder_hardware_h264_encode(encoder_hardware_h264_t *enc,
                                   uint8_t *buffer_mapped, int buffer_fd,
-                                  uint64_t dts, uint64_t ntp);
+                                  int buffer_offset, uint64_t dts,
+                                  uint64_t ntp, void *input);
 void encoder_hardware_h264_reload_params(encoder_hardware_h264_t *enc,
                                          const parameters_t *params);
+void encoder_hardware_h264_set_bitrate(encoder_hardware_h264_t *enc,
+                                       unsigned int bitrate);
+void encoder_hardware_h264_set_fps(encoder_hardware_h264_t *enc, float fps);
+void encoder_hardware_h264_force_idr(encoder_hardware_h264_t *enc);
+uint64_t encoder_hardware_h264_get_input_errors(encoder_hardware_h264_t *enc);
+void encoder_hardware_h264_release_output(encoder_hardware_h264_t *enc,
+                                          const uint8_t *buffer);
 void encoder_hardware_h264_destroy(encoder_hardware_h264_t *enc);
 
 #endif
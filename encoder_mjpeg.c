@@ -8,13 +8,16 @@
 
 #include <jpeglib.h>
 
+#include "encoder.h"
 #include "encoder_mjpeg.h"
+#include "stats.h"
 
 static char errbuf[256];
 
 const char *encoder_mjpeg_get_error() { return errbuf; }
 
 typedef struct {
+    int stream;
     int width;
     int height;
     int quality;
@@ -23,10 +26,13 @@ typedef struct {
     pthread_cond_t cond;
     pthread_t thread;
     bool data_queued;
+    bool terminate;
     uint8_t *data_buffer;
     uint64_t data_dts;
     uint64_t data_ntp;
+    void *data_input;
     encoder_mjpeg_output_cb output_cb;
+    encoder_mjpeg_input_release_cb input_release_cb;
 } encoder_mjpeg_priv_t;
 
 static void save_as_jpeg(unsigned int width, unsigned int height,
@@ -79,16 +85,24 @@ static void save_as_jpeg(unsigned int width, unsigned int height,
 static void *thread_main(void *userdata) {
     encoder_mjpeg_priv_t *encp = (encoder_mjpeg_priv_t *)userdata;
 
+    stats_register_thread("encoder_mjpeg");
+
     while (true) {
         pthread_mutex_lock(&encp->mutex);
 
-        while (!encp->data_queued) {
+        while (!encp->data_queued && !encp->terminate) {
             pthread_cond_wait(&encp->cond, &encp->mutex);
         }
 
+        if (encp->terminate) {
+            pthread_mutex_unlock(&encp->mutex);
+            break;
+        }
+
         uint8_t *buffer = encp->data_buffer;
         uint64_t dts = encp->data_dts;
         uint64_t ntp = encp->data_ntp;
+        void *input = encp->data_input;
         encp->data_queued = false;
 
         pthread_cond_signal(&encp->cond);
@@ -100,36 +114,43 @@ static void *thread_main(void *userdata) {
         save_as_jpeg(encp->width, encp->height, encp->quality, encp->stride,
                      buffer, &out_buf, &out_size);
 
-        encp->output_cb(out_buf, out_size, dts, ntp);
+        encp->input_release_cb(encp->stream, input);
+
+        encp->output_cb(encp->stream, out_buf, out_size, dts, ntp,
+                        ENCODER_OUTPUT_KEYFRAME, NULL, 0);
 
         free(out_buf);
     }
 
+    stats_unregister_thread();
     return NULL;
 }
 
-bool encoder_mjpeg_create(bool is_secondary, const parameters_t *params,
-                          int stride, encoder_mjpeg_output_cb output_cb,
+bool encoder_mjpeg_create(int stream, const parameters_t *params, int stride,
+                          encoder_mjpeg_output_cb output_cb,
+                          encoder_mjpeg_input_release_cb input_release_cb,
                           encoder_mjpeg_t **enc) {
     *enc = malloc(sizeof(encoder_mjpeg_priv_t));
     encoder_mjpeg_priv_t *encp = (encoder_mjpeg_priv_t *)(*enc);
     memset(encp, 0, sizeof(encoder_mjpeg_priv_t));
 
-    encp->width = (!is_secondary) ? params->width : params->secondary_width;
-    encp->height = (!is_secondary) ? params->height : params->secondary_height;
-    encp->quality = (!is_secondary) ? params->mjpeg_quality
-                                    : params->secondary_mjpeg_quality;
+    encp->stream = stream;
+    encp->width = params->streams[stream].width;
+    encp->height = params->streams[stream].height;
+    encp->quality = params->streams[stream].mjpeg_quality;
     encp->stride = stride;
     pthread_mutex_init(&encp->mutex, NULL);
     pthread_cond_init(&encp->cond, NULL);
     pthread_create(&encp->thread, NULL, thread_main, encp);
     encp->output_cb = output_cb;
+    encp->input_release_cb = input_release_cb;
 
     return true;
 }
 
 void encoder_mjpeg_encode(encoder_mjpeg_t *enc, uint8_t *buffer_mapped,
-                          int buffer_fd, uint64_t dts, uint64_t ntp) {
+                          int buffer_fd, int buffer_offset, uint64_t dts,
+                          uint64_t ntp, void *input) {
     encoder_mjpeg_priv_t *encp = (encoder_mjpeg_priv_t *)enc;
 
     pthread_mutex_lock(&encp->mutex);
@@ -142,6 +163,7 @@ void encoder_mjpeg_encode(encoder_mjpeg_t *enc, uint8_t *buffer_mapped,
     encp->data_buffer = buffer_mapped;
     encp->data_dts = dts;
     encp->data_ntp = ntp;
+    encp->data_input = input;
 
     pthread_cond_signal(&encp->cond);
 
@@ -150,3 +172,23 @@ void encoder_mjpeg_encode(encoder_mjpeg_t *enc, uint8_t *buffer_mapped,
 
 void encoder_mjpeg_reload_params(encoder_mjpeg_t *enc,
                                  const parameters_t *params) {}
+
+void encoder_mjpeg_destroy(encoder_mjpeg_t *enc) {
+    encoder_mjpeg_priv_t *encp = (encoder_mjpeg_priv_t *)enc;
+
+    pthread_mutex_lock(&encp->mutex);
+    encp->terminate = true;
+    pthread_cond_broadcast(&encp->cond);
+    pthread_mutex_unlock(&encp->mutex);
+
+    pthread_join(encp->thread, NULL);
+
+    // a frame that has been queued but not encoded is given back.
+    if (encp->data_queued) {
+        encp->input_release_cb(encp->stream, encp->data_input);
+    }
+
+    pthread_cond_destroy(&encp->cond);
+    pthread_mutex_destroy(&encp->mutex);
+    free(encp);
+}
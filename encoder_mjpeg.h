@@ -5,15 +5,24 @@
 
 typedef void encoder_mjpeg_t;
 
-typedef void (*encoder_mjpeg_output_cb)(const uint8_t *buffer, uint64_t size,
-                                        uint64_t dts, uint64_t ntp);
+typedef void (*encoder_mjpeg_output_cb)(int stream, const uint8_t *buffer,
+                                        uint64_t size, uint64_t dts,
+                                        uint64_t ntp, uint32_t flags,
+                                        const uint32_t *nal_sizes,
+                                        int nal_count);
+
+typedef void (*encoder_mjpeg_input_release_cb)(int stream,
+                                               void *input);
 
 const char *encoder_mjpeg_get_error();
-bool encoder_mjpeg_create(bool is_secondary, const parameters_t *params,
-                          int stride, encoder_mjpeg_output_cb output_cb,
+bool encoder_mjpeg_create(int stream, const parameters_t *params, int stride,
+                          encoder_mjpeg_output_cb output_cb,
+                          encoder_mjpeg_input_release_cb input_release_cb,
                           encoder_mjpeg_t **enc);
 void encoder_mjpeg_encode(encoder_mjpeg_t *enc, uint8_t *buffer_mapped,
-                          int buffer_fd, uint64_t dts, uint64_t ntp);
+                          int buffer_fd, int buffer_offset, uint64_t dts,
+                          uint64_t ntp, void *input);
 void encoder_mjpeg_reload_params(encoder_mjpeg_t *enc,
                                  const parameters_t *params);
+void encoder_mjpeg_destroy(encoder_mjpeg_t *enc);
 #endif
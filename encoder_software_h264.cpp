@@ -7,7 +7,10 @@
 #include <linux/videodev2.h>
 #include <wels/codec_api.h>
 
+#include "encoder.h"
 #include "encoder_software_h264.h"
+#include "pipe.h"
+#include "stats.h"
 
 static char errbuf[256];
 
@@ -20,8 +23,8 @@ static void set_error(const char *format, ...) {
 const char *encoder_software_h264_get_error() { return errbuf; }
 
 typedef struct {
-    const parameters_t *params;
     encoder_software_h264_output_cb output_cb;
+    encoder_software_h264_input_release_cb input_release_cb;
     ISVCEncoder *encoder;
     SEncParamExt enc_params;
     SSourcePicture pic;
@@ -31,19 +34,24 @@ typedef struct {
     pthread_cond_t queue_cond;
     pthread_t thread;
     bool data_queued;
+    bool terminate;
     uint8_t *data_buffer;
     uint64_t data_dts;
     uint64_t data_ntp;
-    bool is_secondary;
+    void *data_input;
+    int stream;
+    unsigned int height;
+    unsigned int idr_period;
+    unsigned int bitrate;
+    uint8_t *au_buffer;
+    uint64_t au_buffer_size;
 } encoder_software_h264_priv_t;
 
 static void encode(encoder_software_h264_priv_t *encp, uint8_t *buffer,
-                   uint64_t dts, uint64_t ntp) {
+                   uint64_t dts, uint64_t ntp, void *input) {
     pthread_mutex_lock(&encp->mutex);
 
-    unsigned int height = (!encp->is_secondary)
-                              ? encp->params->height
-                              : encp->params->secondary_height;
+    unsigned int height = encp->height;
 
     encp->pic.pData[0] = buffer; // Y
     encp->pic.pData[1] =
@@ -54,6 +62,10 @@ static void encode(encoder_software_h264_priv_t *encp, uint8_t *buffer,
 
     memset(&encp->info, 0, sizeof(SFrameBSInfo));
     int res = encp->encoder->EncodeFrame(&encp->pic, &encp->info);
+
+    // the picture is copied into the encoder, release it as soon as possible.
+    encp->input_release_cb(encp->stream, input);
+
     if (res != 0) {
         fprintf(stderr, "EncodeFrame() failed\n");
         pthread_mutex_unlock(&encp->mutex);
@@ -62,67 +74,163 @@ static void encode(encoder_software_h264_priv_t *encp, uint8_t *buffer,
 
     pthread_mutex_unlock(&encp->mutex);
 
-    if (encp->info.eFrameType != videoFrameTypeSkip) {
-        for (int i = 0; i < encp->info.iLayerNum; i++) {
-            const SLayerBSInfo *layer_info = &encp->info.sLayerInfo[i];
+    if (encp->info.eFrameType == videoFrameTypeSkip) {
+        return;
+    }
+
+    // layers are merged into a single access unit.
+    uint32_t nal_sizes[PIPE_MAX_NALS];
+    int nal_count = 0;
+    uint64_t au_size = 0;
+    bool contiguous = true;
+    uint32_t flags = 0;
+
+    if (encp->info.eFrameType == videoFrameTypeIDR) {
+        flags |= ENCODER_OUTPUT_KEYFRAME;
+    }
+
+    for (int i = 0; i < encp->info.iLayerNum; i++) {
+        const SLayerBSInfo *layer_info = &encp->info.sLayerInfo[i];
+
+        if (layer_info->uiLayerType == NON_VIDEO_CODING_LAYER) {
+            flags |= ENCODER_OUTPUT_PARAMETER_SETS;
+        }
+
+        if (layer_info->pBsBuf != encp->info.sLayerInfo[0].pBsBuf + au_size) {
+            contiguous = false;
+        }
 
-            uint64_t frame_size = 0;
-            for (int j = 0; j < layer_info->iNalCount; j++) {
-                frame_size += layer_info->pNalLengthInByte[j];
+        for (int j = 0; j < layer_info->iNalCount; j++) {
+            if (nal_count < PIPE_MAX_NALS) {
+                nal_sizes[nal_count] = layer_info->pNalLengthInByte[j];
             }
+            nal_count++;
+            au_size += layer_info->pNalLengthInByte[j];
+        }
+    }
+
+    if (nal_count > PIPE_MAX_NALS) {
+        nal_count = 0;
+    }
+
+    if (encp->info.iLayerNum == 0 || au_size == 0) {
+        return;
+    }
 
-            encp->output_cb(layer_info->pBsBuf, frame_size, dts, ntp);
+    // layers are usually stored one after the other inside the bitstream
+    // buffer of the encoder. Otherwise, copy them.
+    if (contiguous) {
+        encp->output_cb(encp->stream, encp->info.sLayerInfo[0].pBsBuf,
+                        au_size, dts, ntp, flags, nal_sizes, nal_count);
+        return;
+    }
+
+    if (au_size > encp->au_buffer_size) {
+        free(encp->au_buffer);
+        encp->au_buffer = (uint8_t *)malloc(au_size);
+        encp->au_buffer_size = au_size;
+    }
+
+    uint64_t pos = 0;
+    for (int i = 0; i < encp->info.iLayerNum; i++) {
+        const SLayerBSInfo *layer_info = &encp->info.sLayerInfo[i];
+
+        uint64_t layer_size = 0;
+        for (int j = 0; j < layer_info->iNalCount; j++) {
+            layer_size += layer_info->pNalLengthInByte[j];
         }
+
+        memcpy(&encp->au_buffer[pos], layer_info->pBsBuf, layer_size);
+        pos += layer_size;
+    }
+
+    encp->output_cb(encp->stream, encp->au_buffer, au_size, dts, ntp, flags,
+                    nal_sizes, nal_count);
+}
+
+// the maximum bitrate must always be greater than the target bitrate,
+// therefore the order of the two options depends on the direction.
+static void set_bitrate(encoder_software_h264_priv_t *encp,
+                        unsigned int old_bitrate, unsigned int bitrate) {
+    SBitrateInfo bitrateInfo;
+    bitrateInfo.iLayer = SPATIAL_LAYER_0;
+
+    if (bitrate > old_bitrate) {
+        bitrateInfo.iBitrate = (int)((double)bitrate * 1.2f);
+        encp->encoder->SetOption(ENCODER_OPTION_MAX_BITRATE, &bitrateInfo);
+
+        bitrateInfo.iBitrate = bitrate;
+        encp->encoder->SetOption(ENCODER_OPTION_BITRATE, &bitrateInfo);
+    } else {
+        bitrateInfo.iBitrate = bitrate;
+        encp->encoder->SetOption(ENCODER_OPTION_BITRATE, &bitrateInfo);
+
+        bitrateInfo.iBitrate = (int)((double)bitrate * 1.2f);
+        encp->encoder->SetOption(ENCODER_OPTION_MAX_BITRATE, &bitrateInfo);
     }
+
+    encp->bitrate = bitrate;
 }
 
 static void *thread_main(void *userdata) {
     encoder_software_h264_priv_t *encp =
         (encoder_software_h264_priv_t *)userdata;
 
+    char name[16];
+    if (encp->stream == 0) {
+        snprintf(name, sizeof(name), "encoder");
+    } else {
+        snprintf(name, sizeof(name), "encoder_%d", encp->stream);
+    }
+    stats_register_thread(name);
+
     while (true) {
         pthread_mutex_lock(&encp->queue_mutex);
 
-        while (!encp->data_queued) {
+        while (!encp->data_queued && !encp->terminate) {
             pthread_cond_wait(&encp->queue_cond, &encp->queue_mutex);
         }
 
+        if (encp->terminate) {
+            pthread_mutex_unlock(&encp->queue_mutex);
+            break;
+        }
+
         uint8_t *buffer = encp->data_buffer;
         uint64_t dts = encp->data_dts;
         uint64_t ntp = encp->data_ntp;
+        void *input = encp->data_input;
         encp->data_queued = false;
 
         pthread_cond_signal(&encp->queue_cond);
 
         pthread_mutex_unlock(&encp->queue_mutex);
 
-        encode(encp, buffer, dts, ntp);
+        encode(encp, buffer, dts, ntp, input);
     }
 
+    stats_unregister_thread();
     return NULL;
 }
 
-bool encoder_software_h264_create(bool is_secondary, const parameters_t *params,
+bool encoder_software_h264_create(int stream, const parameters_t *params,
                                   int stride, int colorspace,
                                   encoder_software_h264_output_cb output_cb,
+                                  encoder_software_h264_input_release_cb
+                                      input_release_cb,
                                   encoder_software_h264_t **enc) {
     *enc = malloc(sizeof(encoder_software_h264_priv_t));
     encoder_software_h264_priv_t *encp = (encoder_software_h264_priv_t *)(*enc);
     memset(encp, 0, sizeof(encoder_software_h264_priv_t));
 
-    unsigned int width =
-        (!is_secondary) ? params->width : params->secondary_width;
-    unsigned int height =
-        (!is_secondary) ? params->height : params->secondary_height;
-    float fps = (!is_secondary) ? params->fps : params->secondary_fps;
-    unsigned int bitrate =
-        (!is_secondary) ? params->bitrate : params->secondary_bitrate;
-    unsigned int idr_period =
-        (!is_secondary) ? params->idr_period : params->secondary_idr_period;
-    const char *h264_profile =
-        (!is_secondary) ? params->h264_profile : params->secondary_h264_profile;
-    const char *h264_level =
-        (!is_secondary) ? params->h264_level : params->secondary_h264_level;
+    const parameters_stream_t *stream_params = &params->streams[stream];
+    unsigned int width = stream_params->width;
+    unsigned int height = stream_params->height;
+    float fps = stream_params->fps;
+    unsigned int bitrate = stream_params->bitrate;
+    unsigned int idr_period = stream_params->idr_period;
+    const char *h264_profile = stream_params->h264_profile;
+    const char *h264_level = stream_params->h264_level;
 
     int videoFormat;
 
@@ -208,9 +316,12 @@ bool encoder_software_h264_create(bool is_secondary, const parameters_t *params,
     encp->pic.iStride[1] = stride >> 1;
     encp->pic.iStride[2] = stride >> 1;
 
-    encp->params = params;
     encp->output_cb = output_cb;
-    encp->is_secondary = is_secondary;
+    encp->input_release_cb = input_release_cb;
+    encp->stream = stream;
+    encp->height = height;
+    encp->idr_period = idr_period;
+    encp->bitrate = bitrate;
     pthread_mutex_init(&encp->mutex, NULL);
 
     pthread_mutex_init(&encp->queue_mutex, NULL);
@@ -226,7 +337,8 @@ failed:
 
 void encoder_software_h264_encode(encoder_software_h264_t *enc,
                                   uint8_t *buffer_mapped, int buffer_fd,
-                                  uint64_t dts, uint64_t ntp) {
+                                  int buffer_offset, uint64_t dts,
+                                  uint64_t ntp, void *input) {
     encoder_software_h264_priv_t *encp = (encoder_software_h264_priv_t *)enc;
 
     pthread_mutex_lock(&encp->queue_mutex);
@@ -239,6 +351,7 @@ void encoder_software_h264_encode(encoder_software_h264_t *enc,
     encp->data_buffer = buffer_mapped;
     encp->data_dts = dts;
     encp->data_ntp = ntp;
+    encp->data_input = input;
 
     pthread_cond_signal(&encp->queue_cond);
 
@@ -251,44 +364,70 @@ void encoder_software_h264_reload_params(encoder_software_h264_t *enc,
 
     pthread_mutex_lock(&encp->mutex);
 
-    unsigned int old_idr_period = (!encp->is_secondary)
-                                      ? encp->params->idr_period
-                                      : encp->params->secondary_idr_period;
-    unsigned int old_bitrate = (!encp->is_secondary)
-                                   ? encp->params->bitrate
-                                   : encp->params->secondary_bitrate;
-    unsigned int idr_period = (!encp->is_secondary)
-                                  ? params->idr_period
-                                  : params->secondary_idr_period;
-    unsigned int bitrate =
-        (!encp->is_secondary) ? params->bitrate : params->secondary_bitrate;
-
-    if (idr_period != old_idr_period) {
+    unsigned int idr_period = params->streams[encp->stream].idr_period;
+    unsigned int bitrate = params->streams[encp->stream].bitrate;
+
+    if (idr_period != encp->idr_period) {
         int32_t idrInterval = idr_period;
         encp->encoder->SetOption(ENCODER_OPTION_IDR_INTERVAL, &idrInterval);
+        encp->idr_period = idr_period;
     }
 
-    if (bitrate != old_bitrate) {
-        if (bitrate > old_bitrate) {
-            SBitrateInfo bitrateInfo;
-            bitrateInfo.iLayer = SPATIAL_LAYER_0;
-            bitrateInfo.iBitrate = (int)((double)bitrate * 1.2f);
-            encp->encoder->SetOption(ENCODER_OPTION_MAX_BITRATE, &bitrateInfo);
-
-            bitrateInfo.iBitrate = bitrate;
-            encp->encoder->SetOption(ENCODER_OPTION_BITRATE, &bitrateInfo);
-        } else {
-            SBitrateInfo bitrateInfo;
-            bitrateInfo.iLayer = SPATIAL_LAYER_0;
-            bitrateInfo.iBitrate = bitrate;
-            encp->encoder->SetOption(ENCODER_OPTION_BITRATE, &bitrateInfo);
-
-            bitrateInfo.iBitrate = (int)((double)bitrate * 1.2f);
-            encp->encoder->SetOption(ENCODER_OPTION_MAX_BITRATE, &bitrateInfo);
-        }
+    if (bitrate != encp->bitrate) {
+        set_bitrate(encp, encp->bitrate, bitrate);
     }
 
-    encp->params = params;
+    pthread_mutex_unlock(&encp->mutex);
+}
+
+void encoder_software_h264_set_bitrate(encoder_software_h264_t *enc,
+                                       unsigned int bitrate) {
+    encoder_software_h264_priv_t *encp = (encoder_software_h264_priv_t *)enc;
+
+    pthread_mutex_lock(&encp->mutex);
+
+    set_bitrate(encp, encp->bitrate, bitrate);
+
+    pthread_mutex_unlock(&encp->mutex);
+}
+
+void encoder_software_h264_set_fps(encoder_software_h264_t *enc, float fps) {
+    encoder_software_h264_priv_t *encp = (encoder_software_h264_priv_t *)enc;
+
+    pthread_mutex_lock(&encp->mutex);
+    encp->encoder->SetOption(ENCODER_OPTION_FRAME_RATE, &fps);
+    pthread_mutex_unlock(&encp->mutex);
+}
 
+void encoder_software_h264_force_idr(encoder_software_h264_t *enc) {
+    encoder_software_h264_priv_t *encp = (encoder_software_h264_priv_t *)enc;
+
+    pthread_mutex_lock(&encp->mutex);
+    encp->encoder->ForceIntraFrame(true);
     pthread_mutex_unlock(&encp->mutex);
 }
+
+void encoder_software_h264_destroy(encoder_software_h264_t *enc) {
+    encoder_software_h264_priv_t *encp = (encoder_software_h264_priv_t *)enc;
+
+    pthread_mutex_lock(&encp->queue_mutex);
+    encp->terminate = true;
+    pthread_cond_broadcast(&encp->queue_cond);
+    pthread_mutex_unlock(&encp->queue_mutex);
+
+    pthread_join(encp->thread, NULL);
+
+    // a frame that has been queued but not encoded is given back.
+    if (encp->data_queued) {
+        encp->input_release_cb(encp->stream, encp->data_input);
+    }
+
+    encp->encoder->Uninitialize();
+    WelsDestroySVCEncoder(encp->encoder);
+
+    pthread_cond_destroy(&encp->queue_cond);
+    pthread_mutex_destroy(&encp->queue_mutex);
+    pthread_mutex_destroy(&encp->mutex);
+    free(encp->au_buffer);
+    free(encp);
+}
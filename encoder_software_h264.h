@@ -5,24 +5,35 @@
 
 typedef void encoder_software_h264_t;
 
-typedef void (*encoder_software_h264_output_cb)(const uint8_t *buffer,
-                                                uint64_t size, uint64_t dts,
-                                                uint64_t ntp);
+typedef void (*encoder_software_h264_output_cb)(
+    int stream, const uint8_t *buffer, uint64_t size, uint64_t dts,
+    uint64_t ntp, uint32_t flags, const uint32_t *nal_sizes, int nal_count);
+
+typedef void (*encoder_software_h264_input_release_cb)(int stream,
+                                                       void *input);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 const char *encoder_software_h264_get_error();
-bool encoder_software_h264_create(bool is_secondary, const parameters_t *params,
+bool encoder_software_h264_create(int stream, const parameters_t *params,
                                   int stride, int colorspace,
                                   encoder_software_h264_output_cb output_cb,
+                                  encoder_software_h264_input_release_cb
+                                      input_release_cb,
                                   encoder_software_h264_t **enc);
 void encoder_software_h264_encode(encoder_software_h264_t *enc,
                                   uint8_t *buffer_mapped, int buffer_fd,
-                                  uint64_t dts, uint64_t ntp);
+                                  int buffer_offset, uint64_t dts,
+                                  uint64_t ntp, void *input);
 void encoder_software_h264_reload_params(encoder_software_h264_t *enc,
                                          const parameters_t *params);
+void encoder_software_h264_set_bitrate(encoder_software_h264_t *enc,
+                                       unsigned int bitrate);
+void encoder_software_h264_set_fps(encoder_software_h264_t *enc, float fps);
+void encoder_software_h264_force_idr(encoder_software_h264_t *enc);
+void encoder_software_h264_destroy(encoder_software_h264_t *enc);
 
 #ifdef __cplusplus
 }
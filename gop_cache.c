@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gop_cache.h"
+
+// cache of the frames received since the last keyframe.
+//
+// frames are copied into an arena that is allocated once. When a keyframe
+// is received, the cache is emptied. When the GOP doesn't fit into the
+// arena, the cache is invalidated until the next keyframe, since a partial
+// GOP cannot be decoded.
+
+typedef struct {
+    uint8_t *arena;
+    uint32_t arena_size;
+    gop_cache_frame_t *frames;
+    int max_frames;
+    int count;
+    uint32_t used;
+    bool valid;
+} gop_cache_priv_t;
+
+bool gop_cache_create(uint32_t size, int max_frames, gop_cache_t **cache) {
+    *cache = malloc(sizeof(gop_cache_priv_t));
+    gop_cache_priv_t *cachep = (gop_cache_priv_t *)(*cache);
+    memset(cachep, 0, sizeof(gop_cache_priv_t));
+
+    cachep->arena = malloc(size);
+    cachep->frames = malloc(max_frames * sizeof(gop_cache_frame_t));
+    if (cachep->arena == NULL || cachep->frames == NULL) {
+        free(cachep->arena);
+        free(cachep->frames);
+        free(cachep);
+        return false;
+    }
+
+    cachep->arena_size = size;
+    cachep->max_frames = max_frames;
+
+    return true;
+}
+
+void gop_cache_add(gop_cache_t *cache, const uint8_t *data, uint32_t size,
+                   uint64_t dts, uint64_t ntp, uint8_t flags,
+                   const uint32_t *nal_sizes, int nal_count) {
+    gop_cache_priv_t *cachep = (gop_cache_priv_t *)cache;
+
+    if ((flags & PIPE_FLAG_KEYFRAME) != 0) {
+        cachep->count = 0;
+        cachep->used = 0;
+        cachep->valid = true;
+    }
+
+    if (!cachep->valid) {
+        return;
+    }
+
+    if (cachep->count == cachep->max_frames ||
+        size > (cachep->arena_size - cachep->used)) {
+        cachep->count = 0;
+        cachep->used = 0;
+        cachep->valid = false;
+        return;
+    }
+
+    gop_cache_frame_t *frame = &cachep->frames[cachep->count++];
+    memcpy(&cachep->arena[cachep->used], data, size);
+    frame->data = &cachep->arena[cachep->used];
+    frame->size = size;
+    frame->dts = dts;
+    frame->ntp = ntp;
+    frame->flags = flags;
+    memcpy(frame->nal_sizes, nal_sizes, nal_count * sizeof(uint32_t));
+    frame->nal_count = nal_count;
+
+    cachep->used += size;
+}
+
+int gop_cache_count(gop_cache_t *cache) {
+    gop_cache_priv_t *cachep = (gop_cache_priv_t *)cache;
+    return cachep->count;
+}
+
+const gop_cache_frame_t *gop_cache_get(gop_cache_t *cache, int i) {
+    gop_cache_priv_t *cachep = (gop_cache_priv_t *)cache;
+    return &cachep->frames[i];
+}
+
+// discard cached frames. The cache becomes valid again at the next keyframe.
+void gop_cache_reset(gop_cache_t *cache) {
+    gop_cache_priv_t *cachep = (gop_cache_priv_t *)cache;
+    cachep->count = 0;
+    cachep->used = 0;
+    cachep->valid = false;
+}
+
+void gop_cache_destroy(gop_cache_t *cache) {
+    gop_cache_priv_t *cachep = (gop_cache_priv_t *)cache;
+
+    free(cachep->arena);
+    free(cachep->frames);
+    free(cachep);
+}
@@ -0,0 +1,30 @@
+#ifndef __GOP_CACHE_H__
+#define __GOP_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pipe.h"
+
+typedef void gop_cache_t;
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t size;
+    uint64_t dts;
+    uint64_t ntp;
+    uint8_t flags;
+    uint32_t nal_sizes[PIPE_MAX_NALS];
+    int nal_count;
+} gop_cache_frame_t;
+
+bool gop_cache_create(uint32_t size, int max_frames, gop_cache_t **cache);
+void gop_cache_add(gop_cache_t *cache, const uint8_t *data, uint32_t size,
+                   uint64_t dts, uint64_t ntp, uint8_t flags,
+                   const uint32_t *nal_sizes, int nal_count);
+int gop_cache_count(gop_cache_t *cache);
+const gop_cache_frame_t *gop_cache_get(gop_cache_t *cache, int i);
+void gop_cache_reset(gop_cache_t *cache);
+void gop_cache_destroy(gop_cache_t *cache);
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "h264.h"
+
+// find the next 3-byte start code, starting from pos.
+static uint32_t find_start_code(const uint8_t *buf, uint32_t size,
+                                uint32_t pos) {
+    while (pos + 3 <= size) {
+        const uint8_t *p = memchr(&buf[pos + 2], 0x01, size - pos - 2);
+        if (p == NULL) {
+            return size;
+        }
+
+        uint32_t i = p - buf;
+        if (buf[i - 1] == 0x00 && buf[i - 2] == 0x00) {
+            return i - 2;
+        }
+        pos = i - 1;
+    }
+
+    return size;
+}
+
+// size of the start code at the beginning of buf, or 0.
+uint32_t h264_start_code_size(const uint8_t *buf, uint32_t size) {
+    if (size >= 4 && buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x00 &&
+        buf[3] == 0x01) {
+        return 4;
+    }
+    if (size >= 3 && buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x01) {
+        return 3;
+    }
+    return 0;
+}
+
+// split an Annex-B access unit into NAL units.
+// Sizes include start codes. Returns the number of NAL units, or 0 if the
+// buffer doesn't begin with a start code or contains more than max_nals units.
+int h264_find_nals(const uint8_t *buf, uint32_t size, uint32_t *nal_sizes,
+                   int max_nals) {
+    if (h264_start_code_size(buf, size) == 0) {
+        return 0;
+    }
+
+    int count = 0;
+    uint32_t start = 0;
+
+    while (start < size) {
+        uint32_t end = find_start_code(buf, size, start + 3);
+
+        // a zero byte preceding a 3-byte start code belongs to the
+        // 4-byte start code of the next NAL unit.
+        if (end < size && end > start && buf[end - 1] == 0x00) {
+            end--;
+        }
+
+        if (count == max_nals) {
+            return 0;
+        }
+        nal_sizes[count++] = end - start;
+        start = end;
+    }
+
+    return count;
+}
+
+// type of a NAL unit, start code included.
+int h264_nal_type(const uint8_t *nal, uint32_t size) {
+    uint32_t start_code_size = h264_start_code_size(nal, size);
+    if (start_code_size == 0 || start_code_size == size) {
+        return -1;
+    }
+    return nal[start_code_size] & 0x1F;
+}
@@ -0,0 +1,14 @@
+#ifndef __H264_H__
+#define __H264_H__
+
+#include <stdint.h>
+
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+
+int h264_find_nals(const uint8_t *buf, uint32_t size, uint32_t *nal_sizes,
+                   int max_nals);
+uint32_t h264_start_code_size(const uint8_t *buf, uint32_t size);
+int h264_nal_type(const uint8_t *nal, uint32_t size);
+
+#endif
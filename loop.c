@@ -0,0 +1,317 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "loop.h"
+
+// event loop of the main thread.
+//
+// it waits for commands on the command pipe, for termination signals and for
+// timers. Commands are parsed incrementally from a buffer that is reused, so
+// that partial reads are handled and there are no allocations per command.
+// Signals must be blocked before any other thread is started, therefore the
+// loop must be created before the other subsystems.
+
+#define MAX_TIMERS 16
+
+// maximum size of a command.
+#define MAX_COMMAND_SIZE (16 * 1024 * 1024)
+
+#define SOURCE_COMMAND 0
+#define SOURCE_SIGNAL 1
+#define SOURCE_TIMER 2
+
+typedef struct {
+    int fd;
+    bool oneshot;
+    loop_timer_cb timer_cb;
+    void *userdata;
+} loop_timer_t;
+
+static char errbuf[256];
+
+static void set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errbuf, 256, format, args);
+}
+
+const char *loop_get_error() { return errbuf; }
+
+typedef struct {
+    int epoll_fd;
+    int command_fd;
+    int signal_fd;
+    loop_command_cb command_cb;
+    uint8_t *buf;
+    uint32_t buf_size;
+    uint32_t buf_cap;
+    pthread_mutex_t timers_mutex;
+    loop_timer_t timers[MAX_TIMERS];
+} loop_priv_t;
+
+static bool add_fd(int epoll_fd, int fd, uint64_t source) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u64 = source;
+    return (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0);
+}
+
+bool loop_create(int command_fd, loop_command_cb command_cb, loop_t **loop) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    *loop = malloc(sizeof(loop_priv_t));
+    loop_priv_t *loopp = (loop_priv_t *)(*loop);
+    memset(loopp, 0, sizeof(loop_priv_t));
+
+    loopp->command_fd = command_fd;
+    loopp->command_cb = command_cb;
+    loopp->signal_fd = -1;
+
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        loopp->timers[i].fd = -1;
+    }
+
+    loopp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loopp->epoll_fd < 0) {
+        set_error("epoll_create1() failed");
+        goto failed;
+    }
+
+    loopp->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (loopp->signal_fd < 0) {
+        set_error("signalfd() failed");
+        goto failed;
+    }
+
+    if (!add_fd(loopp->epoll_fd, command_fd, SOURCE_COMMAND) ||
+        !add_fd(loopp->epoll_fd, loopp->signal_fd, SOURCE_SIGNAL)) {
+        set_error("epoll_ctl() failed");
+        goto failed;
+    }
+
+    pthread_mutex_init(&loopp->timers_mutex, NULL);
+
+    return true;
+
+failed:
+    if (loopp->signal_fd >= 0) {
+        close(loopp->signal_fd);
+    }
+    if (loopp->epoll_fd >= 0) {
+        close(loopp->epoll_fd);
+    }
+    free(loopp);
+    return false;
+}
+
+// schedule timer_cb after delay microseconds, then every period microseconds.
+// When period is zero, the timer fires once and is removed before timer_cb is
+// called. Can be called by any thread. Returns an ID, or -1 in case of error.
+int loop_add_timer(loop_t *loop, uint64_t delay, uint64_t period,
+                   loop_timer_cb timer_cb, void *userdata) {
+    loop_priv_t *loopp = (loop_priv_t *)loop;
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // a zero it_value disarms the timer.
+    if (delay == 0) {
+        delay = 1;
+    }
+
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = delay / 1000000;
+    spec.it_value.tv_nsec = (delay % 1000000) * 1000;
+    spec.it_interval.tv_sec = period / 1000000;
+    spec.it_interval.tv_nsec = (period % 1000000) * 1000;
+
+    pthread_mutex_lock(&loopp->timers_mutex);
+
+    int id = -1;
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (loopp->timers[i].fd < 0) {
+            id = i;
+            break;
+        }
+    }
+
+    if (id < 0 || !add_fd(loopp->epoll_fd, fd, SOURCE_TIMER + id)) {
+        pthread_mutex_unlock(&loopp->timers_mutex);
+        close(fd);
+        return -1;
+    }
+
+    loopp->timers[id].fd = fd;
+    loopp->timers[id].oneshot = (period == 0);
+    loopp->timers[id].timer_cb = timer_cb;
+    loopp->timers[id].userdata = userdata;
+
+    pthread_mutex_unlock(&loopp->timers_mutex);
+
+    timerfd_settime(fd, 0, &spec, NULL);
+
+    return id;
+}
+
+// timers_mutex must be held.
+static void remove_timer(loop_priv_t *loopp, int id) {
+    if (loopp->timers[id].fd >= 0) {
+        epoll_ctl(loopp->epoll_fd, EPOLL_CTL_DEL, loopp->timers[id].fd, NULL);
+        close(loopp->timers[id].fd);
+        loopp->timers[id].fd = -1;
+    }
+}
+
+void loop_remove_timer(loop_t *loop, int id) {
+    loop_priv_t *loopp = (loop_priv_t *)loop;
+
+    if (id < 0 || id >= MAX_TIMERS) {
+        return;
+    }
+
+    pthread_mutex_lock(&loopp->timers_mutex);
+    remove_timer(loopp, id);
+    pthread_mutex_unlock(&loopp->timers_mutex);
+}
+
+static void handle_timer(loop_priv_t *loopp, int id) {
+    pthread_mutex_lock(&loopp->timers_mutex);
+
+    loop_timer_t timer = loopp->timers[id];
+    if (timer.fd < 0) {
+        pthread_mutex_unlock(&loopp->timers_mutex);
+        return;
+    }
+
+    // the timer may have been replaced after the event was returned.
+    uint64_t expirations;
+    ssize_t n = read(timer.fd, &expirations, sizeof(uint64_t));
+
+    if (n == sizeof(uint64_t) && timer.oneshot) {
+        remove_timer(loopp, id);
+    }
+
+    pthread_mutex_unlock(&loopp->timers_mutex);
+
+    if (n == sizeof(uint64_t)) {
+        timer.timer_cb(timer.userdata);
+    }
+}
+
+// read available bytes and process complete commands.
+// Commands are in the same format of pipe messages: [size, u32][payload].
+static bool handle_commands(loop_priv_t *loopp) {
+    if (loopp->buf_cap - loopp->buf_size < 4096) {
+        loopp->buf_cap = loopp->buf_cap * 2 + 4096;
+        loopp->buf = realloc(loopp->buf, loopp->buf_cap);
+    }
+
+    ssize_t n = read(loopp->command_fd, &loopp->buf[loopp->buf_size],
+                     loopp->buf_cap - loopp->buf_size);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+
+    loopp->buf_size += n;
+
+    uint32_t pos = 0;
+
+    while ((loopp->buf_size - pos) >= sizeof(uint32_t)) {
+        uint32_t size;
+        memcpy(&size, &loopp->buf[pos], sizeof(uint32_t));
+
+        if (size == 0 || size > MAX_COMMAND_SIZE) {
+            fprintf(stderr, "invalid command size: %u\n", size);
+            return false;
+        }
+
+        if ((loopp->buf_size - pos - sizeof(uint32_t)) < size) {
+            // make room for the rest of the command.
+            if (sizeof(uint32_t) + size > loopp->buf_cap) {
+                loopp->buf_cap = sizeof(uint32_t) + size;
+                loopp->buf = realloc(loopp->buf, loopp->buf_cap);
+            }
+            break;
+        }
+
+        bool ok = loopp->command_cb(&loopp->buf[pos + sizeof(uint32_t)], size);
+        pos += sizeof(uint32_t) + size;
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    memmove(loopp->buf, &loopp->buf[pos], loopp->buf_size - pos);
+    loopp->buf_size -= pos;
+
+    return true;
+}
+
+// run until the command callback returns false, the command pipe is closed
+// or a termination signal is received.
+void loop_run(loop_t *loop) {
+    loop_priv_t *loopp = (loop_priv_t *)loop;
+    struct epoll_event events[MAX_TIMERS + 2];
+
+    while (true) {
+        int n = epoll_wait(loopp->epoll_fd, events, MAX_TIMERS + 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "epoll_wait() failed\n");
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t source = events[i].data.u64;
+
+            if (source == SOURCE_COMMAND) {
+                if (!handle_commands(loopp)) {
+                    return;
+                }
+            } else if (source == SOURCE_SIGNAL) {
+                struct signalfd_siginfo info;
+                read(loopp->signal_fd, &info, sizeof(info));
+                return;
+            } else {
+                handle_timer(loopp, source - SOURCE_TIMER);
+            }
+        }
+    }
+}
+
+void loop_destroy(loop_t *loop) {
+    loop_priv_t *loopp = (loop_priv_t *)loop;
+
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (loopp->timers[i].fd >= 0) {
+            close(loopp->timers[i].fd);
+        }
+    }
+
+    close(loopp->signal_fd);
+    close(loopp->epoll_fd);
+    pthread_mutex_destroy(&loopp->timers_mutex);
+    free(loopp->buf);
+    free(loopp);
+}
@@ -0,0 +1,22 @@
+#ifndef __LOOP_H__
+#define __LOOP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void loop_t;
+
+// returns false to stop the loop.
+typedef bool (*loop_command_cb)(const uint8_t *buf, uint32_t size);
+
+typedef void (*loop_timer_cb)(void *userdata);
+
+const char *loop_get_error();
+bool loop_create(int command_fd, loop_command_cb command_cb, loop_t **loop);
+int loop_add_timer(loop_t *loop, uint64_t delay, uint64_t period,
+                   loop_timer_cb timer_cb, void *userdata);
+void loop_remove_timer(loop_t *loop, int id);
+void loop_run(loop_t *loop);
+void loop_destroy(loop_t *loop);
+
+#endif
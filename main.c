@@ -1,75 +1,683 @@
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 
 #include <linux/dma-buf.h>
 
 #include "camera.h"
 #include "encoder.h"
+#include "loop.h"
+#include "output.h"
 #include "parameters.h"
 #include "pipe.h"
+#include "scaler.h"
+#include "stats.h"
+#include "test.h"
 #include "text.h"
 
+// microseconds.
+#define WATCHDOG_MIN_TIMEOUT 1000000
+
+// microseconds.
+#define BUFFER_TUNING_PERIOD 1000000
+
+// microseconds.
+#define STATE_SAVE_PERIOD 10000000
+
+// output buffers of each level of a scaler.
+#define SCALER_BUFFER_COUNT 4
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int pipe_out_fd;
-static pthread_mutex_t pipe_out_mutex;
+static loop_t *loop;
+static output_t *out;
 static parameters_t *params;
-static camera_t *cam;
+// cameras. The first one produces the primary stream.
+static camera_t *cams[PARAMETERS_MAX_CAMERAS];
+static unsigned int cam_ids[PARAMETERS_MAX_CAMERAS];
+static unsigned int cam_count;
+// camera that produces each stream, indexed by stream ID.
+static camera_t *stream_cams[PARAMETERS_MAX_STREAMS];
 static text_t *text;
-static encoder_t *enc;
-static encoder_t *enc_secondary = NULL;
+// encoders, indexed by stream ID. NULL when the stream is disabled.
+static encoder_t *encs[PARAMETERS_MAX_STREAMS];
+// scalers, indexed by the ID of their source stream.
+static scaler_t *scalers[PARAMETERS_MAX_STREAMS];
+// whether inputs of encoders are buffers of a scaler instead of camera
+// frames.
+static bool scaled_inputs[PARAMETERS_MAX_STREAMS];
+
+static void on_frame(camera_frame_t *frame, uint64_t dts, uint64_t ntp,
+                     const camera_buffer_t *buffers) {
+    // in low memory mode, the primary stream is not mapped when the overlay
+    // is disabled.
+    if (buffers[0].mapped != NULL) {
+        camera_frame_acquire(frame, CAMERA_CONSUMER_OVERLAY);
+
+        // mapped DMA buffers require a DMA_BUF_IOCTL_SYNC before and after
+        // usage.
+        // https://forums.raspberrypi.com/viewtopic.php?t=352554
+        struct dma_buf_sync dma_sync = {0};
+        dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+        ioctl(buffers[0].fd, DMA_BUF_IOCTL_SYNC, &dma_sync);
+
+        text_draw(text, buffers[0].mapped, ntp);
+
+        dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+        ioctl(buffers[0].fd, DMA_BUF_IOCTL_SYNC, &dma_sync);
+
+        camera_frame_release(frame, CAMERA_CONSUMER_OVERLAY);
+    }
+
+    // encoders release the frame once they don't need it anymore.
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (encs[i] != NULL && buffers[i].fd >= 0) {
+            camera_frame_acquire(frame, CAMERA_CONSUMER_ENCODER(i));
+            encoder_encode(encs[i], buffers[i].mapped, buffers[i].fd,
+                           buffers[i].offset, dts, ntp, frame);
+        }
+    }
+
+    // scalers release the frame once the scaled streams have been computed.
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (scalers[i] != NULL && buffers[i].fd >= 0) {
+            camera_frame_acquire(frame, CAMERA_CONSUMER_SCALER(i));
+            scaler_process(scalers[i], buffers[i].mapped, buffers[i].fd, dts,
+                           ntp, frame);
+        }
+    }
+}
+
+static void on_scaler_input_release(int source, void *input) {
+    camera_frame_release(input, CAMERA_CONSUMER_SCALER(source));
+}
+
+static void on_scaler_output(int stream, uint8_t *buffer_mapped,
+                             int buffer_fd, uint64_t dts, uint64_t ntp,
+                             void *buffer) {
+    encoder_encode(encs[stream], buffer_mapped, buffer_fd, 0, dts, ntp,
+                   buffer);
+}
+
+// inputs of scaled streams are buffers of a scaler, while inputs of other
+// streams are camera frames.
+static void on_encoder_input_release(int stream, void *input) {
+    if (scaled_inputs[stream]) {
+        scaler_buffer_release(input);
+    } else {
+        camera_frame_release(input, CAMERA_CONSUMER_ENCODER(stream));
+    }
+}
+
+static void on_encoder_output(int stream, const uint8_t *buffer, uint64_t size,
+                              uint64_t dts, uint64_t ntp, uint32_t flags,
+                              const uint32_t *nal_sizes, int nal_count) {
+    stats_encode_end(stream, dts);
+    output_write_data(out, stream, buffer, size, dts, ntp, flags, nal_sizes,
+                      nal_count);
+}
+
+static void on_output_release(int stream, const uint8_t *buffer) {
+    encoder_release_output(encs[stream], buffer);
+}
+
+static void force_idr_all() {
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (encs[i] != NULL) {
+            encoder_force_idr(encs[i]);
+        }
+    }
+}
 
-static void on_frame(uint8_t *buffer_mapped, int buffer_fd, uint64_t dts,
-                     uint64_t ntp, uint8_t *secondary_buffer_mapped,
-                     int secondary_buffer_fd) {
-    // mapped DMA buffers require a DMA_BUF_IOCTL_SYNC before and after usage.
-    // https://forums.raspberrypi.com/viewtopic.php?t=352554
-    struct dma_buf_sync dma_sync = {0};
-    dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
-    ioctl(buffer_fd, DMA_BUF_IOCTL_SYNC, &dma_sync);
+static void force_idr_camera(camera_t *cam) {
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (encs[i] != NULL && stream_cams[i] == cam) {
+            encoder_force_idr(encs[i]);
+        }
+    }
+}
 
-    text_draw(text, buffer_mapped, ntp);
+static int find_camera(camera_t *cam) {
+    for (unsigned int k = 0; k < cam_count; k++) {
+        if (cams[k] == cam) {
+            return k;
+        }
+    }
+    return 0;
+}
 
-    dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
-    ioctl(buffer_fd, DMA_BUF_IOCTL_SYNC, &dma_sync);
+// find the camera of each stream. Scaled streams take the camera of their
+// source.
+static void assign_streams(const parameters_t *p) {
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        stream_cams[i] = NULL;
+    }
 
-    encoder_encode(enc, buffer_mapped, buffer_fd, dts, ntp);
+    for (unsigned int i = 0; i < p->stream_count; i++) {
+        for (unsigned int k = 0; k < cam_count; k++) {
+            if (p->streams[i].width != 0 &&
+                p->streams[i].camera_id == cam_ids[k]) {
+                stream_cams[i] = cams[k];
+            }
+        }
+    }
+}
 
-    if (enc_secondary != NULL && secondary_buffer_mapped != NULL) {
-        encoder_encode(enc_secondary, secondary_buffer_mapped,
-                       secondary_buffer_fd, dts, ntp);
+static unsigned int get_buffer_count() {
+    unsigned int count = 0;
+    for (unsigned int k = 0; k < cam_count; k++) {
+        count += camera_get_buffer_count(cams[k]);
     }
+    return count;
 }
 
-static void on_encoder_output(const uint8_t *buffer, uint64_t size,
-                              uint64_t dts, uint64_t ntp) {
-    pthread_mutex_lock(&pipe_out_mutex);
-    pipe_write_data(pipe_out_fd, buffer, size, dts, ntp);
-    pthread_mutex_unlock(&pipe_out_mutex);
+// read a value in kB from a file in the format of /proc/meminfo.
+static unsigned long read_meminfo_value(const char *path, const char *key) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    char line[256];
+    size_t key_len = strlen(key);
+    unsigned long value = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            value = strtoul(&line[key_len + 1], NULL, 10);
+            break;
+        }
+    }
+
+    fclose(f);
+    return value;
 }
 
-static void on_encoder_secondary_output(const uint8_t *buffer, uint64_t size,
-                                        uint64_t dts, uint64_t ntp) {
-    pthread_mutex_lock(&pipe_out_mutex);
-    pipe_write_secondary_data(pipe_out_fd, buffer, size, dts, ntp);
-    pthread_mutex_unlock(&pipe_out_mutex);
+// CMA is shared with other processes, therefore its usage is system-wide.
+static void print_memory_usage() {
+    unsigned long cma_total = read_meminfo_value("/proc/meminfo", "CmaTotal");
+    unsigned long cma_free = read_meminfo_value("/proc/meminfo", "CmaFree");
+    unsigned long rss = read_meminfo_value("/proc/self/status", "VmRSS");
+
+    fprintf(stderr, "memory usage: CMA %lu/%lu kB, RSS %lu kB\n",
+            cma_total - cma_free, cma_total, rss);
 }
 
-static void on_error() {
-    pthread_mutex_lock(&pipe_out_mutex);
-    pipe_write_error(pipe_out_fd, "camera driver exited");
-    pthread_mutex_unlock(&pipe_out_mutex);
+// create the scalers that are missing.
+static bool create_scalers(const parameters_t *p, char *msg, size_t msg_size) {
+    for (unsigned int i = 0; i < p->stream_count; i++) {
+        const parameters_stream_t *stream = &p->streams[i];
+        if (stream->width == 0 || stream->scale_levels == 0 ||
+            scalers[stream->scale_source] != NULL) {
+            continue;
+        }
+
+        int source = stream->scale_source;
+        bool ok = scaler_create(
+            p, source, camera_get_stride(stream_cams[source], source),
+            SCALER_BUFFER_COUNT, on_scaler_output, on_scaler_input_release,
+            &scalers[source]);
+        if (!ok) {
+            snprintf(msg, msg_size, "scaler_create(): %s", scaler_get_error());
+            return false;
+        }
+    }
+
+    return true;
 }
 
+// create the encoders that are missing. Scalers must have been created
+// before. Encoders must be able to hold all the buffers that the camera may
+// add.
+static bool create_encoders(const parameters_t *p, char *msg,
+                            size_t msg_size) {
+    for (unsigned int i = 0; i < p->stream_count; i++) {
+        const parameters_stream_t *stream = &p->streams[i];
+        if (stream->width == 0 || encs[i] != NULL) {
+            continue;
+        }
+
+        camera_t *cam = stream_cams[i];
+        bool ok;
+        if (stream->scale_levels != 0) {
+            scaler_t *scaler = scalers[stream->scale_source];
+            ok = encoder_create(
+                i, p, scaler_get_frame_size(scaler, i),
+                scaler_get_stride(scaler, i),
+                camera_get_colorspace(cam, stream->scale_source),
+                SCALER_BUFFER_COUNT, on_encoder_output,
+                on_encoder_input_release, &encs[i]);
+        } else {
+            ok = encoder_create(i, p, camera_get_frame_size(cam, i),
+                                camera_get_stride(cam, i),
+                                camera_get_colorspace(cam, i),
+                                camera_get_max_buffer_count(cam),
+                                on_encoder_output, on_encoder_input_release,
+                                &encs[i]);
+        }
+        if (!ok) {
+            snprintf(msg, msg_size, "encoder_create(): %s",
+                     encoder_get_error());
+            return false;
+        }
+
+        scaled_inputs[i] = (stream->scale_levels != 0);
+    }
+
+    return true;
+}
+
+static void on_stats_timer(void *userdata) {
+    char report[4096];
+    stats_report(report, sizeof(report));
+    output_write_stats(out, report);
+}
+
+// restart a camera, keeping encoders alive.
+static void recover(int k) {
+    fprintf(stderr, "restarting camera %u\n", cam_ids[k]);
+
+    parameters_t view;
+    parameters_camera_view(params, cam_ids[k], &view);
+
+    bool ok = camera_recover(cams[k], &view);
+    if (!ok) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "camera driver exited: %s",
+                 camera_get_error());
+        output_write_error(out, msg);
+        return;
+    }
+
+    // frames that follow the restart cannot reference previous ones.
+    force_idr_camera(cams[k]);
+}
+
+typedef struct {
+    int frame_size;
+    int stride;
+    int colorspace;
+} stream_layout_t;
+
+static void get_stream_layout(int stream, stream_layout_t *layout) {
+    camera_t *cam = stream_cams[stream];
+    layout->frame_size = camera_get_frame_size(cam, stream);
+    layout->stride = camera_get_stride(cam, stream);
+    layout->colorspace = camera_get_colorspace(cam, stream);
+}
+
+// whether a stream is produced by the scaler of a source stream.
+static bool uses_scaler(const parameters_t *p, int stream, int source) {
+    return (p->streams[stream].width != 0 &&
+            p->streams[stream].scale_levels != 0 &&
+            (int)p->streams[stream].scale_source == source);
+}
+
+// apply parameters that change the format of streams, by stopping the
+// camera, configuring it again and creating again the scalers and encoders
+// that are affected. Other encoders are kept, therefore their readers are
+// not disconnected.
+static bool reconfigure(const parameters_t *new_params, uint64_t diff,
+                        char *msg, size_t msg_size) {
+    uint64_t start = monotonic_us();
+
+    bool streams_changed = (diff & PARAMETERS_CAMERA_CONFIG) != 0;
+
+    // encoders are created again when their inputs change.
+    stream_layout_t layouts[PARAMETERS_MAX_STREAMS];
+    unsigned int max_buffer_counts[PARAMETERS_MAX_STREAMS];
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (encs[i] != NULL && !scaled_inputs[i]) {
+            get_stream_layout(i, &layouts[i]);
+            max_buffer_counts[i] = camera_get_max_buffer_count(stream_cams[i]);
+        }
+    }
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (scalers[i] != NULL) {
+            get_stream_layout(i, &layouts[i]);
+        }
+    }
+
+    for (unsigned int k = 0; k < cam_count; k++) {
+        camera_stop(cams[k]);
+    }
+
+    for (unsigned int k = 0; k < cam_count; k++) {
+        parameters_t view;
+        parameters_camera_view(new_params, cam_ids[k], &view);
+        if (!camera_reconfigure(cams[k], &view, streams_changed)) {
+            snprintf(msg, msg_size, "camera_reconfigure(): %s",
+                     camera_get_error());
+            return false;
+        }
+    }
+
+    // frames are not used by consumers anymore, therefore scalers and
+    // encoders can be destroyed.
+    bool scaler_changed[PARAMETERS_MAX_STREAMS] = {false};
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (scalers[i] == NULL) {
+            continue;
+        }
+
+        // the source stream is disabled or is not produced by the camera
+        // anymore when its format changes.
+        scaler_changed[i] = (diff & PARAMETERS_STREAM_FORMAT(i)) != 0;
+        for (int j = 0; j < PARAMETERS_MAX_STREAMS; j++) {
+            if ((diff & PARAMETERS_STREAM_FORMAT(j)) != 0 &&
+                (uses_scaler(params, j, i) || uses_scaler(new_params, j, i))) {
+                scaler_changed[i] = true;
+            }
+        }
+
+        if (!scaler_changed[i] && streams_changed) {
+            stream_layout_t layout;
+            get_stream_layout(i, &layout);
+            scaler_changed[i] = (layout.stride != layouts[i].stride);
+        }
+    }
+
+    bool encoder_changed[PARAMETERS_MAX_STREAMS] = {false};
+    for (int i = PARAMETERS_MAX_STREAMS - 1; i >= 0; i--) {
+        if (encs[i] == NULL) {
+            continue;
+        }
+
+        if ((diff & PARAMETERS_STREAM_FORMAT(i)) != 0) {
+            encoder_changed[i] = true;
+        } else if (scaled_inputs[i]) {
+            encoder_changed[i] =
+                scaler_changed[params->streams[i].scale_source];
+        } else if (streams_changed) {
+            stream_layout_t layout;
+            get_stream_layout(i, &layout);
+            encoder_changed[i] =
+                (layout.frame_size != layouts[i].frame_size ||
+                 layout.stride != layouts[i].stride ||
+                 layout.colorspace != layouts[i].colorspace ||
+                 camera_get_max_buffer_count(stream_cams[i]) !=
+                     max_buffer_counts[i]);
+        }
+
+        if (encoder_changed[i]) {
+            output_suspend_stream(out, i);
+            encoder_destroy(encs[i]);
+            encs[i] = NULL;
+        }
+    }
+
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (scaler_changed[i]) {
+            scaler_destroy(scalers[i]);
+            scalers[i] = NULL;
+        }
+    }
+
+    // the overlay depends on the size of the primary stream.
+    if (streams_changed) {
+        text_t *new_text;
+        if (!text_create(new_params, camera_get_stride(cams[0], 0),
+                         &new_text)) {
+            snprintf(msg, msg_size, "text_create(): %s", text_get_error());
+            return false;
+        }
+        text_destroy(text);
+        text = new_text;
+    }
+
+    // streams that are enabled are produced by the camera of the new
+    // parameters.
+    assign_streams(new_params);
+
+    if (!create_scalers(new_params, msg, msg_size) ||
+        !create_encoders(new_params, msg, msg_size)) {
+        return false;
+    }
+
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (encoder_changed[i]) {
+            output_resume_stream(out, i);
+        }
+    }
+
+    for (unsigned int k = 0; k < cam_count; k++) {
+        parameters_t view;
+        parameters_camera_view(new_params, cam_ids[k], &view);
+        if (!camera_restart(cams[k], &view)) {
+            snprintf(msg, msg_size, "camera_restart(): %s",
+                     camera_get_error());
+            return false;
+        }
+    }
+
+    // frames that follow the restart cannot reference previous ones.
+    force_idr_all();
+
+    stats_buffer_count(get_buffer_count());
+
+    uint64_t duration = monotonic_us() - start;
+    fprintf(stderr, "reconfigured in %llu us, using %u buffers\n",
+            (unsigned long long)duration, get_buffer_count());
+    print_memory_usage();
+
+    return true;
+}
+
+// whether a recovery has been scheduled, indexed like cameras.
+static _Atomic bool recover_pending[PARAMETERS_MAX_CAMERAS];
+
+static void on_recover_timer(void *userdata) {
+    int k = (int)(intptr_t)userdata;
+
+    // errors that happen during the recovery schedule another one.
+    atomic_store(&recover_pending[k], false);
+    recover(k);
+}
+
+// called by the camera thread. Recovery is performed by the main thread.
+static void on_error(camera_t *cam) {
+    int k = find_camera(cam);
+    if (atomic_exchange(&recover_pending[k], true)) {
+        return;
+    }
+
+    if (loop_add_timer(loop, 0, 0, on_recover_timer, (void *)(intptr_t)k) <
+        0) {
+        atomic_store(&recover_pending[k], false);
+        output_write_error(out, "camera driver exited");
+    }
+}
+
+// restart the camera when no frame is received within watchdog_frames frame
+// durations. The first frame after a start takes longer, therefore the
+// timeout has a lower limit.
+static void on_watchdog_timer(void *userdata) {
+    for (unsigned int k = 0; k < cam_count; k++) {
+        // a recovery is already on its way.
+        if (atomic_load(&recover_pending[k])) {
+            continue;
+        }
+
+        parameters_t view;
+        parameters_camera_view(params, cam_ids[k], &view);
+
+        uint64_t timeout =
+            (uint64_t)((double)params->watchdog_frames * 1000000 / view.fps);
+        if (timeout < WATCHDOG_MIN_TIMEOUT) {
+            timeout = WATCHDOG_MIN_TIMEOUT;
+        }
+
+        if (camera_is_stalled(cams[k], timeout)) {
+            fprintf(stderr, "no frames received from camera %u in %llu us\n",
+                    cam_ids[k], (unsigned long long)timeout);
+            recover(k);
+        }
+    }
+}
+
+// the AE/AWB state of the main camera is saved periodically, since the
+// process can be killed at any time.
+static void save_state() {
+    if (!camera_save_state(cams[0], params->state_file)) {
+        fprintf(stderr, "unable to save AE/AWB state: %s\n",
+                camera_get_error());
+    }
+}
+
+static void on_state_timer(void *userdata) { save_state(); }
+
+// in adaptive mode, add a buffer when frames were dropped by the camera or
+// could not be queued into encoders during the last period.
+static void on_buffer_tuning_timer(void *userdata) {
+    static uint64_t prev_starvations[PARAMETERS_MAX_CAMERAS] = {0};
+
+    for (unsigned int k = 0; k < cam_count; k++) {
+        uint64_t starvations = camera_get_sequence_gaps(cams[k]);
+        for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+            if (encs[i] != NULL && !scaled_inputs[i] &&
+                stream_cams[i] == cams[k]) {
+                starvations += encoder_get_input_errors(encs[i]);
+            }
+        }
+
+        if (starvations == prev_starvations[k]) {
+            continue;
+        }
+        prev_starvations[k] = starvations;
+
+        if (camera_add_buffer(cams[k])) {
+            fprintf(stderr, "frames were dropped, using %u buffers\n",
+                    get_buffer_count());
+            stats_buffer_count(get_buffer_count());
+        }
+    }
+}
+
+// apply the frame rate of a stream to its camera and its encoder. The
+// primary streams of cameras set the frame rate of the sensor.
+static void set_stream_fps(const parameters_t *p, int stream, float fps) {
+    if (stream == 0 || p->streams[stream].camera_id != p->camera_id) {
+        camera_set_fps(stream_cams[stream], fps);
+    } else {
+        camera_set_stream_fps(stream_cams[stream], stream, fps);
+    }
+    encoder_set_fps(encs[stream], fps);
+}
+
+// binary commands, that take effect on the next frame without reloading all
+// parameters:
+// ['b'][stream, u8][bitrate, u32]: set bitrate
+// ['i'][stream, u8]: force an IDR frame
+// ['f'][stream, u8][fps, float32]: set frame rate
+// stream is the stream ID: 0 for the primary stream, 1 for the secondary
+// one, 2 and above for additional streams.
+// params are updated too, in order to keep parameter reloads consistent.
+static void handle_binary_command(const uint8_t *buf, uint32_t size) {
+    static const uint32_t sizes[] = {['b'] = 6, ['i'] = 2, ['f'] = 6};
+
+    if (size != sizes[buf[0]]) {
+        printf("skipping command since its size is invalid\n");
+        return;
+    }
+
+    int stream = buf[1];
+    if (stream >= PARAMETERS_MAX_STREAMS || encs[stream] == NULL) {
+        printf("skipping command since stream %d is disabled\n", stream);
+        return;
+    }
+    encoder_t *target = encs[stream];
+
+    switch (buf[0]) {
+    case 'b': {
+        uint32_t bitrate;
+        memcpy(&bitrate, &buf[2], sizeof(uint32_t));
+
+        encoder_set_bitrate(target, bitrate);
+        params->streams[stream].bitrate = bitrate;
+        output_resize_gop_cache(out, stream, &params->streams[stream]);
+        break;
+    }
+
+    case 'i':
+        encoder_force_idr(target);
+        break;
+
+    case 'f': {
+        float fps;
+        memcpy(&fps, &buf[2], sizeof(float));
+        if (fps <= 0) {
+            printf("skipping command since fps is invalid\n");
+            return;
+        }
+        if (params->streams[stream].scale_levels != 0) {
+            printf("skipping command since stream %d follows the frame rate "
+                   "of its source\n",
+                   stream);
+            return;
+        }
+
+        set_stream_fps(params, stream, fps);
+        if (stream == 0) {
+            params->fps = fps;
+        }
+        params->streams[stream].fps = fps;
+        output_resize_gop_cache(out, stream, &params->streams[stream]);
+        break;
+    }
+    }
+}
+
+// whether the loop has been stopped by an error.
+static bool failed = false;
+
 static bool handle_command(const uint8_t *buf, uint32_t size) {
     switch (buf[0]) {
     case 'e':
         return false;
 
+    case 'b':
+    case 'i':
+    case 'f':
+        handle_binary_command(buf, size);
+        break;
+
+    // stop and restart capturing frames, without releasing anything.
+    case 'p':
+        for (unsigned int k = 0; k < cam_count; k++) {
+            camera_pause(cams[k]);
+        }
+        break;
+
+    case 'r':
+        // readers of a resumed stream need a keyframe to start decoding.
+        force_idr_all();
+        for (unsigned int k = 0; k < cam_count; k++) {
+            camera_resume(cams[k]);
+        }
+        break;
+
+    // ['g'][stream, u8]: send again the frames of the current GOP, in order
+    // to allow new readers to start decoding immediately.
+    case 'g':
+        if (size != 2 || buf[1] >= PARAMETERS_MAX_STREAMS) {
+            printf("skipping command since it is invalid\n");
+            break;
+        }
+        output_replay(out, buf[1]);
+        break;
+
     case 'c': {
         parameters_t *new_params;
         bool ok = parameters_unserialize(&buf[1], size - 1, &new_params);
@@ -79,11 +687,67 @@ static bool handle_command(const uint8_t *buf, uint32_t size) {
             break;
         }
 
-        camera_reload_params(cam, new_params);
-        text_reload_params(text, new_params);
-        encoder_reload_params(enc, new_params);
-        if (enc_secondary != NULL) {
-            encoder_reload_params(enc_secondary, new_params);
+        // only settings that changed are applied, in order not to perturb
+        // AE/AWB and not to waste ioctls.
+        uint64_t diff = parameters_diff(params, new_params);
+
+        if ((diff & PARAMETERS_PROCESS_RESTART) != 0) {
+            printf("some parameters cannot be changed without restarting, "
+                   "they have been ignored\n");
+        }
+
+        // cameras are opened once, at startup.
+        if ((diff & PARAMETERS_CAMERAS) != 0) {
+            printf("skipping reloading parameters since cameras cannot be "
+                   "added or removed without restarting\n");
+            parameters_destroy(new_params);
+            break;
+        }
+
+        if ((diff & (PARAMETERS_CAMERA_CONFIG | PARAMETERS_CAMERA_RESTART |
+                     PARAMETERS_STREAM_FORMATS)) != 0) {
+            char msg[256];
+            if (!reconfigure(new_params, diff, msg, sizeof(msg))) {
+                // cameras are stopped and the pipeline is partly rebuilt,
+                // with encoders that may point to the new parameters,
+                // therefore the process is stopped and restarted by the
+                // server.
+                output_write_error(out, msg);
+                failed = true;
+                return false;
+            }
+        }
+
+        if ((diff & PARAMETERS_CAMERA) != 0) {
+            for (unsigned int k = 0; k < cam_count; k++) {
+                parameters_t view;
+                parameters_camera_view(new_params, cam_ids[k], &view);
+                camera_reload_params(cams[k], &view, diff);
+            }
+        }
+        if ((diff & PARAMETERS_TEXT_OVERLAY) != 0) {
+            text_reload_params(text, new_params);
+        }
+        for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+            if (encs[i] != NULL && (diff & PARAMETERS_ENCODER(i)) != 0) {
+                encoder_reload_params(encs[i], new_params);
+            }
+        }
+        for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+            const parameters_stream_t *stream = &new_params->streams[i];
+            if (encs[i] != NULL && (diff & PARAMETERS_STREAM_FPS(i)) != 0 &&
+                stream->scale_levels == 0 && stream->fps > 0) {
+                set_stream_fps(new_params, i, stream->fps);
+            }
+        }
+        for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+            const parameters_stream_t *a = &params->streams[i];
+            const parameters_stream_t *b = &new_params->streams[i];
+            if ((a->width != 0) != (b->width != 0) ||
+                a->bitrate != b->bitrate || a->idr_period != b->idr_period ||
+                a->fps != b->fps) {
+                output_resize_gop_cache(out, i, b);
+            }
         }
         parameters_destroy(params);
         params = new_params;
@@ -93,8 +757,39 @@ static bool handle_command(const uint8_t *buf, uint32_t size) {
     return true;
 }
 
+// text overlay initialization, that loads FreeType and the font, runs
+// in parallel with the creation of encoders.
+typedef struct {
+    const parameters_t *params;
+    int stride;
+    text_t *text;
+    bool ok;
+    char msg[256];
+    uint64_t duration;
+} text_init_t;
+
+static void *text_init_main(void *userdata) {
+    text_init_t *init = (text_init_t *)userdata;
+    uint64_t start = monotonic_us();
+
+    init->ok = text_create(init->params, init->stride, &init->text);
+    if (!init->ok) {
+        snprintf(init->msg, sizeof(init->msg), "text_create(): %s",
+                 text_get_error());
+    }
+
+    init->duration = monotonic_us() - start;
+    return NULL;
+}
+
 int main() {
+    uint64_t startup_start = monotonic_us();
+
     if (getenv("TEST") != NULL) {
+        if (!test_run()) {
+            printf("test failed\n");
+            return -1;
+        }
         printf("test passed\n");
         return 0;
     }
@@ -102,8 +797,16 @@ int main() {
     int pipe_in_fd = atoi(getenv("PIPE_CONF_FD"));
     pipe_out_fd = atoi(getenv("PIPE_VIDEO_FD"));
 
+    pipe_set_size(pipe_out_fd);
+
+    stats_register_thread("main");
+
     uint8_t *buf;
     uint32_t n = pipe_read(pipe_in_fd, &buf);
+    if (n == 0) {
+        pipe_write_error(pipe_out_fd, "unable to read parameters");
+        return -1;
+    }
 
     bool ok = parameters_unserialize(&buf[1], n - 1, &params);
     free(buf);
@@ -113,71 +816,142 @@ int main() {
         return -1;
     }
 
-    pthread_mutex_init(&pipe_out_mutex, NULL);
-    pthread_mutex_lock(&pipe_out_mutex);
-
-    ok = camera_create(params, on_frame, on_error, &cam);
+    // the loop must be created before any other thread, since it blocks
+    // termination signals.
+    ok = loop_create(pipe_in_fd, handle_command, &loop);
     if (!ok) {
-        pipe_write_error(pipe_out_fd, "camera_create(): %s",
-                         camera_get_error());
+        pipe_write_error(pipe_out_fd, "loop_create(): %s", loop_get_error());
         return -1;
     }
 
-    ok = text_create(params, camera_get_stride(cam), &text);
+    ok = output_create(params, pipe_out_fd, on_output_release, &out);
     if (!ok) {
-        pipe_write_error(pipe_out_fd, "text_create(): %s", text_get_error());
+        pipe_write_error(pipe_out_fd, "output_create(): %s",
+                         output_get_error());
         return -1;
     }
 
-    ok = encoder_create(false, params, camera_get_frame_size(cam),
-                        camera_get_stride(cam), camera_get_colorspace(cam),
-                        on_encoder_output, &enc);
+    uint64_t phase_start = monotonic_us();
+    stats_startup_t startup;
+
+    cam_count = parameters_get_cameras(params, cam_ids);
+    for (unsigned int k = 0; k < cam_count; k++) {
+        parameters_t view;
+        parameters_camera_view(params, cam_ids[k], &view);
+        ok = camera_create(&view, on_frame, on_error, &cams[k]);
+        if (!ok) {
+            pipe_write_error(pipe_out_fd, "camera_create(): %s",
+                             camera_get_error());
+            return -1;
+        }
+    }
+    assign_streams(params);
+
+    startup.camera = monotonic_us() - phase_start;
+    phase_start = monotonic_us();
+
+    text_init_t text_init = {
+        .params = params,
+        .stride = camera_get_stride(cams[0], 0),
+    };
+    pthread_t text_thread;
+    pthread_create(&text_thread, NULL, text_init_main, &text_init);
+
+    char msg[256];
+    ok = create_scalers(params, msg, sizeof(msg)) &&
+         create_encoders(params, msg, sizeof(msg));
+    startup.encoders = monotonic_us() - phase_start;
+
+    pthread_join(text_thread, NULL);
     if (!ok) {
-        pipe_write_error(pipe_out_fd, "encoder_create(): %s",
-                         encoder_get_error());
+        pipe_write_error(pipe_out_fd, "%s", msg);
         return -1;
     }
+    if (!text_init.ok) {
+        pipe_write_error(pipe_out_fd, "%s", text_init.msg);
+        return -1;
+    }
+    text = text_init.text;
+    startup.text = text_init.duration;
 
-    if (params->secondary_width != 0) {
-        ok = encoder_create(true, params, camera_get_secondary_frame_size(cam),
-                            camera_get_secondary_stride(cam),
-                            camera_get_secondary_colorspace(cam),
-                            on_encoder_secondary_output, &enc_secondary);
+    phase_start = monotonic_us();
+
+    for (unsigned int k = 0; k < cam_count; k++) {
+        parameters_t view;
+        parameters_camera_view(params, cam_ids[k], &view);
+        ok = camera_start(cams[k], &view);
         if (!ok) {
-            pipe_write_error(pipe_out_fd, "encoder_create(): %s",
-                             encoder_get_error());
+            pipe_write_error(pipe_out_fd, "camera_start(): %s",
+                             camera_get_error());
             return -1;
         }
     }
 
-    ok = camera_start(cam, params);
-    if (!ok) {
-        pipe_write_error(pipe_out_fd, "camera_start(): %s", camera_get_error());
-        return -1;
+    startup.start = monotonic_us() - phase_start;
+    startup.total = monotonic_us() - startup_start;
+
+    char report[256];
+    stats_startup_report(report, sizeof(report), &startup);
+    output_write_ready(out, report);
+    fprintf(stderr, "ready, %s\n", report);
+
+    fprintf(stderr, "using %u buffers\n", get_buffer_count());
+    print_memory_usage();
+    stats_buffer_count(get_buffer_count());
+
+    if (params->buffer_count == 0) {
+        loop_add_timer(loop, BUFFER_TUNING_PERIOD, BUFFER_TUNING_PERIOD,
+                       on_buffer_tuning_timer, NULL);
     }
 
-    pipe_write_ready(pipe_out_fd);
-    pthread_mutex_unlock(&pipe_out_mutex);
+    if (params->stats_period != 0) {
+        uint64_t period = (uint64_t)params->stats_period * 1000000;
+        loop_add_timer(loop, period, period, on_stats_timer, NULL);
+    }
 
-    while (true) {
-        uint8_t *buf;
-        uint32_t size = pipe_read(pipe_in_fd, &buf);
+    if (params->watchdog_frames != 0 && params->fps > 0) {
+        uint64_t period =
+            (uint64_t)((double)params->watchdog_frames * 1000000 / params->fps /
+                       2);
+        loop_add_timer(loop, period, period, on_watchdog_timer, NULL);
+    }
 
-        bool ok = handle_command(buf, size);
-        free(buf);
+    if (params->state_file != NULL) {
+        loop_add_timer(loop, STATE_SAVE_PERIOD, STATE_SAVE_PERIOD,
+                       on_state_timer, NULL);
+    }
 
-        if (!ok) {
-            break;
-        }
+    loop_run(loop);
+
+    if (params->state_file != NULL) {
+        save_state();
     }
 
-    camera_stop(cam);
-    if (enc_secondary != NULL) {
-        encoder_destroy(enc_secondary);
+    for (unsigned int k = 0; k < cam_count; k++) {
+        camera_stop(cams[k]);
+    }
+    output_stop(out);
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (scalers[i] != NULL) {
+            scaler_stop(scalers[i]);
+        }
+    }
+    for (int i = PARAMETERS_MAX_STREAMS - 1; i >= 0; i--) {
+        if (encs[i] != NULL) {
+            encoder_destroy(encs[i]);
+        }
+    }
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (scalers[i] != NULL) {
+            scaler_destroy(scalers[i]);
+        }
     }
-    encoder_destroy(enc);
     text_destroy(text);
-    camera_destroy(cam);
+    for (int k = cam_count - 1; k >= 0; k--) {
+        camera_destroy(cams[k]);
+    }
+    output_destroy(out);
+    loop_destroy(loop);
 
-    return 0;
+    return failed ? -1 : 0;
 }
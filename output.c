@@ -0,0 +1,1003 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include "encoder.h"
+#include "gop_cache.h"
+#include "h264.h"
+#include "output.h"
+#include "pipe.h"
+#include "ring.h"
+#include "stats.h"
+
+// messages are written by a dedicated thread, in order to prevent a slow
+// reader from stalling encoders and the camera.
+// Encoders push messages into a bounded lock-free queue; when the queue is
+// full, frames are dropped according to the drop policy.
+
+// must be a power of two.
+#define QUEUE_SIZE 16
+
+// slots that can only be used by keyframes.
+#define QUEUE_KEYFRAME_RESERVE 2
+
+// maximum number of spliced buffers waiting to be consumed by the reader.
+#define PENDING_SIZE 32
+
+// how often the pipe is checked when spliced buffers are waiting.
+#define PENDING_POLL_PERIOD_NS 2000000
+
+// limits of the GOP cache arena, per stream.
+#define GOP_CACHE_MIN_SIZE (1024 * 1024)
+#define GOP_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+#define MSG_STOP 0
+#define MSG_SUSPEND 1
+#define MSG_RESIZE_CACHE 2
+
+typedef enum {
+    DROP_POLICY_UNTIL_KEYFRAME,
+    DROP_POLICY_BLOCK,
+} drop_policy_t;
+
+typedef struct {
+    _Atomic size_t seq;
+    char type;
+    uint8_t stream;
+    uint8_t *buf;
+    size_t cap;
+    const uint8_t *borrowed;
+    size_t size;
+    uint64_t dts;
+    uint64_t ntp;
+    uint8_t flags;
+    uint32_t nal_sizes[PIPE_MAX_NALS];
+    int nal_count;
+} slot_t;
+
+typedef struct {
+    const uint8_t *buffer;
+    int stream;
+    uint64_t end; // position of the end of the buffer in the pipe
+} pending_t;
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t cap;
+} parameter_sets_t;
+
+// settings of a stream that determine the size of its GOP cache.
+typedef struct {
+    unsigned int bitrate;
+    unsigned int idr_period;
+    float fps;
+    bool enabled;
+} cache_params_t;
+
+typedef struct {
+    // accessed by the thread that produces frames of the stream only.
+    bool skip_until_keyframe;
+    // parameter sets of a dropped frame, that are sent with the next frame.
+    parameter_sets_t held;
+    uint32_t held_nal_sizes[PIPE_MAX_NALS];
+    int held_nal_count;
+    // a frame merged with held parameter sets.
+    parameter_sets_t merged;
+    _Atomic uint64_t dropped;
+    // frames of suspended streams are discarded.
+    _Atomic bool suspended;
+    // number of threads inside output_write_data().
+    _Atomic int writers;
+} stream_state_t;
+
+static char errbuf[256];
+
+static void set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errbuf, 256, format, args);
+}
+
+const char *output_get_error() { return errbuf; }
+
+typedef struct {
+    int pipe_fd;
+    ring_t *ring;
+    output_release_cb release_cb;
+    drop_policy_t drop_policy;
+    int header_version;
+    bool parameter_sets_enabled;
+    bool strip_parameter_sets;
+    bool gop_cache_enabled;
+    slot_t slots[QUEUE_SIZE];
+    _Atomic size_t enqueue_pos;
+    size_t dequeue_pos;
+    _Atomic int free_count;
+    _Atomic int waiting;
+    sem_t items;
+    sem_t space;
+    // posted by the writer thread once a stream has been suspended.
+    sem_t suspended;
+    _Atomic bool ready;
+    stream_state_t streams[PARAMETERS_MAX_STREAMS];
+    pthread_t thread;
+
+    // accessed by the writer thread only.
+    bool splice_supported;
+    uint64_t pipe_written;
+    pending_t pending[PENDING_SIZE];
+    int pending_first;
+    int pending_count;
+    parameter_sets_t parameter_sets[PARAMETERS_MAX_STREAMS];
+    parameter_sets_t parameter_sets_tmp;
+    gop_cache_t *gop_caches[PARAMETERS_MAX_STREAMS];
+} output_priv_t;
+
+static void sem_wait_safe(sem_t *sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+// take a free slot, leaving at least 'reserve' slots available.
+static bool take_space(output_priv_t *outp, int reserve, bool block) {
+    while (true) {
+        int n = atomic_load(&outp->free_count);
+        while (n > reserve) {
+            if (atomic_compare_exchange_weak(&outp->free_count, &n, n - 1)) {
+                return true;
+            }
+        }
+
+        if (!block) {
+            return false;
+        }
+
+        atomic_fetch_add(&outp->waiting, 1);
+        if (atomic_load(&outp->free_count) <= reserve) {
+            sem_wait_safe(&outp->space);
+        }
+        atomic_fetch_sub(&outp->waiting, 1);
+    }
+}
+
+static void give_space(output_priv_t *outp) {
+    atomic_fetch_add(&outp->free_count, 1);
+    if (atomic_load(&outp->waiting) > 0) {
+        sem_post(&outp->space);
+    }
+}
+
+// push a message into the queue. A slot must have been taken before.
+// Borrowed buffers are not copied.
+static void push(output_priv_t *outp, char type, int stream,
+                 const uint8_t *data, size_t size, bool borrowed, uint64_t dts,
+                 uint64_t ntp, uint32_t flags, const uint32_t *nal_sizes,
+                 int nal_count) {
+    size_t pos = atomic_fetch_add(&outp->enqueue_pos, 1);
+    slot_t *slot = &outp->slots[pos & (QUEUE_SIZE - 1)];
+
+    slot->type = type;
+    slot->stream = stream;
+
+    if (borrowed) {
+        slot->borrowed = data;
+    } else {
+        // slot buffers are reused and grow when needed, therefore allocations
+        // happen only during the first frames.
+        if (slot->cap < size) {
+            slot->buf = realloc(slot->buf, size);
+            slot->cap = size;
+        }
+
+        slot->borrowed = NULL;
+        if (size != 0) {
+            memcpy(slot->buf, data, size);
+        }
+    }
+
+    slot->size = size;
+    slot->dts = dts;
+    slot->ntp = ntp;
+
+    slot->flags = 0;
+    if ((flags & ENCODER_OUTPUT_KEYFRAME) != 0) {
+        slot->flags |= PIPE_FLAG_KEYFRAME;
+    }
+    if ((flags & ENCODER_OUTPUT_PARAMETER_SETS) != 0) {
+        slot->flags |= PIPE_FLAG_PARAMETER_SETS;
+    }
+
+    if (nal_count <= PIPE_MAX_NALS) {
+        memcpy(slot->nal_sizes, nal_sizes, nal_count * sizeof(uint32_t));
+        slot->nal_count = nal_count;
+    } else {
+        slot->nal_count = 0;
+    }
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    sem_post(&outp->items);
+}
+
+// release spliced buffers that have been read entirely.
+static void release_consumed(output_priv_t *outp) {
+    int queued = 0;
+    ioctl(outp->pipe_fd, FIONREAD, &queued);
+    uint64_t consumed = outp->pipe_written - queued;
+
+    while (outp->pending_count > 0 &&
+           outp->pending[outp->pending_first].end <= consumed) {
+        pending_t *p = &outp->pending[outp->pending_first];
+        outp->release_cb(p->stream, p->buffer);
+        outp->pending_first = (outp->pending_first + 1) % PENDING_SIZE;
+        outp->pending_count--;
+    }
+}
+
+// release the spliced buffers of a stream, even if they have not been read
+// yet, as it happens when the writer thread is stopped.
+static void release_stream(output_priv_t *outp, int stream) {
+    int count = 0;
+
+    for (int i = 0; i < outp->pending_count; i++) {
+        pending_t *p = &outp->pending[(outp->pending_first + i) % PENDING_SIZE];
+        if (p->stream == stream) {
+            outp->release_cb(p->stream, p->buffer);
+        } else {
+            outp->pending[(outp->pending_first + count) % PENDING_SIZE] = *p;
+            count++;
+        }
+    }
+
+    outp->pending_count = count;
+}
+
+// drop every reference to frames of a stream, that is going to be
+// produced by a new encoder.
+static void suspend_stream(output_priv_t *outp, int stream) {
+    release_stream(outp, stream);
+
+    if (outp->gop_caches[stream] != NULL) {
+        gop_cache_reset(outp->gop_caches[stream]);
+    }
+
+    // parameter sets of the new encoder are sent even if they are equal to
+    // the previous ones.
+    outp->parameter_sets[stream].size = 0;
+
+    sem_post(&outp->suspended);
+}
+
+// the arena is sized to hold two GOPs at the target bitrate, since the size
+// of single GOPs is not constant.
+static bool create_gop_cache(unsigned int bitrate, unsigned int idr_period,
+                             float fps, gop_cache_t **cache) {
+    uint64_t size = 0;
+    if (fps > 0) {
+        size = (uint64_t)((double)bitrate / 8 * idr_period / fps) * 2;
+    }
+
+    if (size < GOP_CACHE_MIN_SIZE) {
+        size = GOP_CACHE_MIN_SIZE;
+    } else if (size > GOP_CACHE_MAX_SIZE) {
+        size = GOP_CACHE_MAX_SIZE;
+    }
+
+    return gop_cache_create(size, idr_period + 1, cache);
+}
+
+// replace the GOP cache of a stream with one that fits its new settings.
+// Cached frames are lost, and the cache is filled again from the next
+// keyframe.
+static void resize_cache(output_priv_t *outp, int stream,
+                         const cache_params_t *p) {
+    if (outp->gop_caches[stream] != NULL) {
+        gop_cache_destroy(outp->gop_caches[stream]);
+        outp->gop_caches[stream] = NULL;
+    }
+
+    if (!p->enabled) {
+        return;
+    }
+
+    if (!create_gop_cache(p->bitrate, p->idr_period, p->fps,
+                          &outp->gop_caches[stream])) {
+        outp->gop_caches[stream] = NULL;
+        fprintf(stderr, "unable to allocate the GOP cache of stream %d\n",
+                stream);
+    }
+}
+
+static void release_all(output_priv_t *outp) {
+    while (outp->pending_count > 0) {
+        pending_t *p = &outp->pending[outp->pending_first];
+        outp->release_cb(p->stream, p->buffer);
+        outp->pending_first = (outp->pending_first + 1) % PENDING_SIZE;
+        outp->pending_count--;
+    }
+}
+
+// write a borrowed buffer with vmsplice(). The buffer is released once the
+// reader has consumed it.
+static void splice_data(output_priv_t *outp, const slot_t *slot,
+                        const uint8_t *header, uint32_t header_size,
+                        const uint8_t *payload, uint32_t size) {
+
+    while (outp->pending_count == PENDING_SIZE) {
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = PENDING_POLL_PERIOD_NS};
+        nanosleep(&ts, NULL);
+        release_consumed(outp);
+    }
+
+    bool spliced;
+    outp->pipe_written += pipe_splice_data(outp->pipe_fd, header, header_size,
+                                           payload, size, &spliced);
+
+    if (!spliced) {
+        fprintf(stderr, "vmsplice() is not supported by encoder buffers, "
+                        "falling back to copies\n");
+        outp->splice_supported = false;
+        outp->release_cb(slot->stream, slot->borrowed);
+        return;
+    }
+
+    int i = (outp->pending_first + outp->pending_count) % PENDING_SIZE;
+    outp->pending[i].buffer = slot->borrowed;
+    outp->pending[i].stream = slot->stream;
+    outp->pending[i].end = outp->pipe_written;
+    outp->pending_count++;
+}
+
+static bool is_parameter_set(const uint8_t *nal, uint32_t size) {
+    int type = h264_nal_type(nal, size);
+    return (type == H264_NAL_SPS || type == H264_NAL_PPS);
+}
+
+// keep SPS and PPS of a frame that is dropped, in order to send them with the
+// next frame of the stream.
+static void hold_parameter_sets(stream_state_t *stream, const uint8_t *mapped,
+                                const uint32_t *nal_sizes, int nal_count) {
+    parameter_sets_t *held = &stream->held;
+    held->size = 0;
+    stream->held_nal_count = 0;
+    uint32_t offset = 0;
+
+    for (int i = 0; i < nal_count; i++) {
+        if (is_parameter_set(&mapped[offset], nal_sizes[i])) {
+            if (held->cap < held->size + nal_sizes[i]) {
+                held->cap = held->size + nal_sizes[i];
+                held->buf = realloc(held->buf, held->cap);
+            }
+            memcpy(&held->buf[held->size], &mapped[offset], nal_sizes[i]);
+            held->size += nal_sizes[i];
+            stream->held_nal_sizes[stream->held_nal_count++] = nal_sizes[i];
+        }
+        offset += nal_sizes[i];
+    }
+}
+
+// write SPS and PPS of an access unit into a dedicated message, when they
+// differ from the previous ones.
+static void update_parameter_sets(output_priv_t *outp, const slot_t *slot,
+                                  const uint8_t *payload) {
+    parameter_sets_t *tmp = &outp->parameter_sets_tmp;
+    parameter_sets_t *cur = &outp->parameter_sets[slot->stream];
+
+    tmp->size = 0;
+    uint32_t offset = 0;
+
+    for (int i = 0; i < slot->nal_count; i++) {
+        uint32_t nal_size = slot->nal_sizes[i];
+
+        if (is_parameter_set(&payload[offset], nal_size)) {
+            if (tmp->cap < tmp->size + nal_size) {
+                tmp->cap = tmp->size + nal_size;
+                tmp->buf = realloc(tmp->buf, tmp->cap);
+            }
+            memcpy(&tmp->buf[tmp->size], &payload[offset], nal_size);
+            tmp->size += nal_size;
+        }
+
+        offset += nal_size;
+    }
+
+    if (tmp->size == 0 || (tmp->size == cur->size &&
+                           memcmp(tmp->buf, cur->buf, tmp->size) == 0)) {
+        return;
+    }
+
+    parameter_sets_t swap = *cur;
+    *cur = *tmp;
+    *tmp = swap;
+
+    uint8_t header[2];
+    uint32_t header_size = pipe_parameter_sets_header(header, slot->stream);
+
+    if (outp->ring != NULL) {
+        ring_write_data(outp->ring, header, header_size, cur->buf, cur->size);
+    } else {
+        outp->pipe_written += pipe_write_data(outp->pipe_fd, header,
+                                              header_size, cur->buf, cur->size);
+    }
+}
+
+// remove SPS and PPS from an access unit.
+// Borrowed buffers cannot be modified, therefore only leading parameter sets
+// are removed from them, by moving the beginning of the payload.
+static void strip_parameter_sets(slot_t *slot, const uint8_t **payload) {
+    uint8_t *buf = slot->buf;
+    uint32_t offset = 0;
+    uint32_t write_offset = 0;
+    int count = 0;
+    bool leading = true;
+
+    for (int i = 0; i < slot->nal_count; i++) {
+        uint32_t nal_size = slot->nal_sizes[i];
+
+        if (is_parameter_set(&(*payload)[offset], nal_size) &&
+            (slot->borrowed == NULL || leading)) {
+            offset += nal_size;
+            continue;
+        }
+
+        leading = false;
+
+        if (slot->borrowed == NULL && write_offset != offset) {
+            memmove(&buf[write_offset], &buf[offset], nal_size);
+        }
+
+        slot->nal_sizes[count++] = nal_size;
+        offset += nal_size;
+        write_offset += nal_size;
+    }
+
+    if (slot->borrowed != NULL) {
+        *payload += slot->size - write_offset;
+    }
+
+    if (count == slot->nal_count) {
+        return;
+    }
+
+    slot->nal_count = count;
+    slot->size = write_offset;
+
+    bool remaining = false;
+    offset = 0;
+    for (int i = 0; i < count; i++) {
+        if (is_parameter_set(&(*payload)[offset], slot->nal_sizes[i])) {
+            remaining = true;
+        }
+        offset += slot->nal_sizes[i];
+    }
+    if (!remaining) {
+        slot->flags &= ~PIPE_FLAG_PARAMETER_SETS;
+    }
+}
+
+static void write_data(output_priv_t *outp, slot_t *slot) {
+    const uint8_t *payload =
+        (slot->borrowed != NULL) ? slot->borrowed : slot->buf;
+
+    // the NAL table is empty when the stream is not H264.
+    if (outp->parameter_sets_enabled &&
+        (slot->flags & PIPE_FLAG_PARAMETER_SETS) != 0 && slot->nal_count != 0) {
+        update_parameter_sets(outp, slot, payload);
+
+        if (outp->strip_parameter_sets) {
+            strip_parameter_sets(slot, &payload);
+        }
+    }
+
+    uint8_t header[PIPE_DATA_HEADER_MAX_SIZE];
+    uint32_t header_size = pipe_data_header(
+        header, outp->header_version, slot->stream, slot->flags,
+        slot->nal_sizes, slot->nal_count, payload, slot->dts, slot->ntp);
+
+    stats_frame_written(slot->stream, slot->dts, header_size + slot->size);
+
+    // the cache is filled before the buffer is released.
+    gop_cache_t *cache = outp->gop_caches[slot->stream];
+    if (cache != NULL) {
+        gop_cache_add(cache, payload, slot->size, slot->dts, slot->ntp,
+                      slot->flags, slot->nal_sizes, slot->nal_count);
+    }
+
+    if (outp->ring != NULL) {
+        ring_write_data(outp->ring, header, header_size, payload, slot->size);
+    } else if (slot->borrowed != NULL && outp->splice_supported) {
+        splice_data(outp, slot, header, header_size, payload, slot->size);
+        return;
+    } else {
+        outp->pipe_written += pipe_write_data(outp->pipe_fd, header,
+                                              header_size, payload, slot->size);
+    }
+
+    if (slot->borrowed != NULL) {
+        outp->release_cb(slot->stream, slot->borrowed);
+    }
+}
+
+// write the frames received since the last keyframe, with the replay flag.
+// Replayed frames always use the extended header.
+static void write_replay(output_priv_t *outp, int stream) {
+    gop_cache_t *cache = outp->gop_caches[stream];
+    if (cache == NULL) {
+        return;
+    }
+
+    int count = gop_cache_count(cache);
+
+    for (int i = 0; i < count; i++) {
+        const gop_cache_frame_t *frame = gop_cache_get(cache, i);
+
+        uint8_t header[PIPE_DATA_HEADER_MAX_SIZE];
+        uint32_t header_size = pipe_data_header(
+            header, 2, stream, frame->flags | PIPE_FLAG_REPLAY,
+            frame->nal_sizes, frame->nal_count, frame->data, frame->dts,
+            frame->ntp);
+
+        if (outp->ring != NULL) {
+            ring_write_data(outp->ring, header, header_size, frame->data,
+                            frame->size);
+        } else {
+            outp->pipe_written +=
+                pipe_write_data(outp->pipe_fd, header, header_size,
+                                frame->data, frame->size);
+        }
+    }
+}
+
+static void write_message(output_priv_t *outp, slot_t *slot) {
+    switch (slot->type) {
+    case 'r':
+        outp->pipe_written += pipe_write_ready(
+            outp->pipe_fd, (const char *)slot->buf, slot->size);
+        break;
+
+    case 'e':
+        outp->pipe_written += pipe_write_error(outp->pipe_fd, "%.*s",
+                                               (int)slot->size, slot->buf);
+        break;
+
+    case 'm':
+        outp->pipe_written += pipe_write_stats(
+            outp->pipe_fd, (const char *)slot->buf, slot->size);
+        break;
+
+    case 'd':
+        write_data(outp, slot);
+        break;
+
+    case 'g':
+        write_replay(outp, slot->stream);
+        break;
+
+    case MSG_SUSPEND:
+        suspend_stream(outp, slot->stream);
+        break;
+
+    case MSG_RESIZE_CACHE:
+        resize_cache(outp, slot->stream, (const cache_params_t *)slot->buf);
+        break;
+    }
+}
+
+// wait for the next message. While spliced buffers are waiting to be
+// consumed, the pipe is checked periodically.
+static void wait_message(output_priv_t *outp) {
+    while (outp->pending_count > 0) {
+        release_consumed(outp);
+        if (outp->pending_count == 0) {
+            break;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PENDING_POLL_PERIOD_NS;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        if (sem_timedwait(&outp->items, &ts) == 0) {
+            return;
+        }
+    }
+
+    sem_wait_safe(&outp->items);
+}
+
+static void *thread_main(void *userdata) {
+    output_priv_t *outp = (output_priv_t *)userdata;
+
+    stats_register_thread("output");
+
+    while (true) {
+        wait_message(outp);
+
+        slot_t *slot = &outp->slots[outp->dequeue_pos & (QUEUE_SIZE - 1)];
+
+        // producers may publish messages out of order.
+        while (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+               outp->dequeue_pos + 1) {
+            sched_yield();
+        }
+
+        bool stop = (slot->type == MSG_STOP);
+        if (!stop) {
+            write_message(outp, slot);
+        } else {
+            release_all(outp);
+        }
+
+        atomic_store_explicit(&slot->seq, outp->dequeue_pos + QUEUE_SIZE,
+                              memory_order_release);
+        outp->dequeue_pos++;
+        give_space(outp);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    stats_unregister_thread();
+    return NULL;
+}
+
+bool output_create(const parameters_t *params, int pipe_fd,
+                   output_release_cb release_cb, output_t **out) {
+    ring_t *ring = NULL;
+
+    // frames can be exchanged through a shared-memory ring instead of the
+    // pipe. This is negotiated once, in the first configuration message.
+    if (params->ring_fd != 0) {
+        bool ok = ring_create(params->ring_fd, params->ring_event_fd,
+                              params->ring_size, &ring);
+        if (!ok) {
+            set_error("ring_create(): %s", ring_get_error());
+            return false;
+        }
+    }
+
+    gop_cache_t *gop_caches[PARAMETERS_MAX_STREAMS] = {NULL};
+
+    for (unsigned int i = 0; params->gop_cache && i < params->stream_count;
+         i++) {
+        const parameters_stream_t *stream = &params->streams[i];
+        if (stream->width == 0) {
+            continue;
+        }
+
+        bool ok = create_gop_cache(stream->bitrate, stream->idr_period,
+                                   stream->fps, &gop_caches[i]);
+        if (!ok) {
+            set_error("unable to allocate the GOP cache");
+            for (unsigned int j = 0; j < i; j++) {
+                if (gop_caches[j] != NULL) {
+                    gop_cache_destroy(gop_caches[j]);
+                }
+            }
+            if (ring != NULL) {
+                ring_destroy(ring);
+            }
+            return false;
+        }
+    }
+
+    *out = malloc(sizeof(output_priv_t));
+    output_priv_t *outp = (output_priv_t *)(*out);
+    memset(outp, 0, sizeof(output_priv_t));
+
+    memcpy(outp->gop_caches, gop_caches, sizeof(gop_caches));
+
+    outp->pipe_fd = pipe_fd;
+    outp->ring = ring;
+    outp->release_cb = release_cb;
+    outp->splice_supported = true;
+    outp->header_version = (params->frame_header_version >= 2) ? 2 : 1;
+
+    // parameter set messages are understood by readers of the extended
+    // protocol, or by readers that asked for in-band ones to be removed.
+    outp->strip_parameter_sets = params->strip_parameter_sets;
+    outp->gop_cache_enabled = params->gop_cache;
+    outp->parameter_sets_enabled =
+        (outp->header_version >= 2 || outp->strip_parameter_sets);
+
+    if (params->output_drop_policy != NULL &&
+        strcmp(params->output_drop_policy, "block") == 0) {
+        outp->drop_policy = DROP_POLICY_BLOCK;
+    } else {
+        outp->drop_policy = DROP_POLICY_UNTIL_KEYFRAME;
+    }
+
+    for (size_t i = 0; i < QUEUE_SIZE; i++) {
+        atomic_init(&outp->slots[i].seq, i);
+    }
+    atomic_init(&outp->enqueue_pos, 0);
+    atomic_init(&outp->free_count, QUEUE_SIZE);
+    atomic_init(&outp->waiting, 0);
+    atomic_init(&outp->ready, false);
+    sem_init(&outp->items, 0, 0);
+    sem_init(&outp->space, 0, 0);
+    sem_init(&outp->suspended, 0, 0);
+
+    pthread_create(&outp->thread, NULL, thread_main, outp);
+
+    return true;
+}
+
+void output_write_ready(output_t *out, const char *report) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    take_space(outp, 0, true);
+    push(outp, 'r', 0, (const uint8_t *)report, strlen(report), false, 0, 0,
+         0, NULL, 0);
+
+    // frames produced before the ready message are discarded.
+    atomic_store(&outp->ready, true);
+}
+
+void output_write_error(output_t *out, const char *msg) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    take_space(outp, 0, true);
+    push(outp, 'e', 0, (const uint8_t *)msg, strlen(msg), false, 0, 0, 0,
+         NULL, 0);
+}
+
+// statistics are not sent when the queue is almost full.
+void output_write_stats(output_t *out, const char *report) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    if (!atomic_load(&outp->ready)) {
+        return;
+    }
+
+    if (!take_space(outp, QUEUE_KEYFRAME_RESERVE, false)) {
+        return;
+    }
+    push(outp, 'm', 0, (const uint8_t *)report, strlen(report), false, 0, 0, 0,
+         NULL, 0);
+}
+
+// send again the frames of the current GOP.
+void output_replay(output_t *out, int stream) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    if (!atomic_load(&outp->ready)) {
+        return;
+    }
+
+    take_space(outp, 0, true);
+    push(outp, 'g', stream, NULL, 0, false, 0, 0, 0, NULL, 0);
+}
+
+static void enqueue_data(output_priv_t *outp, int stream_id,
+                         const uint8_t *mapped, uint64_t size, uint64_t dts,
+                         uint64_t ntp, uint32_t flags,
+                         const uint32_t *nal_sizes, int nal_count) {
+    stream_state_t *stream = &outp->streams[stream_id];
+    bool borrowed = (flags & ENCODER_OUTPUT_BORROWED) != 0;
+
+    if (!atomic_load(&outp->ready)) {
+        if (borrowed) {
+            outp->release_cb(stream_id, mapped);
+        }
+        return;
+    }
+
+    if (outp->drop_policy == DROP_POLICY_BLOCK) {
+        take_space(outp, 0, true);
+        push(outp, 'd', stream_id, mapped, size, borrowed, dts, ntp, flags,
+             nal_sizes, nal_count);
+        return;
+    }
+
+    bool is_keyframe = (flags & ENCODER_OUTPUT_KEYFRAME) != 0;
+    bool has_parameter_sets = (flags & ENCODER_OUTPUT_PARAMETER_SETS) != 0;
+    bool ok;
+
+    // frames following a dropped frame cannot be decoded until the next
+    // keyframe.
+    if (stream->skip_until_keyframe && !is_keyframe) {
+        ok = false;
+    } else if (is_keyframe) {
+        ok = take_space(outp, 0, false);
+    } else {
+        ok = take_space(outp, QUEUE_KEYFRAME_RESERVE, false);
+    }
+
+    if (!ok) {
+        // parameter sets are never dropped, but the thread of the encoder
+        // cannot be blocked either, therefore they are sent with the next
+        // frame.
+        if (has_parameter_sets) {
+            hold_parameter_sets(stream, mapped, nal_sizes, nal_count);
+        }
+
+        atomic_fetch_add(&stream->dropped, 1);
+        stats_frame_dropped(stream_id);
+        if (!stream->skip_until_keyframe) {
+            fprintf(stderr, "output queue is full, dropping frames until "
+                            "next keyframe\n");
+            stream->skip_until_keyframe = true;
+        }
+        if (borrowed) {
+            outp->release_cb(stream_id, mapped);
+        }
+        return;
+    }
+
+    stream->skip_until_keyframe = false;
+
+    if (stream->held_nal_count != 0 && !has_parameter_sets) {
+        // parameter sets are put in front of the frame, that is copied.
+        parameter_sets_t *merged = &stream->merged;
+        uint32_t merged_size = stream->held.size + size;
+        if (merged->cap < merged_size) {
+            merged->cap = merged_size;
+            merged->buf = realloc(merged->buf, merged->cap);
+        }
+        memcpy(merged->buf, stream->held.buf, stream->held.size);
+        memcpy(&merged->buf[stream->held.size], mapped, size);
+        merged->size = merged_size;
+
+        uint32_t merged_nal_sizes[2 * PIPE_MAX_NALS];
+        memcpy(merged_nal_sizes, stream->held_nal_sizes,
+               stream->held_nal_count * sizeof(uint32_t));
+        memcpy(&merged_nal_sizes[stream->held_nal_count], nal_sizes,
+               nal_count * sizeof(uint32_t));
+
+        // the NAL table cannot be built when the one of the frame is empty.
+        int merged_nal_count =
+            (nal_count != 0) ? (stream->held_nal_count + nal_count) : 0;
+
+        push(outp, 'd', stream_id, merged->buf, merged->size, false, dts, ntp,
+             flags | ENCODER_OUTPUT_PARAMETER_SETS, merged_nal_sizes,
+             merged_nal_count);
+        stream->held_nal_count = 0;
+
+        if (borrowed) {
+            outp->release_cb(stream_id, mapped);
+        }
+        return;
+    }
+
+    // parameter sets of the frame replace the held ones.
+    if (has_parameter_sets) {
+        stream->held_nal_count = 0;
+    }
+
+    push(outp, 'd', stream_id, mapped, size, borrowed, dts, ntp, flags,
+         nal_sizes, nal_count);
+}
+
+void output_write_data(output_t *out, int stream_id, const uint8_t *mapped,
+                       uint64_t size, uint64_t dts, uint64_t ntp,
+                       uint32_t flags, const uint32_t *nal_sizes,
+                       int nal_count) {
+    output_priv_t *outp = (output_priv_t *)out;
+    stream_state_t *stream = &outp->streams[stream_id];
+
+    atomic_fetch_add(&stream->writers, 1);
+
+    if (atomic_load(&stream->suspended)) {
+        if ((flags & ENCODER_OUTPUT_BORROWED) != 0) {
+            outp->release_cb(stream_id, mapped);
+        }
+    } else {
+        enqueue_data(outp, stream_id, mapped, size, dts, ntp, flags,
+                     nal_sizes, nal_count);
+    }
+
+    atomic_fetch_sub(&stream->writers, 1);
+}
+
+// stop writing frames of a stream and wait until buffers of the stream are
+// not referenced anymore, in order to allow its encoder to be destroyed.
+// The GOP cache and the parameter sets of the stream are reset.
+void output_suspend_stream(output_t *out, int stream_id) {
+    output_priv_t *outp = (output_priv_t *)out;
+    stream_state_t *stream = &outp->streams[stream_id];
+
+    atomic_store(&stream->suspended, true);
+
+    // frames that are being queued are written before the suspension.
+    while (atomic_load(&stream->writers) != 0) {
+        sched_yield();
+    }
+
+    take_space(outp, 0, true);
+    push(outp, MSG_SUSPEND, stream_id, NULL, 0, false, 0, 0, 0, NULL, 0);
+    sem_wait_safe(&outp->suspended);
+}
+
+void output_resume_stream(output_t *out, int stream_id) {
+    output_priv_t *outp = (output_priv_t *)out;
+    stream_state_t *stream = &outp->streams[stream_id];
+
+    stream->skip_until_keyframe = false;
+    stream->held_nal_count = 0;
+    atomic_store(&stream->suspended, false);
+}
+
+// the GOP cache is sized after the bitrate, the IDR period and the frame
+// rate of the stream, therefore it must be resized when they change, or
+// when the stream is enabled or disabled.
+void output_resize_gop_cache(output_t *out, int stream,
+                             const parameters_stream_t *params) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    if (!outp->gop_cache_enabled) {
+        return;
+    }
+
+    cache_params_t p = {
+        .bitrate = params->bitrate,
+        .idr_period = params->idr_period,
+        .fps = params->fps,
+        .enabled = (params->width != 0),
+    };
+
+    take_space(outp, 0, true);
+    push(outp, MSG_RESIZE_CACHE, stream, (const uint8_t *)&p, sizeof(p),
+         false, 0, 0, 0, NULL, 0);
+}
+
+uint64_t output_get_dropped(output_t *out, int stream) {
+    output_priv_t *outp = (output_priv_t *)out;
+    return atomic_load(&outp->streams[stream].dropped);
+}
+
+// write pending messages and stop the writer thread.
+// Frames received after this call are discarded.
+void output_stop(output_t *out) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    atomic_store(&outp->ready, false);
+
+    take_space(outp, 0, true);
+    push(outp, MSG_STOP, 0, NULL, 0, false, 0, 0, 0, NULL, 0);
+    pthread_join(outp->thread, NULL);
+}
+
+void output_destroy(output_t *out) {
+    output_priv_t *outp = (output_priv_t *)out;
+
+    for (size_t i = 0; i < QUEUE_SIZE; i++) {
+        free(outp->slots[i].buf);
+    }
+
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        free(outp->streams[i].held.buf);
+        free(outp->streams[i].merged.buf);
+    }
+
+    free(outp->parameter_sets_tmp.buf);
+
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        free(outp->parameter_sets[i].buf);
+        if (outp->gop_caches[i] != NULL) {
+            gop_cache_destroy(outp->gop_caches[i]);
+        }
+    }
+
+    sem_destroy(&outp->items);
+    sem_destroy(&outp->space);
+    sem_destroy(&outp->suspended);
+
+    if (outp->ring != NULL) {
+        ring_destroy(outp->ring);
+    }
+
+    free(outp);
+}
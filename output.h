@@ -0,0 +1,33 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parameters.h"
+
+typedef void output_t;
+
+// called when a borrowed buffer is not needed anymore.
+typedef void (*output_release_cb)(int stream, const uint8_t *buffer);
+
+const char *output_get_error();
+bool output_create(const parameters_t *params, int pipe_fd,
+                   output_release_cb release_cb, output_t **out);
+void output_write_ready(output_t *out, const char *report);
+void output_write_error(output_t *out, const char *msg);
+void output_write_stats(output_t *out, const char *report);
+void output_replay(output_t *out, int stream);
+void output_write_data(output_t *out, int stream, const uint8_t *mapped,
+                       uint64_t size, uint64_t dts, uint64_t ntp,
+                       uint32_t flags, const uint32_t *nal_sizes,
+                       int nal_count);
+void output_suspend_stream(output_t *out, int stream);
+void output_resume_stream(output_t *out, int stream);
+void output_resize_gop_cache(output_t *out, int stream,
+                             const parameters_stream_t *params);
+uint64_t output_get_dropped(output_t *out, int stream);
+void output_stop(output_t *out);
+void output_destroy(output_t *out);
+
+#endif
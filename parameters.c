@@ -17,6 +17,272 @@ static void set_error(const char *format, ...) {
 
 const char *parameters_get_error() { return errbuf; }
 
+static bool load_crop(const char *val, const char *name, window_t **crop) {
+    char *decoded_val = base64_decode(val);
+    if (strlen(decoded_val) != 0) {
+        *crop = malloc(sizeof(window_t));
+        bool ok = window_load(decoded_val, *crop);
+        if (!ok) {
+            set_error("invalid %s", name);
+            free(decoded_val);
+            return false;
+        }
+    }
+    free(decoded_val);
+    return true;
+}
+
+// parse an additional stream, in the format
+// width,height,fpsDivider,codec,bitrate,idrPeriod[,x,y,width,height]
+// the crop is normalized.
+static bool load_extra_stream(char *entry, const parameters_t *params,
+                              parameters_stream_t *stream) {
+    char *fields[10];
+    int n = 0;
+    char *token;
+
+    while ((token = strsep(&entry, ",")) != NULL) {
+        if (n == 10) {
+            return false;
+        }
+        fields[n++] = token;
+    }
+
+    if (n != 6 && n != 10) {
+        return false;
+    }
+
+    unsigned int fps_divider = atoi(fields[2]);
+    if (fps_divider == 0) {
+        return false;
+    }
+
+    stream->width = atoi(fields[0]);
+    stream->height = atoi(fields[1]);
+    stream->fps = params->fps / fps_divider;
+    stream->codec = strdup(fields[3]);
+    stream->bitrate = atoi(fields[4]);
+    stream->idr_period = atoi(fields[5]);
+    stream->h264_profile =
+        (params->h264_profile != NULL) ? strdup(params->h264_profile) : NULL;
+    stream->h264_level =
+        (params->h264_level != NULL) ? strdup(params->h264_level) : NULL;
+    stream->mjpeg_quality = params->mjpeg_quality;
+
+    if (stream->width == 0 || stream->height == 0) {
+        return false;
+    }
+
+    if (n == 10) {
+        window_t crop;
+        crop.x = atof(fields[6]);
+        crop.y = atof(fields[7]);
+        crop.width = atof(fields[8]);
+        crop.height = atof(fields[9]);
+        if (crop.x < 0 || crop.y < 0 || crop.width <= 0 || crop.height <= 0 ||
+            (crop.x + crop.width) > 1 || (crop.y + crop.height) > 1) {
+            return false;
+        }
+        stream->crop = malloc(sizeof(window_t));
+        *stream->crop = crop;
+    }
+
+    return true;
+}
+
+// parse the stream of an additional camera, in the format
+// cameraId,width,height,fps,codec,bitrate,idrPeriod
+// Each additional camera produces a single stream, that is its primary one.
+static bool load_camera_stream(char *entry, const parameters_t *params,
+                               parameters_stream_t *stream) {
+    char *fields[7];
+    int n = 0;
+    char *token;
+
+    while ((token = strsep(&entry, ",")) != NULL) {
+        if (n == 7) {
+            return false;
+        }
+        fields[n++] = token;
+    }
+
+    if (n != 7) {
+        return false;
+    }
+
+    stream->camera_id = atoi(fields[0]);
+    stream->width = atoi(fields[1]);
+    stream->height = atoi(fields[2]);
+    stream->fps = atof(fields[3]);
+    stream->codec = strdup(fields[4]);
+    stream->bitrate = atoi(fields[5]);
+    stream->idr_period = atoi(fields[6]);
+    stream->h264_profile =
+        (params->h264_profile != NULL) ? strdup(params->h264_profile) : NULL;
+    stream->h264_level =
+        (params->h264_level != NULL) ? strdup(params->h264_level) : NULL;
+    stream->mjpeg_quality = params->mjpeg_quality;
+
+    if (stream->width == 0 || stream->height == 0 || stream->fps <= 0) {
+        return false;
+    }
+
+    // streams of other cameras precede this one.
+    unsigned int camera_count = 1;
+    for (unsigned int i = 0; i < params->stream_count; i++) {
+        const parameters_stream_t *other = &params->streams[i];
+        if (other == stream || other->width == 0) {
+            continue;
+        }
+        if (other->camera_id == stream->camera_id) {
+            return false;
+        }
+        if (other->camera_id != params->camera_id) {
+            camera_count++;
+        }
+    }
+
+    return (camera_count < PARAMETERS_MAX_CAMERAS);
+}
+
+// parse a scaled stream, in the format
+// source,levels,codec,bitrate,idrPeriod
+static bool load_scaled_stream(char *entry, const parameters_t *params,
+                               parameters_stream_t *stream) {
+    char *fields[5];
+    int n = 0;
+    char *token;
+
+    while ((token = strsep(&entry, ",")) != NULL) {
+        if (n == 5) {
+            return false;
+        }
+        fields[n++] = token;
+    }
+
+    if (n != 5) {
+        return false;
+    }
+
+    stream->scale_source = atoi(fields[0]);
+    stream->scale_levels = atoi(fields[1]);
+    stream->codec = strdup(fields[2]);
+    stream->bitrate = atoi(fields[3]);
+    stream->idr_period = atoi(fields[4]);
+
+    if (stream->scale_source >= params->stream_count ||
+        stream->scale_levels == 0 ||
+        stream->scale_levels > PARAMETERS_MAX_SCALE_LEVELS) {
+        return false;
+    }
+
+    // only streams produced by the ISP can be downscaled.
+    const parameters_stream_t *source = &params->streams[stream->scale_source];
+    if (source->width == 0 || source->scale_levels != 0) {
+        return false;
+    }
+
+    // chroma planes must be downscaled by the same number of levels.
+    unsigned int align = 1 << (stream->scale_levels + 1);
+    if ((source->width % align) != 0 || (source->height % align) != 0) {
+        return false;
+    }
+
+    stream->width = source->width >> stream->scale_levels;
+    stream->height = source->height >> stream->scale_levels;
+    stream->fps = source->fps;
+    stream->camera_id = source->camera_id;
+    stream->h264_profile =
+        (source->h264_profile != NULL) ? strdup(source->h264_profile) : NULL;
+    stream->h264_level =
+        (source->h264_level != NULL) ? strdup(source->h264_level) : NULL;
+    stream->mjpeg_quality = source->mjpeg_quality;
+
+    return true;
+}
+
+typedef bool (*stream_loader_t)(char *entry, const parameters_t *params,
+                                parameters_stream_t *stream);
+
+static bool load_stream_list(parameters_t *params, char *list,
+                             stream_loader_t loader) {
+    if (list == NULL || strlen(list) == 0) {
+        return true;
+    }
+
+    // stream IDs of additional streams start from 2, even when the secondary
+    // stream is disabled.
+    if (params->stream_count < 2) {
+        params->stream_count = 2;
+    }
+    char *entry;
+
+    while ((entry = strsep(&list, ";")) != NULL) {
+        if (params->stream_count == PARAMETERS_MAX_STREAMS) {
+            set_error("too many streams, maximum is %d",
+                      PARAMETERS_MAX_STREAMS);
+            return false;
+        }
+
+        parameters_stream_t *stream = &params->streams[params->stream_count];
+        stream->id = params->stream_count;
+        stream->camera_id = params->camera_id;
+        params->stream_count++;
+
+        if (!loader(entry, params, stream)) {
+            set_error("invalid stream %u", params->stream_count - 1);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// fill the stream list. The primary and secondary streams are taken from
+// flat fields, the others from the Streams, CameraStreams and ScaledStreams
+// parameters, lists of entries separated by semicolons. Scaled streams come
+// last.
+static bool load_streams(parameters_t *params, char *extra, char *cameras,
+                         char *scaled) {
+    params->streams[0] = (parameters_stream_t){
+        .width = params->width,
+        .height = params->height,
+        .fps = params->fps,
+        .crop = params->crop,
+        .codec = params->codec,
+        .idr_period = params->idr_period,
+        .bitrate = params->bitrate,
+        .h264_profile = params->h264_profile,
+        .h264_level = params->h264_level,
+        .mjpeg_quality = params->mjpeg_quality,
+        .id = 0,
+        .camera_id = params->camera_id,
+    };
+    params->stream_count = 1;
+
+    params->streams[1] = (parameters_stream_t){
+        .width = params->secondary_width,
+        .height = params->secondary_height,
+        .fps = params->secondary_fps,
+        .crop = params->secondary_crop,
+        .codec = params->secondary_codec,
+        .idr_period = params->secondary_idr_period,
+        .bitrate = params->secondary_bitrate,
+        .h264_profile = params->secondary_h264_profile,
+        .h264_level = params->secondary_h264_level,
+        .mjpeg_quality = params->secondary_mjpeg_quality,
+        .id = 1,
+        .camera_id = params->camera_id,
+    };
+    if (params->secondary_width != 0) {
+        params->stream_count = 2;
+    }
+
+    return load_stream_list(params, extra, load_extra_stream) &&
+           load_stream_list(params, cameras, load_camera_stream) &&
+           load_stream_list(params, scaled, load_scaled_stream);
+}
+
 bool parameters_unserialize(const uint8_t *buf, size_t buf_size,
                             parameters_t **params) {
     *params = malloc(sizeof(parameters_t));
@@ -27,6 +293,12 @@ bool parameters_unserialize(const uint8_t *buf, size_t buf_size,
     copy[buf_size] = 0x00;
     char *ptr = copy;
     char *entry;
+    char *extra_streams = NULL;
+    char *camera_streams = NULL;
+    char *scaled_streams = NULL;
+
+    (*params)->watchdog_frames = 10;
+    (*params)->buffer_count = 3;
 
     while ((entry = strsep(&ptr, " ")) != NULL) {
         char *key = strsep(&entry, ":");
@@ -156,22 +428,340 @@ bool parameters_unserialize(const uint8_t *buf, size_t buf_size,
             (*params)->secondary_h264_level = base64_decode(val);
         } else if (strcmp(key, "SecondaryMJPEGQuality") == 0) {
             (*params)->secondary_mjpeg_quality = atoi(val);
+        } else if (strcmp(key, "RingFD") == 0) {
+            (*params)->ring_fd = atoi(val);
+        } else if (strcmp(key, "RingEventFD") == 0) {
+            (*params)->ring_event_fd = atoi(val);
+        } else if (strcmp(key, "RingSize") == 0) {
+            (*params)->ring_size = atoi(val);
+        } else if (strcmp(key, "OutputDropPolicy") == 0) {
+            (*params)->output_drop_policy = base64_decode(val);
+        } else if (strcmp(key, "OutputZeroCopy") == 0) {
+            (*params)->output_zero_copy = (strcmp(val, "1") == 0);
+        } else if (strcmp(key, "FrameHeaderVersion") == 0) {
+            (*params)->frame_header_version = atoi(val);
+        } else if (strcmp(key, "StripParameterSets") == 0) {
+            (*params)->strip_parameter_sets = (strcmp(val, "1") == 0);
+        } else if (strcmp(key, "StatsPeriod") == 0) {
+            (*params)->stats_period = atoi(val);
+        } else if (strcmp(key, "GOPCache") == 0) {
+            (*params)->gop_cache = (strcmp(val, "1") == 0);
+        } else if (strcmp(key, "Standby") == 0) {
+            (*params)->standby = (strcmp(val, "1") == 0);
+        } else if (strcmp(key, "WatchdogFrames") == 0) {
+            (*params)->watchdog_frames = atoi(val);
+        } else if (strcmp(key, "BufferCount") == 0) {
+            (*params)->buffer_count = atoi(val);
+            if ((*params)->buffer_count > PARAMETERS_MAX_BUFFER_COUNT) {
+                set_error("invalid BufferCount");
+                goto failed;
+            }
+        } else if (strcmp(key, "BufferMemoryBudget") == 0) {
+            (*params)->buffer_memory_budget = atoi(val);
+        } else if (strcmp(key, "BufferArena") == 0) {
+            (*params)->buffer_arena = (strcmp(val, "1") == 0);
+        } else if (strcmp(key, "LowMemory") == 0) {
+            (*params)->low_memory = (strcmp(val, "1") == 0);
+        } else if (strcmp(key, "StateFile") == 0) {
+            char *decoded_val = base64_decode(val);
+            if (strlen(decoded_val) != 0) {
+                free((*params)->state_file);
+                (*params)->state_file = decoded_val;
+            } else {
+                free(decoded_val);
+            }
+        } else if (strcmp(key, "Crop") == 0) {
+            if (!load_crop(val, "Crop", &(*params)->crop)) {
+                goto failed;
+            }
+        } else if (strcmp(key, "SecondaryCrop") == 0) {
+            if (!load_crop(val, "SecondaryCrop", &(*params)->secondary_crop)) {
+                goto failed;
+            }
+        } else if (strcmp(key, "Streams") == 0) {
+            free(extra_streams);
+            extra_streams = base64_decode(val);
+        } else if (strcmp(key, "CameraStreams") == 0) {
+            free(camera_streams);
+            camera_streams = base64_decode(val);
+        } else if (strcmp(key, "ScaledStreams") == 0) {
+            free(scaled_streams);
+            scaled_streams = base64_decode(val);
         }
     }
 
-    (*params)->buffer_count = 3;
+    // streams depend on other fields, therefore they are filled at the end.
+    if (!load_streams(*params, extra_streams, camera_streams,
+                      scaled_streams)) {
+        goto failed;
+    }
 
+    free(extra_streams);
+    free(camera_streams);
+    free(scaled_streams);
     free(copy);
 
     return true;
 
 failed:
+    free(extra_streams);
+    free(camera_streams);
+    free(scaled_streams);
     free(copy);
     parameters_destroy(*params);
 
     return false;
 }
 
+static bool str_equal(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return (a == b);
+    }
+    return (strcmp(a, b) == 0);
+}
+
+// whether two sensor modes are the same.
+static bool mode_equal(const sensor_mode_t *a, const sensor_mode_t *b) {
+    if (a == NULL || b == NULL) {
+        return (a == b);
+    }
+    return (a->width == b->width && a->height == b->height &&
+            a->bit_depth == b->bit_depth && a->packed == b->packed);
+}
+
+static bool window_equal(const window_t *a, const window_t *b) {
+    if (a == NULL || b == NULL) {
+        return (a == b);
+    }
+    return (a->x == b->x && a->y == b->y && a->width == b->width &&
+            a->height == b->height);
+}
+
+// whether a stream is produced by the ISP.
+static bool is_isp_stream(const parameters_stream_t *stream) {
+    return (stream->width != 0 && stream->scale_levels == 0);
+}
+
+static bool stream_format_equal(const parameters_stream_t *a,
+                                const parameters_stream_t *b) {
+    return (a->width == b->width && a->height == b->height &&
+            str_equal(a->codec, b->codec) &&
+            str_equal(a->h264_profile, b->h264_profile) &&
+            str_equal(a->h264_level, b->h264_level) &&
+            a->mjpeg_quality == b->mjpeg_quality &&
+            a->scale_levels == b->scale_levels &&
+            a->scale_source == b->scale_source);
+}
+
+// whether the streams of the camera or their buffers differ.
+static bool camera_config_equal(const parameters_t *a,
+                                const parameters_t *b) {
+    if (!mode_equal(a->mode, b->mode) || a->h_flip != b->h_flip ||
+        a->v_flip != b->v_flip || a->buffer_count != b->buffer_count ||
+        a->buffer_memory_budget != b->buffer_memory_budget ||
+        a->buffer_arena != b->buffer_arena || a->low_memory != b->low_memory) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        const parameters_stream_t *sa = &a->streams[i];
+        const parameters_stream_t *sb = &b->streams[i];
+
+        if (is_isp_stream(sa) != is_isp_stream(sb) ||
+            (is_isp_stream(sa) &&
+             (sa->width != sb->width || sa->height != sb->height))) {
+            return false;
+        }
+
+        // in low memory mode, streams are mapped only when they are read by
+        // the CPU, that depends on codecs, on the overlay and on scalers.
+        if (a->low_memory &&
+            (!str_equal(sa->codec, sb->codec) ||
+             sa->scale_levels != sb->scale_levels ||
+             sa->scale_source != sb->scale_source)) {
+            return false;
+        }
+    }
+
+    return (!a->low_memory || a->text_overlay_enable == b->text_overlay_enable);
+}
+
+// compare the parameters that can be changed at runtime.
+// Returns a bitmask of PARAMETERS_* with the ones that differ.
+uint64_t parameters_diff(const parameters_t *a, const parameters_t *b) {
+    uint64_t diff = 0;
+
+    if (a->brightness != b->brightness) {
+        diff |= PARAMETERS_BRIGHTNESS;
+    }
+    if (a->contrast != b->contrast) {
+        diff |= PARAMETERS_CONTRAST;
+    }
+    if (a->saturation != b->saturation) {
+        diff |= PARAMETERS_SATURATION;
+    }
+    if (a->sharpness != b->sharpness) {
+        diff |= PARAMETERS_SHARPNESS;
+    }
+    if (!str_equal(a->exposure, b->exposure)) {
+        diff |= PARAMETERS_EXPOSURE;
+    }
+    if (a->flicker_period != b->flicker_period) {
+        diff |= PARAMETERS_FLICKER_PERIOD;
+    }
+    if (!str_equal(a->awb, b->awb)) {
+        diff |= PARAMETERS_AWB;
+    }
+    if (a->awb_gain_red != b->awb_gain_red ||
+        a->awb_gain_blue != b->awb_gain_blue) {
+        diff |= PARAMETERS_AWB_GAINS;
+    }
+    if (!str_equal(a->denoise, b->denoise)) {
+        diff |= PARAMETERS_DENOISE;
+    }
+    if (a->shutter != b->shutter) {
+        diff |= PARAMETERS_SHUTTER;
+    }
+    if (!str_equal(a->metering, b->metering)) {
+        diff |= PARAMETERS_METERING;
+    }
+    if (a->gain != b->gain) {
+        diff |= PARAMETERS_GAIN;
+    }
+    if (a->ev != b->ev) {
+        diff |= PARAMETERS_EV;
+    }
+    if (a->fps != b->fps) {
+        diff |= PARAMETERS_FPS;
+    }
+    if (a->text_overlay_enable != b->text_overlay_enable ||
+        !str_equal(a->text_overlay, b->text_overlay)) {
+        diff |= PARAMETERS_TEXT_OVERLAY;
+    }
+    for (unsigned int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (a->streams[i].idr_period != b->streams[i].idr_period) {
+            diff |= PARAMETERS_STREAM_IDR_PERIOD(i);
+        }
+        if (a->streams[i].bitrate != b->streams[i].bitrate) {
+            diff |= PARAMETERS_STREAM_BITRATE(i);
+        }
+        if (a->streams[i].fps != b->streams[i].fps) {
+            diff |= PARAMETERS_STREAM_FPS(i);
+        }
+        if (!stream_format_equal(&a->streams[i], &b->streams[i])) {
+            diff |= PARAMETERS_STREAM_FORMAT(i);
+        }
+    }
+
+    if (!camera_config_equal(a, b)) {
+        diff |= PARAMETERS_CAMERA_CONFIG;
+    }
+
+    bool crops_equal = true;
+    for (unsigned int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        crops_equal &= window_equal(a->streams[i].crop, b->streams[i].crop);
+    }
+    if (!crops_equal || !window_equal(a->roi, b->roi) ||
+        !window_equal(a->af_window, b->af_window) ||
+        !str_equal(a->af_mode, b->af_mode) ||
+        !str_equal(a->af_range, b->af_range) ||
+        !str_equal(a->af_speed, b->af_speed) ||
+        a->lens_position != b->lens_position) {
+        diff |= PARAMETERS_CAMERA_RESTART;
+    }
+
+    for (unsigned int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        if (a->streams[i].camera_id != b->streams[i].camera_id) {
+            diff |= PARAMETERS_CAMERAS;
+        }
+    }
+
+    if (a->camera_id != b->camera_id || a->hdr != b->hdr ||
+        !str_equal(a->tuning_file, b->tuning_file) ||
+        !str_equal(a->state_file, b->state_file) ||
+        !str_equal(a->log_level, b->log_level) || a->ring_fd != b->ring_fd ||
+        a->gop_cache != b->gop_cache ||
+        a->frame_header_version != b->frame_header_version ||
+        a->strip_parameter_sets != b->strip_parameter_sets ||
+        !str_equal(a->output_drop_policy, b->output_drop_policy) ||
+        a->output_zero_copy != b->output_zero_copy) {
+        diff |= PARAMETERS_PROCESS_RESTART;
+    }
+
+    return diff;
+}
+
+// list the cameras that produce streams. The camera of the primary stream
+// comes first.
+unsigned int parameters_get_cameras(const parameters_t *params,
+                                    unsigned int *camera_ids) {
+    unsigned int count = 0;
+    camera_ids[count++] = params->camera_id;
+
+    for (unsigned int i = 0; i < params->stream_count; i++) {
+        const parameters_stream_t *stream = &params->streams[i];
+        if (stream->width == 0) {
+            continue;
+        }
+
+        bool found = false;
+        for (unsigned int j = 0; j < count; j++) {
+            found |= (camera_ids[j] == stream->camera_id);
+        }
+        if (!found && count < PARAMETERS_MAX_CAMERAS) {
+            camera_ids[count++] = stream->camera_id;
+        }
+    }
+
+    return count;
+}
+
+// fill view with the parameters of a single camera, whose streams are
+// numbered from zero, starting with its primary stream. Pointers are shared
+// with params, therefore the view must not be destroyed.
+void parameters_camera_view(const parameters_t *params,
+                            unsigned int camera_id, parameters_t *view) {
+    *view = *params;
+    view->camera_id = camera_id;
+    view->stream_count = 0;
+    memset(view->streams, 0, sizeof(view->streams));
+
+    // index of each stream of params in the view.
+    int indexes[PARAMETERS_MAX_STREAMS] = {0};
+
+    for (unsigned int i = 0; i < params->stream_count; i++) {
+        const parameters_stream_t *stream = &params->streams[i];
+        if (stream->camera_id != camera_id) {
+            continue;
+        }
+
+        parameters_stream_t *dest = &view->streams[view->stream_count];
+        *dest = *stream;
+        if (stream->scale_levels != 0) {
+            dest->scale_source = indexes[stream->scale_source];
+        }
+        indexes[i] = view->stream_count++;
+    }
+
+    if (camera_id == params->camera_id) {
+        return;
+    }
+
+    // settings that are bound to the sensor or to the primary stream of
+    // the process are not applied to additional cameras.
+    const parameters_stream_t *primary = &view->streams[0];
+    view->width = primary->width;
+    view->height = primary->height;
+    view->fps = primary->fps;
+    view->crop = primary->crop;
+    view->codec = primary->codec;
+    view->idr_period = primary->idr_period;
+    view->bitrate = primary->bitrate;
+    view->mode = NULL;
+    view->text_overlay_enable = false;
+    view->state_file = NULL;
+}
+
 void parameters_destroy(parameters_t *params) {
     if (params->exposure != NULL) {
         free(params->exposure);
@@ -221,5 +811,24 @@ void parameters_destroy(parameters_t *params) {
     if (params->secondary_h264_level != NULL) {
         free(params->secondary_h264_level);
     }
+    if (params->output_drop_policy != NULL) {
+        free(params->output_drop_policy);
+    }
+    if (params->state_file != NULL) {
+        free(params->state_file);
+    }
+    if (params->crop != NULL) {
+        free(params->crop);
+    }
+    if (params->secondary_crop != NULL) {
+        free(params->secondary_crop);
+    }
+    // strings of the first two streams are owned by the flat fields.
+    for (unsigned int i = 2; i < PARAMETERS_MAX_STREAMS; i++) {
+        free(params->streams[i].crop);
+        free(params->streams[i].codec);
+        free(params->streams[i].h264_profile);
+        free(params->streams[i].h264_level);
+    }
     free(params);
 }
@@ -7,6 +7,41 @@
 #include "sensor_mode.h"
 #include "window.h"
 
+// maximum number of output streams.
+#define PARAMETERS_MAX_STREAMS 6
+
+// maximum number of 2:1 downscaling steps of scaled streams.
+#define PARAMETERS_MAX_SCALE_LEVELS 4
+
+// maximum number of cameras driven by the process.
+#define PARAMETERS_MAX_CAMERAS 4
+
+// settings of an output stream. Stream 0 is the primary stream and stream 1
+// is the secondary one; their strings alias the flat fields of parameters_t.
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    float fps;
+    // portion of the sensor image to use, normalized. NULL means full frame.
+    window_t *crop;
+    char *codec;
+    unsigned int idr_period;
+    unsigned int bitrate;
+    char *h264_profile;
+    char *h264_level;
+    unsigned int mjpeg_quality;
+    // when not zero, the stream is not produced by the ISP but is obtained
+    // by downscaling stream scale_source by 2^scale_levels with the CPU.
+    unsigned int scale_levels;
+    unsigned int scale_source;
+    // ID of the stream in the pipe, that differs from its index in the
+    // parameters of a single camera.
+    unsigned int id;
+    // camera that produces the stream. Scaled streams take the camera of
+    // their source.
+    unsigned int camera_id;
+} parameters_stream_t;
+
 typedef struct {
     char *log_level;
     unsigned int camera_id;
@@ -55,11 +90,86 @@ typedef struct {
     char *secondary_h264_profile;
     char *secondary_h264_level;
     unsigned int secondary_mjpeg_quality;
-
-    // private
+    unsigned int ring_fd;
+    unsigned int ring_event_fd;
+    unsigned int ring_size;
+    char *output_drop_policy;
+    bool output_zero_copy;
+    unsigned int frame_header_version;
+    bool strip_parameter_sets;
+    unsigned int stats_period;
+    bool gop_cache;
+    bool standby;
+    unsigned int watchdog_frames;
+    // zero enables adaptive mode.
     unsigned int buffer_count;
+    // MiB. Limits the buffer count in adaptive mode.
+    unsigned int buffer_memory_budget;
+    // allocate a single DMA buffer per stream and slice frames out of it.
+    bool buffer_arena;
+    // reduce memory usage of buffers, for boards with little RAM.
+    bool low_memory;
+    // file where the converged AE/AWB state is saved, in order to seed the
+    // next start. NULL when disabled.
+    char *state_file;
+    window_t *crop;
+    window_t *secondary_crop;
+    // streams, indexed by stream ID. Streams with zero width are disabled.
+    parameters_stream_t streams[PARAMETERS_MAX_STREAMS];
+    unsigned int stream_count;
 } parameters_t;
 
+// maximum buffer count.
+#define PARAMETERS_MAX_BUFFER_COUNT 16
+
+// parameters that can be changed at runtime.
+#define PARAMETERS_BRIGHTNESS (1ULL << 0)
+#define PARAMETERS_CONTRAST (1ULL << 1)
+#define PARAMETERS_SATURATION (1ULL << 2)
+#define PARAMETERS_SHARPNESS (1ULL << 3)
+#define PARAMETERS_EXPOSURE (1ULL << 4)
+#define PARAMETERS_FLICKER_PERIOD (1ULL << 5)
+#define PARAMETERS_AWB (1ULL << 6)
+#define PARAMETERS_AWB_GAINS (1ULL << 7)
+#define PARAMETERS_DENOISE (1ULL << 8)
+#define PARAMETERS_SHUTTER (1ULL << 9)
+#define PARAMETERS_METERING (1ULL << 10)
+#define PARAMETERS_GAIN (1ULL << 11)
+#define PARAMETERS_EV (1ULL << 12)
+#define PARAMETERS_FPS (1ULL << 13)
+#define PARAMETERS_TEXT_OVERLAY (1ULL << 14)
+#define PARAMETERS_IDR_PERIOD (1ULL << 15)
+#define PARAMETERS_BITRATE (1ULL << 16)
+// bits 17 and above hold IDR period and bitrate of the other streams.
+#define PARAMETERS_STREAM_IDR_PERIOD(stream)                                   \
+    (PARAMETERS_IDR_PERIOD << (2 * (stream)))
+#define PARAMETERS_STREAM_BITRATE(stream) (PARAMETERS_BITRATE << (2 * (stream)))
+// bits 27 to 32 hold the frame rate of each stream.
+#define PARAMETERS_STREAM_FPS(stream) (1ULL << (27 + (stream)))
+// parameters that require the camera to be stopped and configured again.
+#define PARAMETERS_CAMERA_CONFIG (1ULL << 38)
+// parameters that require the camera to be restarted with new controls.
+#define PARAMETERS_CAMERA_RESTART (1ULL << 39)
+// parameters that cannot be changed without restarting the process.
+#define PARAMETERS_PROCESS_RESTART (1ULL << 40)
+// bits 41 to 46 hold format changes of each stream, that require its
+// encoder to be created again.
+#define PARAMETERS_STREAM_FORMAT(stream) (1ULL << (41 + (stream)))
+#define PARAMETERS_STREAM_FORMATS                                              \
+    (((1ULL << PARAMETERS_MAX_STREAMS) - 1) << 41)
+// the set of cameras or the camera of a stream changed.
+#define PARAMETERS_CAMERAS (1ULL << 47)
+#define PARAMETERS_ALL (~0ULL)
+
+#define PARAMETERS_CAMERA                                                      \
+    (PARAMETERS_BRIGHTNESS | PARAMETERS_CONTRAST | PARAMETERS_SATURATION |     \
+     PARAMETERS_SHARPNESS | PARAMETERS_EXPOSURE | PARAMETERS_FLICKER_PERIOD |  \
+     PARAMETERS_AWB | PARAMETERS_AWB_GAINS | PARAMETERS_DENOISE |              \
+     PARAMETERS_SHUTTER | PARAMETERS_METERING | PARAMETERS_GAIN |              \
+     PARAMETERS_EV | PARAMETERS_FPS)
+#define PARAMETERS_ENCODER(stream)                                             \
+    (PARAMETERS_STREAM_IDR_PERIOD(stream) | PARAMETERS_STREAM_BITRATE(stream))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -67,6 +177,11 @@ extern "C" {
 const char *parameters_get_error();
 bool parameters_unserialize(const uint8_t *buf, size_t buf_size,
                             parameters_t **params);
+uint64_t parameters_diff(const parameters_t *a, const parameters_t *b);
+unsigned int parameters_get_cameras(const parameters_t *params,
+                                    unsigned int *camera_ids);
+void parameters_camera_view(const parameters_t *params,
+                            unsigned int camera_id, parameters_t *view);
 void parameters_destroy(parameters_t *params);
 
 #ifdef __cplusplus
@@ -1,57 +1,268 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "h264.h"
 #include "pipe.h"
 
-void pipe_write_error(int fd, const char *format, ...) {
+// size of the output pipe.
+// this allows to write an entire 1080p IDR frame with a single syscall without
+// waiting for the reader. 1MiB is the default value of
+// /proc/sys/fs/pipe-max-size, that is the limit for unprivileged processes.
+#define PIPE_SIZE (1024 * 1024)
+
+// write all buffers, resuming after partial writes and signals.
+static bool writev_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+static bool read_full(int fd, uint8_t *buf, uint32_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return false;
+        }
+
+        buf += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+void pipe_set_size(int fd) {
+    int size = PIPE_SIZE;
+    while (size >= 64 * 1024) {
+        if (fcntl(fd, F_SETPIPE_SZ, size) >= 0) {
+            break;
+        }
+        size /= 2;
+    }
+}
+
+// all write functions return the number of bytes written into the pipe.
+
+uint32_t pipe_write_error(int fd, const char *format, ...) {
     char buf[256];
     buf[0] = 'e';
     va_list args;
     va_start(args, format);
     vsnprintf(&buf[1], 255, format, args);
+    va_end(args);
     uint32_t n = strlen(buf);
-    write(fd, &n, 4);
-    write(fd, buf, n);
+
+    struct iovec iov[2] = {
+        {.iov_base = &n, .iov_len = sizeof(uint32_t)},
+        {.iov_base = buf, .iov_len = n},
+    };
+    if (!writev_full(fd, iov, 2)) {
+        return 0;
+    }
+    return sizeof(uint32_t) + n;
 }
 
-void pipe_write_ready(int fd) {
-    char buf[] = {'r'};
-    uint32_t n = 1;
-    write(fd, &n, 4);
-    write(fd, buf, n);
+// ['r'][report]. The report contains the duration of startup phases and
+// can be ignored by readers.
+uint32_t pipe_write_ready(int fd, const char *report, uint32_t size) {
+    char type = 'r';
+    uint32_t n = 1 + size;
+
+    struct iovec iov[3] = {
+        {.iov_base = &n, .iov_len = sizeof(uint32_t)},
+        {.iov_base = &type, .iov_len = 1},
+        {.iov_base = (void *)report, .iov_len = size},
+    };
+    if (!writev_full(fd, iov, 3)) {
+        return 0;
+    }
+    return sizeof(uint32_t) + n;
 }
 
-void pipe_write_data(int fd, const uint8_t *mapped, uint32_t size, uint64_t dts,
-                     uint64_t ntp) {
-    char head[] = {'d'};
-    size += 1 + 2 * sizeof(uint64_t);
-    write(fd, &size, 4);
-    write(fd, head, 1);
-    write(fd, &dts, sizeof(uint64_t));
-    write(fd, &ntp, sizeof(uint64_t));
-    write(fd, mapped, size - 1 - 2 * sizeof(uint64_t));
+uint32_t pipe_write_stats(int fd, const char *report, uint32_t size) {
+    char type = 'm';
+    uint32_t n = 1 + size;
+
+    struct iovec iov[3] = {
+        {.iov_base = &n, .iov_len = sizeof(uint32_t)},
+        {.iov_base = &type, .iov_len = 1},
+        {.iov_base = (void *)report, .iov_len = size},
+    };
+    if (!writev_full(fd, iov, 3)) {
+        return 0;
+    }
+    return sizeof(uint32_t) + n;
 }
 
-void pipe_write_secondary_data(int fd, const uint8_t *mapped, uint32_t size,
-                               uint64_t dts, uint64_t ntp) {
-    char head[] = {'s'};
-    size += 1 + 2 * sizeof(uint64_t);
-    write(fd, &size, 4);
-    write(fd, head, 1);
-    write(fd, &dts, sizeof(uint64_t));
-    write(fd, &ntp, sizeof(uint64_t));
-    write(fd, mapped, size - 1 - 2 * sizeof(uint64_t));
+// build the header of a data message.
+//
+// version 1: [type][dts, u64][ntp, u64]
+// version 2: [type][version, u8][flags, u8][NAL count, u16][dts, u64]
+//            [ntp, u64][NAL table: (offset, u32)(size, u32) * NAL count]
+//
+// type is 'd' for stream 0, 's' for stream 1 and ['n'][stream, u8] for the
+// other streams.
+//
+// NAL offsets are relative to the beginning of the payload and point to NAL
+// headers, NAL sizes do not include start codes.
+uint32_t pipe_data_header(uint8_t *buf, int version, int stream,
+                          uint8_t flags, const uint32_t *nal_sizes,
+                          int nal_count, const uint8_t *mapped, uint64_t dts,
+                          uint64_t ntp) {
+    uint8_t *p = buf;
+    if (stream == 0) {
+        *p++ = 'd';
+    } else if (stream == 1) {
+        *p++ = 's';
+    } else {
+        *p++ = 'n';
+        *p++ = stream;
+    }
+
+    if (version < 2) {
+        memcpy(p, &dts, sizeof(uint64_t));
+        p += sizeof(uint64_t);
+        memcpy(p, &ntp, sizeof(uint64_t));
+        p += sizeof(uint64_t);
+        return p - buf;
+    }
+
+    if (nal_count > PIPE_MAX_NALS) {
+        nal_count = 0;
+    }
+
+    *p++ = 2;
+    *p++ = flags;
+    uint16_t count = nal_count;
+    memcpy(p, &count, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    memcpy(p, &dts, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    memcpy(p, &ntp, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+
+    uint32_t offset = 0;
+    for (int i = 0; i < nal_count; i++) {
+        uint32_t start_code_size =
+            h264_start_code_size(&mapped[offset], nal_sizes[i]);
+        uint32_t entry[2] = {offset + start_code_size,
+                             nal_sizes[i] - start_code_size};
+        memcpy(p, entry, sizeof(entry));
+        p += sizeof(entry);
+        offset += nal_sizes[i];
+    }
+
+    return p - buf;
+}
+
+// header of parameter set messages, that are followed by SPS and PPS in
+// Annex-B format: ['p'][stream, u8]
+uint32_t pipe_parameter_sets_header(uint8_t *buf, int stream) {
+    buf[0] = 'p';
+    buf[1] = stream;
+    return 2;
+}
+
+uint32_t pipe_write_data(int fd, const uint8_t *header, uint32_t header_size,
+                         const uint8_t *mapped, uint32_t size) {
+    uint32_t n = header_size + size;
+
+    struct iovec iov[3] = {
+        {.iov_base = &n, .iov_len = sizeof(uint32_t)},
+        {.iov_base = (void *)header, .iov_len = header_size},
+        {.iov_base = (void *)mapped, .iov_len = size},
+    };
+    if (!writev_full(fd, iov, 3)) {
+        return 0;
+    }
+    return sizeof(uint32_t) + n;
+}
+
+// write the header with a copy and the payload with vmsplice(), that moves
+// references to the pages of the payload into the pipe, without copying them.
+// The payload must not be modified until the reader has consumed it.
+// When pages cannot be referenced (i.e. they belong to a device mapping),
+// the payload is copied and 'spliced' is set to false.
+uint32_t pipe_splice_data(int fd, const uint8_t *header, uint32_t header_size,
+                          const uint8_t *mapped, uint32_t size,
+                          bool *spliced) {
+    uint32_t n = header_size + size;
+    *spliced = false;
+
+    struct iovec iov[2] = {
+        {.iov_base = &n, .iov_len = sizeof(uint32_t)},
+        {.iov_base = (void *)header, .iov_len = header_size},
+    };
+    if (!writev_full(fd, iov, 2)) {
+        return 0;
+    }
+
+    struct iovec payload = {.iov_base = (void *)mapped, .iov_len = size};
+
+    while (payload.iov_len > 0) {
+        ssize_t res = vmsplice(fd, &payload, 1, 0);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        *spliced = true;
+        payload.iov_base = (uint8_t *)payload.iov_base + res;
+        payload.iov_len -= res;
+    }
+
+    if (payload.iov_len > 0 && !writev_full(fd, &payload, 1)) {
+        return 0;
+    }
+
+    return sizeof(uint32_t) + n;
 }
 
 uint32_t pipe_read(int fd, uint8_t **pbuf) {
     uint32_t n;
-    read(fd, &n, 4);
+    if (!read_full(fd, (uint8_t *)&n, sizeof(uint32_t)) || n == 0) {
+        return 0;
+    }
 
     *pbuf = malloc(n);
-    read(fd, *pbuf, n);
+    if (!read_full(fd, *pbuf, n)) {
+        free(*pbuf);
+        return 0;
+    }
+
     return n;
 }
@@ -4,12 +4,29 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-void pipe_write_error(int fd, const char *format, ...);
-void pipe_write_ready(int fd);
-void pipe_write_data(int fd, const uint8_t *mapped, uint32_t size, uint64_t dts,
-                     uint64_t ntp);
-void pipe_write_secondary_data(int fd, const uint8_t *mapped, uint32_t size,
-                               uint64_t dts, uint64_t ntp);
+// flags of version 2 data messages.
+#define PIPE_FLAG_KEYFRAME (1 << 0)
+#define PIPE_FLAG_PARAMETER_SETS (1 << 1)
+#define PIPE_FLAG_REPLAY (1 << 2)
+
+#define PIPE_MAX_NALS 32
+
+#define PIPE_DATA_HEADER_MAX_SIZE                                              \
+    (6 + 2 * sizeof(uint64_t) + PIPE_MAX_NALS * 2 * sizeof(uint32_t))
+
+void pipe_set_size(int fd);
+uint32_t pipe_write_error(int fd, const char *format, ...);
+uint32_t pipe_write_ready(int fd, const char *report, uint32_t size);
+uint32_t pipe_write_stats(int fd, const char *report, uint32_t size);
+uint32_t pipe_data_header(uint8_t *buf, int version, int stream,
+                          uint8_t flags, const uint32_t *nal_sizes,
+                          int nal_count, const uint8_t *mapped, uint64_t dts,
+                          uint64_t ntp);
+uint32_t pipe_parameter_sets_header(uint8_t *buf, int stream);
+uint32_t pipe_write_data(int fd, const uint8_t *header, uint32_t header_size,
+                         const uint8_t *mapped, uint32_t size);
+uint32_t pipe_splice_data(int fd, const uint8_t *header, uint32_t header_size,
+                          const uint8_t *mapped, uint32_t size, bool *spliced);
 uint32_t pipe_read(int fd, uint8_t **pbuf);
 
 #endif
@@ -0,0 +1,191 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+// shared-memory transport for encoded frames.
+//
+// the reader creates a memfd and an eventfd, passes them to the process and
+// announces them in the first configuration message. The memfd is sized and
+// initialized here; once the ready message is received, the reader maps it and
+// consumes descriptors in the range [read_seq, write_seq), advancing read_seq
+// after each message. Every time a message is published, the eventfd is
+// signaled. When the reader is too slow, messages are dropped instead of
+// overwriting unconsumed data.
+//
+// memory layout:
+// [header, 64 bytes][descriptors, RING_DESC_COUNT * 16 bytes][padding][data]
+//
+// each message in the data area has the same content of pipe messages,
+// without the length prefix, and is stored contiguously.
+
+#define RING_MAGIC 0x5258544d // "MTXR"
+#define RING_VERSION 1
+#define RING_DESC_COUNT 256
+#define RING_DEFAULT_SIZE (8 * 1024 * 1024)
+#define RING_HEADER_SIZE 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t desc_count;
+    uint32_t data_offset;
+    uint32_t data_size;
+    uint32_t reserved;
+    _Atomic uint64_t write_seq; // written by this process
+    _Atomic uint64_t read_seq;  // written by the reader
+    _Atomic uint64_t dropped;   // written by this process
+} ring_header_t;
+
+typedef struct {
+    uint64_t pos; // position of the message, modulo data_size
+    uint32_t size;
+    uint32_t reserved;
+} ring_desc_t;
+
+static char errbuf[256];
+
+static void set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errbuf, 256, format, args);
+}
+
+const char *ring_get_error() { return errbuf; }
+
+typedef struct {
+    int event_fd;
+    uint8_t *mapped;
+    size_t mapped_size;
+    ring_header_t *header;
+    ring_desc_t *descs;
+    uint8_t *data;
+    uint32_t data_size;
+    uint64_t write_seq;
+    uint64_t write_pos;
+} ring_priv_t;
+
+bool ring_create(int fd, int event_fd, uint32_t size, ring_t **ring) {
+    if (size == 0) {
+        size = RING_DEFAULT_SIZE;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    uint32_t data_offset = (RING_HEADER_SIZE +
+                            RING_DESC_COUNT * sizeof(ring_desc_t) + page_size -
+                            1) &
+                           ~(page_size - 1);
+    uint32_t data_size = (size + page_size - 1) & ~(page_size - 1);
+    size_t mapped_size = (size_t)data_offset + data_size;
+
+    int res = ftruncate(fd, mapped_size);
+    if (res != 0) {
+        set_error("ftruncate() failed");
+        return false;
+    }
+
+    uint8_t *mapped = (uint8_t *)mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        set_error("mmap() failed");
+        return false;
+    }
+
+    *ring = malloc(sizeof(ring_priv_t));
+    ring_priv_t *ringp = (ring_priv_t *)(*ring);
+    memset(ringp, 0, sizeof(ring_priv_t));
+
+    ringp->event_fd = event_fd;
+    ringp->mapped = mapped;
+    ringp->mapped_size = mapped_size;
+    ringp->header = (ring_header_t *)mapped;
+    ringp->descs = (ring_desc_t *)(mapped + RING_HEADER_SIZE);
+    ringp->data = mapped + data_offset;
+    ringp->data_size = data_size;
+
+    memset(mapped, 0, data_offset);
+    ringp->header->version = RING_VERSION;
+    ringp->header->desc_count = RING_DESC_COUNT;
+    ringp->header->data_offset = data_offset;
+    ringp->header->data_size = data_size;
+    atomic_store_explicit(&ringp->header->write_seq, 0, memory_order_relaxed);
+    atomic_store_explicit(&ringp->header->read_seq, 0, memory_order_relaxed);
+    atomic_store_explicit(&ringp->header->dropped, 0, memory_order_relaxed);
+    ringp->header->magic = RING_MAGIC;
+
+    return true;
+}
+
+static void write_message(ring_priv_t *ringp, const struct iovec *iov,
+                          int iovcnt) {
+    uint64_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+
+    uint64_t read_seq =
+        atomic_load_explicit(&ringp->header->read_seq, memory_order_acquire);
+    if (read_seq > ringp->write_seq) {
+        read_seq = ringp->write_seq;
+    }
+
+    // messages are stored contiguously. Skip the end of the data area if
+    // the message does not fit into it.
+    uint64_t pos = ringp->write_pos;
+    uint64_t rem = pos % ringp->data_size;
+    if (rem + size > ringp->data_size) {
+        pos += ringp->data_size - rem;
+    }
+
+    uint64_t tail = (read_seq == ringp->write_seq)
+                        ? pos
+                        : ringp->descs[read_seq % RING_DESC_COUNT].pos;
+
+    if (size > ringp->data_size ||
+        (ringp->write_seq - read_seq) >= RING_DESC_COUNT ||
+        (pos + size - tail) > ringp->data_size) {
+        atomic_fetch_add_explicit(&ringp->header->dropped, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+
+    uint8_t *dest = ringp->data + (pos % ringp->data_size);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+
+    ring_desc_t *desc = &ringp->descs[ringp->write_seq % RING_DESC_COUNT];
+    desc->pos = pos;
+    desc->size = size;
+
+    ringp->write_seq++;
+    ringp->write_pos = pos + size;
+    atomic_store_explicit(&ringp->header->write_seq, ringp->write_seq,
+                          memory_order_release);
+
+    uint64_t val = 1;
+    write(ringp->event_fd, &val, sizeof(uint64_t));
+}
+
+void ring_write_data(ring_t *ring, const uint8_t *header, uint32_t header_size,
+                     const uint8_t *mapped, uint32_t size) {
+    struct iovec iov[2] = {
+        {.iov_base = (void *)header, .iov_len = header_size},
+        {.iov_base = (void *)mapped, .iov_len = size},
+    };
+    write_message((ring_priv_t *)ring, iov, 2);
+}
+
+void ring_destroy(ring_t *ring) {
+    ring_priv_t *ringp = (ring_priv_t *)ring;
+
+    munmap(ringp->mapped, ringp->mapped_size);
+    free(ringp);
+}
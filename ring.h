@@ -0,0 +1,15 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void ring_t;
+
+const char *ring_get_error();
+bool ring_create(int fd, int event_fd, uint32_t size, ring_t **ring);
+void ring_write_data(ring_t *ring, const uint8_t *header, uint32_t header_size,
+                     const uint8_t *mapped, uint32_t size);
+void ring_destroy(ring_t *ring);
+
+#endif
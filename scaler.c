@@ -0,0 +1,547 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "dma_heap.h"
+#include "scaler.h"
+#include "stats.h"
+
+// CPU downscaler, that produces additional streams from a stream of the ISP,
+// since the ISP has a limited number of outputs.
+//
+// streams are obtained with a pyramid of 2:1 box filters, in which each level
+// is computed from the previous one. Levels are computed in horizontal
+// strips, so that rows of a level are still in cache when the next level
+// reads them. Output buffers are DMA buffers, in order to be usable by the
+// hardware encoder, and are taken from a pool.
+
+// rows of the deepest level that are computed in each strip.
+#define STRIP_ROWS 4
+
+// strides are aligned in order to be accepted by the hardware encoder.
+#define STRIDE_ALIGN 64
+
+typedef struct {
+    uint8_t *mapped;
+    int fd;
+    // number of streams that are using the buffer.
+    _Atomic int refs;
+} scaler_buffer_t;
+
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    size_t size;
+    // streams that use the level.
+    int streams[PARAMETERS_MAX_STREAMS];
+    int stream_count;
+    // pool of output buffers. NULL when no stream uses the level.
+    scaler_buffer_t *buffers;
+    // used when no stream uses the level or when the pool is exhausted,
+    // since deeper levels are computed from this one.
+    uint8_t *scratch;
+} level_t;
+
+typedef struct {
+    uint8_t *data;
+    unsigned int stride;
+    unsigned int width;
+    unsigned int height;
+} plane_t;
+
+static char errbuf[256];
+
+static void set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errbuf, 256, format, args);
+}
+
+const char *scaler_get_error() { return errbuf; }
+
+typedef struct {
+    int source;
+    int buffer_count;
+    // level 0 is the source stream.
+    level_t levels[PARAMETERS_MAX_SCALE_LEVELS + 1];
+    int level_count;
+    scaler_output_cb output_cb;
+    scaler_input_release_cb input_release_cb;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool thread_started;
+    bool terminate;
+    bool data_queued;
+    uint8_t *data_buffer;
+    int data_fd;
+    uint64_t data_dts;
+    uint64_t data_ntp;
+    void *data_input;
+} scaler_priv_t;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sync_buffer(int fd, uint64_t flags) {
+    struct dma_buf_sync dma_sync = {0};
+    dma_sync.flags = flags;
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &dma_sync);
+}
+
+// compute a row of dst by averaging 2x2 blocks of the rows r0 and r1.
+// SIMD variants round in the same way of the scalar one.
+static void downscale_row(const uint8_t *r0, const uint8_t *r1, uint8_t *dst,
+                          unsigned int width) {
+    unsigned int x = 0;
+
+#if defined(__ARM_NEON)
+    for (; (x + 16) <= width; x += 16) {
+        uint16x8_t s0 = vpadalq_u8(vpaddlq_u8(vld1q_u8(&r0[2 * x])),
+                                   vld1q_u8(&r1[2 * x]));
+        uint16x8_t s1 = vpadalq_u8(vpaddlq_u8(vld1q_u8(&r0[2 * x + 16])),
+                                   vld1q_u8(&r1[2 * x + 16]));
+        vst1q_u8(&dst[x],
+                 vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+    }
+#elif defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    const __m128i two = _mm_set1_epi16(2);
+
+    for (; (x + 16) <= width; x += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)&r0[2 * x]);
+        __m128i a1 = _mm_loadu_si128((const __m128i *)&r0[2 * x + 16]);
+        __m128i b0 = _mm_loadu_si128((const __m128i *)&r1[2 * x]);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)&r1[2 * x + 16]);
+
+        // sums of horizontal pairs, in 16-bit lanes.
+        __m128i s0 = _mm_add_epi16(
+            _mm_add_epi16(_mm_and_si128(a0, low), _mm_srli_epi16(a0, 8)),
+            _mm_add_epi16(_mm_and_si128(b0, low), _mm_srli_epi16(b0, 8)));
+        __m128i s1 = _mm_add_epi16(
+            _mm_add_epi16(_mm_and_si128(a1, low), _mm_srli_epi16(a1, 8)),
+            _mm_add_epi16(_mm_and_si128(b1, low), _mm_srli_epi16(b1, 8)));
+
+        s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+        s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+        _mm_storeu_si128((__m128i *)&dst[x], _mm_packus_epi16(s0, s1));
+    }
+#endif
+
+    for (; x < width; x++) {
+        dst[x] =
+            (r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2;
+    }
+}
+
+// compute all levels of a plane, one strip at a time. planes[0] is the
+// source.
+static void downscale_plane(const plane_t *planes, int level_count) {
+    int deepest = level_count - 1;
+    unsigned int rows = planes[deepest].height;
+
+    for (unsigned int y = 0; y < rows; y += STRIP_ROWS) {
+        unsigned int end = (y + STRIP_ROWS < rows) ? (y + STRIP_ROWS) : rows;
+
+        for (int l = 1; l <= deepest; l++) {
+            const plane_t *src = &planes[l - 1];
+            const plane_t *dst = &planes[l];
+            unsigned int shift = deepest - l;
+
+            for (unsigned int row = y << shift; row < (end << shift); row++) {
+                downscale_row(&src->data[2 * row * src->stride],
+                              &src->data[(2 * row + 1) * src->stride],
+                              &dst->data[row * dst->stride], dst->width);
+            }
+        }
+    }
+
+    // when the height of a level is odd, its last rows are not used by
+    // deeper levels and are computed separately.
+    for (int l = 1; l < deepest; l++) {
+        const plane_t *src = &planes[l - 1];
+        const plane_t *dst = &planes[l];
+
+        for (unsigned int row = rows << (deepest - l); row < dst->height;
+             row++) {
+            downscale_row(&src->data[2 * row * src->stride],
+                          &src->data[(2 * row + 1) * src->stride],
+                          &dst->data[row * dst->stride], dst->width);
+        }
+    }
+}
+
+// planes of a YUV420 buffer are stored one after the other, and chroma planes
+// have half the stride of the luma plane.
+static plane_t get_plane(uint8_t *buf, const level_t *level, int i) {
+    plane_t plane;
+
+    if (i == 0) {
+        plane.data = buf;
+        plane.stride = level->stride;
+        plane.width = level->width;
+        plane.height = level->height;
+        return plane;
+    }
+
+    plane.stride = level->stride / 2;
+    plane.width = level->width / 2;
+    plane.height = level->height / 2;
+    plane.data = buf + level->stride * level->height +
+                 (i - 1) * plane.stride * plane.height;
+    return plane;
+}
+
+// take a free buffer from the pool of a level, or return NULL.
+static scaler_buffer_t *take_buffer(scaler_priv_t *scalerp, level_t *level) {
+    for (int i = 0; i < scalerp->buffer_count; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&level->buffers[i].refs, &expected,
+                                           level->stream_count)) {
+            return &level->buffers[i];
+        }
+    }
+    return NULL;
+}
+
+static void process(scaler_priv_t *scalerp, uint8_t *buffer, int fd,
+                    uint64_t dts, uint64_t ntp, void *input) {
+    uint64_t start = now_us();
+
+    scaler_buffer_t *outputs[PARAMETERS_MAX_SCALE_LEVELS + 1] = {NULL};
+    uint8_t *bufs[PARAMETERS_MAX_SCALE_LEVELS + 1];
+    bufs[0] = buffer;
+
+    for (int l = 1; l < scalerp->level_count; l++) {
+        level_t *level = &scalerp->levels[l];
+        bufs[l] = level->scratch;
+
+        if (level->buffers == NULL) {
+            continue;
+        }
+
+        outputs[l] = take_buffer(scalerp, level);
+        if (outputs[l] == NULL) {
+            for (int i = 0; i < level->stream_count; i++) {
+                stats_frame_dropped(level->streams[i]);
+            }
+            continue;
+        }
+
+        bufs[l] = outputs[l]->mapped;
+        sync_buffer(outputs[l]->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    }
+
+    sync_buffer(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+    for (int i = 0; i < 3; i++) {
+        plane_t planes[PARAMETERS_MAX_SCALE_LEVELS + 1] = {0};
+        for (int l = 0; l < scalerp->level_count; l++) {
+            planes[l] = get_plane(bufs[l], &scalerp->levels[l], i);
+        }
+        downscale_plane(planes, scalerp->level_count);
+    }
+
+    sync_buffer(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+    scalerp->input_release_cb(scalerp->source, input);
+
+    stats_frame_scaled(now_us() - start);
+
+    for (int l = 1; l < scalerp->level_count; l++) {
+        if (outputs[l] == NULL) {
+            continue;
+        }
+
+        sync_buffer(outputs[l]->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+
+        level_t *level = &scalerp->levels[l];
+        for (int i = 0; i < level->stream_count; i++) {
+            stats_frame_captured(level->streams[i], 0);
+            scalerp->output_cb(level->streams[i], outputs[l]->mapped,
+                               outputs[l]->fd, dts, ntp, outputs[l]);
+        }
+    }
+}
+
+static void *thread_main(void *userdata) {
+    scaler_priv_t *scalerp = (scaler_priv_t *)userdata;
+
+    stats_register_thread("scaler");
+
+    while (true) {
+        pthread_mutex_lock(&scalerp->mutex);
+
+        while (!scalerp->data_queued && !scalerp->terminate) {
+            pthread_cond_wait(&scalerp->cond, &scalerp->mutex);
+        }
+
+        if (scalerp->terminate) {
+            pthread_mutex_unlock(&scalerp->mutex);
+            break;
+        }
+
+        uint8_t *buffer = scalerp->data_buffer;
+        int fd = scalerp->data_fd;
+        uint64_t dts = scalerp->data_dts;
+        uint64_t ntp = scalerp->data_ntp;
+        void *input = scalerp->data_input;
+        scalerp->data_queued = false;
+
+        pthread_mutex_unlock(&scalerp->mutex);
+
+        process(scalerp, buffer, fd, dts, ntp, input);
+    }
+
+    stats_unregister_thread();
+    return NULL;
+}
+
+static void free_levels(scaler_priv_t *scalerp) {
+    for (int l = 1; l < scalerp->level_count; l++) {
+        level_t *level = &scalerp->levels[l];
+
+        if (level->buffers != NULL) {
+            for (int i = 0; i < scalerp->buffer_count; i++) {
+                scaler_buffer_t *buf = &level->buffers[i];
+                if (buf->mapped != NULL) {
+                    munmap(buf->mapped, level->size);
+                }
+                if (buf->fd >= 0) {
+                    close(buf->fd);
+                }
+            }
+            free(level->buffers);
+        }
+
+        free(level->scratch);
+    }
+}
+
+static bool alloc_buffers(scaler_priv_t *scalerp, level_t *level,
+                          int heap_fd) {
+    level->buffers = calloc(scalerp->buffer_count, sizeof(scaler_buffer_t));
+
+    for (int i = 0; i < scalerp->buffer_count; i++) {
+        level->buffers[i].fd = -1;
+    }
+
+    for (int i = 0; i < scalerp->buffer_count; i++) {
+        scaler_buffer_t *buf = &level->buffers[i];
+
+        buf->fd = dma_heap_alloc(heap_fd, level->size);
+        if (buf->fd < 0) {
+            set_error("failed to allocate buffer in dma heap");
+            return false;
+        }
+
+        buf->mapped = mmap(NULL, level->size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, buf->fd, 0);
+        if (buf->mapped == MAP_FAILED) {
+            buf->mapped = NULL;
+            set_error("mmap() failed");
+            return false;
+        }
+
+        atomic_init(&buf->refs, 0);
+    }
+
+    return true;
+}
+
+// create a scaler that produces all the scaled streams of stream source.
+bool scaler_create(const parameters_t *params, int source, int stride,
+                   int buffer_count, scaler_output_cb output_cb,
+                   scaler_input_release_cb input_release_cb,
+                   scaler_t **scaler) {
+    *scaler = malloc(sizeof(scaler_priv_t));
+    scaler_priv_t *scalerp = (scaler_priv_t *)(*scaler);
+    memset(scalerp, 0, sizeof(scaler_priv_t));
+
+    scalerp->source = source;
+    scalerp->buffer_count = buffer_count;
+    scalerp->output_cb = output_cb;
+    scalerp->input_release_cb = input_release_cb;
+    scalerp->level_count = 1;
+
+    int heap_fd = -1;
+
+    level_t *level0 = &scalerp->levels[0];
+    level0->width = params->streams[source].width;
+    level0->height = params->streams[source].height;
+    level0->stride = stride;
+
+    for (unsigned int i = 0; i < params->stream_count; i++) {
+        const parameters_stream_t *stream = &params->streams[i];
+        if (stream->scale_levels == 0 || (int)stream->scale_source != source) {
+            continue;
+        }
+
+        level_t *level = &scalerp->levels[stream->scale_levels];
+        level->streams[level->stream_count++] = i;
+
+        if ((int)stream->scale_levels >= scalerp->level_count) {
+            scalerp->level_count = stream->scale_levels + 1;
+        }
+    }
+
+    if (scalerp->level_count == 1) {
+        set_error("stream %d has no scaled streams", source);
+        goto failed;
+    }
+
+    heap_fd = dma_heap_open();
+    if (heap_fd < 0) {
+        set_error("failed to open dma heap allocator");
+        goto failed;
+    }
+
+    for (int l = 1; l < scalerp->level_count; l++) {
+        level_t *level = &scalerp->levels[l];
+        level->width = level0->width >> l;
+        level->height = level0->height >> l;
+        level->stride =
+            (level->width + STRIDE_ALIGN - 1) & ~(STRIDE_ALIGN - 1);
+        level->size = level->stride * level->height * 3 / 2;
+
+        level->scratch = malloc(level->size);
+        if (level->scratch == NULL) {
+            set_error("unable to allocate scaler buffers");
+            goto failed;
+        }
+
+        if (level->stream_count != 0 &&
+            !alloc_buffers(scalerp, level, heap_fd)) {
+            goto failed;
+        }
+    }
+
+    close(heap_fd);
+
+    pthread_mutex_init(&scalerp->mutex, NULL);
+    pthread_cond_init(&scalerp->cond, NULL);
+    pthread_create(&scalerp->thread, NULL, thread_main, scalerp);
+    scalerp->thread_started = true;
+
+    return true;
+
+failed:
+    if (heap_fd >= 0) {
+        close(heap_fd);
+    }
+    free_levels(scalerp);
+    free(scalerp);
+    return false;
+}
+
+static level_t *find_level(scaler_priv_t *scalerp, int stream) {
+    for (int l = 1; l < scalerp->level_count; l++) {
+        level_t *level = &scalerp->levels[l];
+        for (int i = 0; i < level->stream_count; i++) {
+            if (level->streams[i] == stream) {
+                return level;
+            }
+        }
+    }
+    return NULL;
+}
+
+int scaler_get_frame_size(scaler_t *scaler, int stream) {
+    scaler_priv_t *scalerp = (scaler_priv_t *)scaler;
+    return find_level(scalerp, stream)->size;
+}
+
+int scaler_get_stride(scaler_t *scaler, int stream) {
+    scaler_priv_t *scalerp = (scaler_priv_t *)scaler;
+    return find_level(scalerp, stream)->stride;
+}
+
+// queue a frame of the source stream. When the previous frame is still being
+// processed, the frame is skipped, in order not to stall the camera.
+void scaler_process(scaler_t *scaler, uint8_t *buffer_mapped, int buffer_fd,
+                    uint64_t dts, uint64_t ntp, void *input) {
+    scaler_priv_t *scalerp = (scaler_priv_t *)scaler;
+
+    pthread_mutex_lock(&scalerp->mutex);
+
+    if (scalerp->data_queued || scalerp->terminate) {
+        pthread_mutex_unlock(&scalerp->mutex);
+
+        for (int l = 1; l < scalerp->level_count; l++) {
+            level_t *level = &scalerp->levels[l];
+            for (int i = 0; i < level->stream_count; i++) {
+                stats_frame_dropped(level->streams[i]);
+            }
+        }
+        scalerp->input_release_cb(scalerp->source, input);
+        return;
+    }
+
+    scalerp->data_queued = true;
+    scalerp->data_buffer = buffer_mapped;
+    scalerp->data_fd = buffer_fd;
+    scalerp->data_dts = dts;
+    scalerp->data_ntp = ntp;
+    scalerp->data_input = input;
+
+    pthread_cond_signal(&scalerp->cond);
+
+    pthread_mutex_unlock(&scalerp->mutex);
+}
+
+// give back a buffer that was passed to output_cb. Can be called by any
+// thread.
+void scaler_buffer_release(void *buffer) {
+    scaler_buffer_t *buf = (scaler_buffer_t *)buffer;
+    atomic_fetch_sub(&buf->refs, 1);
+}
+
+// stop the thread of the scaler. Output buffers remain valid until
+// scaler_destroy() is called.
+void scaler_stop(scaler_t *scaler) {
+    scaler_priv_t *scalerp = (scaler_priv_t *)scaler;
+
+    pthread_mutex_lock(&scalerp->mutex);
+    scalerp->terminate = true;
+    pthread_cond_signal(&scalerp->cond);
+    pthread_mutex_unlock(&scalerp->mutex);
+
+    pthread_join(scalerp->thread, NULL);
+    scalerp->thread_started = false;
+
+    if (scalerp->data_queued) {
+        scalerp->data_queued = false;
+        scalerp->input_release_cb(scalerp->source, scalerp->data_input);
+    }
+}
+
+void scaler_destroy(scaler_t *scaler) {
+    scaler_priv_t *scalerp = (scaler_priv_t *)scaler;
+
+    if (scalerp->thread_started) {
+        scaler_stop(scaler);
+    }
+
+    pthread_mutex_destroy(&scalerp->mutex);
+    pthread_cond_destroy(&scalerp->cond);
+    free_levels(scalerp);
+    free(scalerp);
+}
@@ -0,0 +1,31 @@
+#ifndef __SCALER_H__
+#define __SCALER_H__
+
+#include "parameters.h"
+
+typedef void scaler_t;
+
+// called for each stream that has been produced from a frame. buffer must
+// be given back with scaler_buffer_release() once it is not needed anymore.
+typedef void (*scaler_output_cb)(int stream, uint8_t *buffer_mapped,
+                                 int buffer_fd, uint64_t dts, uint64_t ntp,
+                                 void *buffer);
+
+// called when the scaler doesn't need an input buffer anymore. input is the
+// pointer that was passed to scaler_process().
+typedef void (*scaler_input_release_cb)(int source, void *input);
+
+const char *scaler_get_error();
+bool scaler_create(const parameters_t *params, int source, int stride,
+                   int buffer_count, scaler_output_cb output_cb,
+                   scaler_input_release_cb input_release_cb,
+                   scaler_t **scaler);
+int scaler_get_frame_size(scaler_t *scaler, int stream);
+int scaler_get_stride(scaler_t *scaler, int stream);
+void scaler_process(scaler_t *scaler, uint8_t *buffer_mapped, int buffer_fd,
+                    uint64_t dts, uint64_t ntp, void *input);
+void scaler_buffer_release(void *buffer);
+void scaler_stop(scaler_t *scaler);
+void scaler_destroy(scaler_t *scaler);
+
+#endif
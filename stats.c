@@ -0,0 +1,398 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "parameters.h"
+#include "stats.h"
+
+// runtime statistics.
+//
+// counters are updated with relaxed atomic operations by the threads that
+// produce frames, and are read periodically by the main thread, that
+// turns them into a text message in the same key:value format of parameters.
+// Counters are cumulative; histograms are reported over the last period.
+
+// histograms have 4 buckets per power of two, in microseconds.
+#define HIST_SUB_BUCKETS 4
+#define HIST_SIZE (24 * HIST_SUB_BUCKETS)
+
+// maximum number of frames waiting to be encoded, per stream.
+#define INFLIGHT_SIZE 32
+
+#define MAX_THREADS 16
+
+#define THREAD_FREE 0
+#define THREAD_CLAIMED 1
+#define THREAD_READY 2
+
+typedef struct {
+    _Atomic uint64_t buckets[HIST_SIZE];
+} histogram_t;
+
+typedef struct {
+    _Atomic uint64_t dts;
+    _Atomic uint64_t time;
+} inflight_t;
+
+typedef struct {
+    _Atomic uint64_t captured;
+    _Atomic uint64_t submitted;
+    _Atomic uint64_t encoded;
+    _Atomic uint64_t dropped;
+    // frames dropped after being submitted to the encoder.
+    _Atomic uint64_t aborted;
+    _Atomic uint64_t bytes;
+    histogram_t encode_time;
+    histogram_t latency;
+    inflight_t inflight[INFLIGHT_SIZE];
+    _Atomic uint64_t inflight_pos;
+} stream_stats_t;
+
+typedef struct {
+    char name[16];
+    clockid_t clock;
+    _Atomic int state;
+} thread_stats_t;
+
+static stream_stats_t streams[PARAMETERS_MAX_STREAMS];
+static _Atomic uint64_t sequence_gaps;
+static _Atomic uint32_t last_sequence;
+static _Atomic bool last_sequence_set;
+static _Atomic uint64_t time_to_first_frame;
+static _Atomic uint64_t recoveries;
+static _Atomic uint64_t recovery_time;
+static _Atomic unsigned int buffer_count;
+static _Atomic uint64_t scaled;
+static histogram_t scale_time;
+static thread_stats_t threads[MAX_THREADS];
+
+// slot of the calling thread, or -1.
+static _Thread_local int thread_slot = -1;
+
+// accessed by the thread that writes reports only.
+static uint64_t prev_encode_time[PARAMETERS_MAX_STREAMS][HIST_SIZE];
+static uint64_t prev_latency[PARAMETERS_MAX_STREAMS][HIST_SIZE];
+static uint64_t prev_scale_time[HIST_SIZE];
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+        return v;
+    }
+
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (v >> (msb - 2)) & (HIST_SUB_BUCKETS - 1);
+    int i = (msb - 1) * HIST_SUB_BUCKETS + sub;
+    return (i < HIST_SIZE) ? i : (HIST_SIZE - 1);
+}
+
+// upper bound of a bucket.
+static uint64_t hist_bound(int i) {
+    if (i < HIST_SUB_BUCKETS) {
+        return i + 1;
+    }
+
+    int msb = i / HIST_SUB_BUCKETS + 1;
+    int sub = i % HIST_SUB_BUCKETS;
+    return (uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (msb - 2);
+}
+
+static void hist_add(histogram_t *h, uint64_t v) {
+    atomic_fetch_add_explicit(&h->buckets[hist_index(v)], 1,
+                              memory_order_relaxed);
+}
+
+// copy the buckets filled since the previous call into delta.
+static uint64_t hist_delta(histogram_t *h, uint64_t *prev, uint64_t *delta) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < HIST_SIZE; i++) {
+        uint64_t v =
+            atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        delta[i] = v - prev[i];
+        prev[i] = v;
+        total += delta[i];
+    }
+
+    return total;
+}
+
+static uint64_t hist_percentile(const uint64_t *delta, uint64_t total,
+                                int percentile) {
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (total * percentile + 99) / 100;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < HIST_SIZE; i++) {
+        sum += delta[i];
+        if (sum >= target) {
+            return hist_bound(i);
+        }
+    }
+
+    return hist_bound(HIST_SIZE - 1);
+}
+
+static size_t append(char *buf, size_t size, size_t pos, const char *format,
+                     ...) {
+    if (pos >= size) {
+        return pos;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(&buf[pos], size - pos, format, args);
+    va_end(args);
+
+    return (n > 0) ? pos + n : pos;
+}
+
+// register the calling thread, in order to report its CPU time.
+// Threads that exit must call stats_unregister_thread(), since encoders and
+// scalers are created again when streams are reconfigured.
+void stats_register_thread(const char *name) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        thread_stats_t *t = &threads[i];
+        int expected = THREAD_FREE;
+        if (atomic_compare_exchange_strong(&t->state, &expected,
+                                           THREAD_CLAIMED)) {
+            snprintf(t->name, sizeof(t->name), "%s", name);
+            pthread_getcpuclockid(pthread_self(), &t->clock);
+            atomic_store_explicit(&t->state, THREAD_READY,
+                                  memory_order_release);
+            thread_slot = i;
+            return;
+        }
+    }
+}
+
+void stats_unregister_thread() {
+    if (thread_slot < 0) {
+        return;
+    }
+
+    atomic_store_explicit(&threads[thread_slot].state, THREAD_FREE,
+                          memory_order_release);
+    thread_slot = -1;
+}
+
+// sequence numbers are only checked for the primary stream, since the
+// other streams are captured with the same requests.
+void stats_frame_captured(int stream, uint32_t sequence) {
+    atomic_fetch_add_explicit(&streams[stream].captured, 1,
+                              memory_order_relaxed);
+
+    if (stream == 0) {
+        if (atomic_load_explicit(&last_sequence_set, memory_order_relaxed)) {
+            uint32_t last =
+                atomic_load_explicit(&last_sequence, memory_order_relaxed);
+            if (sequence > last + 1) {
+                atomic_fetch_add_explicit(&sequence_gaps, sequence - last - 1,
+                                          memory_order_relaxed);
+            }
+        }
+        atomic_store_explicit(&last_sequence, sequence, memory_order_relaxed);
+        atomic_store_explicit(&last_sequence_set, true, memory_order_relaxed);
+    }
+}
+
+void stats_encode_start(int stream, uint64_t dts) {
+    stream_stats_t *s = &streams[stream];
+
+    atomic_fetch_add_explicit(&s->submitted, 1, memory_order_relaxed);
+
+    uint64_t pos =
+        atomic_fetch_add_explicit(&s->inflight_pos, 1, memory_order_relaxed);
+    inflight_t *f = &s->inflight[pos % INFLIGHT_SIZE];
+    atomic_store_explicit(&f->time, now_us(), memory_order_relaxed);
+    atomic_store_explicit(&f->dts, dts, memory_order_release);
+}
+
+void stats_encode_end(int stream, uint64_t dts) {
+    stream_stats_t *s = &streams[stream];
+
+    atomic_fetch_add_explicit(&s->encoded, 1, memory_order_relaxed);
+
+    for (int i = 0; i < INFLIGHT_SIZE; i++) {
+        inflight_t *f = &s->inflight[i];
+        if (atomic_load_explicit(&f->dts, memory_order_acquire) == dts) {
+            uint64_t start =
+                atomic_load_explicit(&f->time, memory_order_relaxed);
+            hist_add(&s->encode_time, now_us() - start);
+            break;
+        }
+    }
+}
+
+void stats_frame_dropped(int stream) {
+    atomic_fetch_add_explicit(&streams[stream].dropped, 1,
+                              memory_order_relaxed);
+}
+
+// a frame counted by stats_encode_start() has been dropped by the encoder,
+// therefore it is not waiting to be encoded anymore.
+void stats_encode_dropped(int stream) {
+    atomic_fetch_add_explicit(&streams[stream].aborted, 1,
+                              memory_order_relaxed);
+    stats_frame_dropped(stream);
+}
+
+// dts is in the same clock of CLOCK_MONOTONIC, therefore the difference with
+// the current time is the delay between capture and output.
+void stats_frame_written(int stream, uint64_t dts, uint64_t size) {
+    stream_stats_t *s = &streams[stream];
+
+    atomic_fetch_add_explicit(&s->bytes, size, memory_order_relaxed);
+
+    uint64_t now = now_us();
+    hist_add(&s->latency, (now > dts) ? (now - dts) : 0);
+}
+
+// time between the last resume and the first frame, in microseconds.
+void stats_resumed(uint64_t value) {
+    atomic_store_explicit(&time_to_first_frame, value, memory_order_relaxed);
+}
+
+// time between the detection of a camera failure and the first frame after
+// the camera has been restarted, in microseconds.
+void stats_recovered(uint64_t value) {
+    atomic_fetch_add_explicit(&recoveries, 1, memory_order_relaxed);
+    atomic_store_explicit(&recovery_time, value, memory_order_relaxed);
+}
+
+void stats_buffer_count(unsigned int value) {
+    atomic_store_explicit(&buffer_count, value, memory_order_relaxed);
+}
+
+// time spent by the CPU downscaler on a source frame, in microseconds.
+void stats_frame_scaled(uint64_t duration) {
+    atomic_fetch_add_explicit(&scaled, 1, memory_order_relaxed);
+    hist_add(&scale_time, duration);
+}
+
+// write a report into buf. Must be called by a single thread.
+size_t stats_report(char *buf, size_t size) {
+    static const char *prefixes[] = {"Primary", "Secondary", "Stream2",
+                                     "Stream3", "Stream4", "Stream5"};
+    size_t pos = 0;
+
+    pos = append(buf, size, pos,
+                 "SequenceGaps:%llu TimeToFirstFrame:%llu Recoveries:%llu "
+                 "RecoveryTime:%llu BufferCount:%u",
+                 (unsigned long long)atomic_load(&sequence_gaps),
+                 (unsigned long long)atomic_load(&time_to_first_frame),
+                 (unsigned long long)atomic_load(&recoveries),
+                 (unsigned long long)atomic_load(&recovery_time),
+                 atomic_load(&buffer_count));
+
+    for (int i = 0; i < PARAMETERS_MAX_STREAMS; i++) {
+        stream_stats_t *s = &streams[i];
+        const char *p = prefixes[i];
+
+        // additional streams are reported only when they are in use.
+        if (i >= 2 && atomic_load(&s->captured) == 0) {
+            continue;
+        }
+
+        uint64_t submitted = atomic_load(&s->submitted);
+        uint64_t done = atomic_load(&s->encoded) + atomic_load(&s->aborted);
+
+        pos = append(buf, size, pos,
+                     " %sCaptured:%llu %sEncoded:%llu %sDropped:%llu "
+                     "%sQueue:%llu %sBytes:%llu",
+                     p, (unsigned long long)atomic_load(&s->captured), p,
+                     (unsigned long long)atomic_load(&s->encoded), p,
+                     (unsigned long long)atomic_load(&s->dropped), p,
+                     (unsigned long long)((submitted > done)
+                                              ? (submitted - done)
+                                              : 0),
+                     p, (unsigned long long)atomic_load(&s->bytes));
+
+        uint64_t delta[HIST_SIZE];
+
+        uint64_t total =
+            hist_delta(&s->encode_time, prev_encode_time[i], delta);
+        pos = append(buf, size, pos, " %sEncodeTime:", p);
+        bool first = true;
+        for (int j = 0; j < HIST_SIZE; j++) {
+            if (delta[j] != 0) {
+                pos = append(buf, size, pos, "%s%llu=%llu", first ? "" : ",",
+                             (unsigned long long)hist_bound(j),
+                             (unsigned long long)delta[j]);
+                first = false;
+            }
+        }
+
+        total = hist_delta(&s->latency, prev_latency[i], delta);
+        pos = append(buf, size, pos, " %sLatency:%llu,%llu,%llu", p,
+                     (unsigned long long)hist_percentile(delta, total, 50),
+                     (unsigned long long)hist_percentile(delta, total, 90),
+                     (unsigned long long)hist_percentile(delta, total, 99));
+    }
+
+    if (atomic_load(&scaled) != 0) {
+        uint64_t delta[HIST_SIZE];
+        hist_delta(&scale_time, prev_scale_time, delta);
+        pos = append(buf, size, pos, " Scaled:%llu ScaleTime:",
+                     (unsigned long long)atomic_load(&scaled));
+        bool first = true;
+        for (int j = 0; j < HIST_SIZE; j++) {
+            if (delta[j] != 0) {
+                pos = append(buf, size, pos, "%s%llu=%llu", first ? "" : ",",
+                             (unsigned long long)hist_bound(j),
+                             (unsigned long long)delta[j]);
+                first = false;
+            }
+        }
+    }
+
+    pos = append(buf, size, pos, " ThreadCPU:");
+    bool first = true;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        thread_stats_t *t = &threads[i];
+        if (atomic_load_explicit(&t->state, memory_order_acquire) !=
+            THREAD_READY) {
+            continue;
+        }
+
+        // the clock of a thread that exited is not available anymore.
+        struct timespec ts;
+        if (clock_gettime(t->clock, &ts) != 0) {
+            continue;
+        }
+
+        pos = append(buf, size, pos, "%s%s=%llu", first ? "" : ",", t->name,
+                     (unsigned long long)ts.tv_sec * 1000000 +
+                         ts.tv_nsec / 1000);
+        first = false;
+    }
+
+    return (pos < size) ? pos : (size - 1);
+}
+
+// write the report that is sent with the ready message into buf.
+size_t stats_startup_report(char *buf, size_t size,
+                            const stats_startup_t *startup) {
+    size_t pos = append(buf, size, 0,
+                        "StartupCamera:%llu StartupText:%llu "
+                        "StartupEncoders:%llu StartupStart:%llu "
+                        "StartupTotal:%llu",
+                        (unsigned long long)startup->camera,
+                        (unsigned long long)startup->text,
+                        (unsigned long long)startup->encoders,
+                        (unsigned long long)startup->start,
+                        (unsigned long long)startup->total);
+
+    return (pos < size) ? pos : (size - 1);
+}
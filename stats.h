@@ -0,0 +1,41 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// durations of startup phases, in microseconds.
+typedef struct {
+    uint64_t camera;
+    uint64_t text;
+    uint64_t encoders;
+    uint64_t start;
+    uint64_t total;
+} stats_startup_t;
+
+void stats_register_thread(const char *name);
+void stats_unregister_thread();
+void stats_frame_captured(int stream, uint32_t sequence);
+void stats_encode_start(int stream, uint64_t dts);
+void stats_encode_end(int stream, uint64_t dts);
+void stats_frame_dropped(int stream);
+void stats_encode_dropped(int stream);
+void stats_frame_written(int stream, uint64_t dts, uint64_t size);
+void stats_resumed(uint64_t time_to_first_frame);
+void stats_recovered(uint64_t recovery_time);
+void stats_buffer_count(unsigned int count);
+void stats_frame_scaled(uint64_t duration);
+size_t stats_report(char *buf, size_t size);
+size_t stats_startup_report(char *buf, size_t size,
+                            const stats_startup_t *startup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,471 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dma_heap.h"
+#include "encoder.h"
+#include "h264.h"
+#include "output.h"
+#include "pipe.h"
+#include "scaler.h"
+#include "stats.h"
+#include "test.h"
+
+// smoke checks and timing runs that are executed when the TEST environment
+// variable is set. They don't need a camera and skip the checks that need
+// devices that are not available.
+
+#define SCALER_TEST_WIDTH 1920
+#define SCALER_TEST_HEIGHT 1080
+#define SCALER_TEST_FRAMES 100
+#define SCALER_TEST_VALUE 128
+// streams 1 to 3 are the source scaled by 2^1 to 2^3. Chroma planes of the
+// 1/4 and 1/8 streams have an odd height.
+#define SCALER_TEST_LEVELS 3
+
+#define PIPE_TEST_FRAME_SIZE (512 * 1024)
+#define PIPE_TEST_FRAMES 200
+
+#define DMA_HEAP_TEST_SLOTS 4
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static _Atomic int scaler_outputs;
+static _Atomic int scaler_inputs;
+static _Atomic bool scaler_mismatch;
+
+// the source is uniform, therefore the last row of each plane, that is the
+// last one to be computed, must have the same value.
+static bool check_scaled_frame(int stream, const uint8_t *mapped) {
+    unsigned int width = SCALER_TEST_WIDTH >> stream;
+    unsigned int height = SCALER_TEST_HEIGHT >> stream;
+    unsigned int stride = (width + 63) & ~63;
+
+    const uint8_t *rows[3] = {
+        &mapped[(height - 1) * stride],
+        &mapped[stride * height + (height / 2 - 1) * (stride / 2)],
+        &mapped[stride * height + (height / 2) * (stride / 2) +
+                (height / 2 - 1) * (stride / 2)],
+    };
+
+    for (int i = 0; i < 3; i++) {
+        unsigned int row_width = (i == 0) ? width : (width / 2);
+        for (unsigned int x = 0; x < row_width; x++) {
+            if (rows[i][x] != SCALER_TEST_VALUE) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void on_scaler_output(int stream, uint8_t *buffer_mapped,
+                             int buffer_fd, uint64_t dts, uint64_t ntp,
+                             void *buffer) {
+    if (!check_scaled_frame(stream, buffer_mapped)) {
+        atomic_store(&scaler_mismatch, true);
+    }
+    scaler_buffer_release(buffer);
+    atomic_fetch_add(&scaler_outputs, 1);
+}
+
+static void on_scaler_input_release(int source, void *input) {
+    atomic_fetch_add(&scaler_inputs, 1);
+}
+
+// time the downscaling of a 1080p frame into 1/2, 1/4 and 1/8 renditions.
+static bool test_scaler() {
+    int heap_fd = dma_heap_open();
+    if (heap_fd < 0) {
+        printf("scaler: skipped, no DMA heap\n");
+        return true;
+    }
+    close(heap_fd);
+
+    parameters_t params;
+    memset(&params, 0, sizeof(params));
+    params.streams[0].width = SCALER_TEST_WIDTH;
+    params.streams[0].height = SCALER_TEST_HEIGHT;
+    for (int l = 1; l <= SCALER_TEST_LEVELS; l++) {
+        params.streams[l].width = SCALER_TEST_WIDTH >> l;
+        params.streams[l].height = SCALER_TEST_HEIGHT >> l;
+        params.streams[l].scale_levels = l;
+    }
+    params.stream_count = SCALER_TEST_LEVELS + 1;
+
+    scaler_t *scaler;
+    if (!scaler_create(&params, 0, SCALER_TEST_WIDTH, 2, on_scaler_output,
+                       on_scaler_input_release, &scaler)) {
+        printf("scaler: scaler_create(): %s\n", scaler_get_error());
+        return false;
+    }
+
+    size_t size = SCALER_TEST_WIDTH * SCALER_TEST_HEIGHT * 3 / 2;
+    uint8_t *frame = malloc(size);
+    memset(frame, SCALER_TEST_VALUE, size);
+
+    uint64_t start = monotonic_us();
+
+    // frames are queued one at a time, since the scaler skips frames that
+    // arrive while it is busy.
+    for (int i = 0; i < SCALER_TEST_FRAMES; i++) {
+        scaler_process(scaler, frame, -1, 0, 0, NULL);
+        while (atomic_load(&scaler_inputs) <= i ||
+               atomic_load(&scaler_outputs) < SCALER_TEST_LEVELS * (i + 1)) {
+            usleep(100);
+        }
+    }
+
+    uint64_t duration = monotonic_us() - start;
+
+    scaler_destroy(scaler);
+    free(frame);
+
+    if (atomic_load(&scaler_mismatch)) {
+        printf("scaler: the last rows of scaled frames were not computed\n");
+        return false;
+    }
+
+    printf("scaler: %llu us per frame\n",
+           (unsigned long long)(duration / SCALER_TEST_FRAMES));
+    return true;
+}
+
+// allocate a DMA buffer from the heap, or from udmabuf when no heap is
+// available, and check that slots written through a mapping of the whole
+// buffer can be read through mappings of single slots, as done with the
+// buffer arenas of cameras.
+static bool test_dma_heap() {
+    int heap_fd = dma_heap_open();
+    if (heap_fd < 0) {
+        printf("dma heap: skipped, no DMA heap\n");
+        return true;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t frame_size = SCALER_TEST_WIDTH * SCALER_TEST_HEIGHT * 3 / 2;
+    size_t slot_size = (frame_size + page_size - 1) & ~(page_size - 1);
+    size_t size = slot_size * DMA_HEAP_TEST_SLOTS;
+
+    uint64_t start = monotonic_us();
+    int fd = dma_heap_alloc(heap_fd, size);
+    uint64_t duration = monotonic_us() - start;
+    close(heap_fd);
+
+    if (fd < 0) {
+        printf("dma heap: dma_heap_alloc() failed\n");
+        return false;
+    }
+
+    uint8_t *mapped =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        printf("dma heap: mmap() failed\n");
+        close(fd);
+        return false;
+    }
+
+    for (int i = 0; i < DMA_HEAP_TEST_SLOTS; i++) {
+        memset(&mapped[i * slot_size], i + 1, slot_size);
+    }
+    munmap(mapped, size);
+
+    bool ok = true;
+    for (int i = 0; i < DMA_HEAP_TEST_SLOTS && ok; i++) {
+        uint8_t *slot = mmap(NULL, slot_size, PROT_READ, MAP_SHARED, fd,
+                             i * slot_size);
+        if (slot == MAP_FAILED) {
+            ok = false;
+            break;
+        }
+        ok = (slot[0] == i + 1 && slot[slot_size - 1] == i + 1);
+        munmap(slot, slot_size);
+    }
+    close(fd);
+
+    if (!ok) {
+        printf("dma heap: slots do not match\n");
+        return false;
+    }
+
+    printf("dma heap: allocated %zu bytes in %llu us\n", size,
+           (unsigned long long)duration);
+    return true;
+}
+
+// size of the header of version 2 data messages of stream 0, without the
+// NAL table.
+#define DATA_HEADER_SIZE (5 + 2 * sizeof(uint64_t))
+
+// an IDR access unit with SPS and PPS, as produced by encoders.
+static const uint8_t test_sps[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42,
+                                   0xc0, 0x1f, 0x8c, 0x8d, 0x40};
+static const uint8_t test_pps[] = {0x00, 0x00, 0x00, 0x01,
+                                   0x68, 0xce, 0x3c, 0x80};
+static const uint8_t test_idr[] = {0x00, 0x00, 0x00, 0x01, 0x65,
+                                   0x88, 0x84, 0x00, 0x33, 0xff};
+
+static void on_output_release(int stream, const uint8_t *buffer) {}
+
+// write an IDR access unit through the output and check the messages
+// received by the reader, byte by byte.
+static bool check_parameter_sets(bool strip) {
+    const char *name = strip ? "strip on" : "strip off";
+
+    uint8_t au[sizeof(test_sps) + sizeof(test_pps) + sizeof(test_idr)];
+    memcpy(au, test_sps, sizeof(test_sps));
+    memcpy(&au[sizeof(test_sps)], test_pps, sizeof(test_pps));
+    memcpy(&au[sizeof(test_sps) + sizeof(test_pps)], test_idr,
+           sizeof(test_idr));
+
+    uint32_t nal_sizes[PIPE_MAX_NALS];
+    int nal_count = h264_find_nals(au, sizeof(au), nal_sizes, PIPE_MAX_NALS);
+    if (nal_count != 3) {
+        printf("parameter sets: %s: found %d NAL units\n", name, nal_count);
+        return false;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        printf("parameter sets: %s: pipe() failed\n", name);
+        return false;
+    }
+
+    parameters_t params;
+    memset(&params, 0, sizeof(params));
+    params.frame_header_version = 2;
+    params.strip_parameter_sets = strip;
+
+    output_t *out;
+    if (!output_create(&params, fds[1], on_output_release, &out)) {
+        printf("parameter sets: %s: output_create(): %s\n", name,
+               output_get_error());
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    output_write_ready(out, "");
+    output_write_data(out, 0, au, sizeof(au), 0, 0,
+                      ENCODER_OUTPUT_KEYFRAME | ENCODER_OUTPUT_PARAMETER_SETS,
+                      nal_sizes, nal_count);
+    output_stop(out);
+    output_destroy(out);
+    close(fds[1]);
+
+    // ['r'], ['p'][stream][SPS, PPS], ['d'][header][payload]
+    uint8_t *msgs[3] = {NULL};
+    uint32_t sizes[3] = {0};
+    for (int i = 0; i < 3; i++) {
+        sizes[i] = pipe_read(fds[0], &msgs[i]);
+        if (sizes[i] == 0) {
+            break;
+        }
+    }
+    close(fds[0]);
+
+    const uint8_t *payload = strip ? test_idr : au;
+    uint32_t payload_size = strip ? sizeof(test_idr) : sizeof(au);
+    int expected_nals = strip ? 1 : 3;
+    uint8_t expected_flags = PIPE_FLAG_KEYFRAME;
+    if (!strip) {
+        expected_flags |= PIPE_FLAG_PARAMETER_SETS;
+    }
+    uint32_t header_size = DATA_HEADER_SIZE + expected_nals * 8;
+
+    bool ok =
+        sizes[0] == 1 && msgs[0][0] == 'r' &&
+        sizes[1] == 2 + sizeof(test_sps) + sizeof(test_pps) &&
+        msgs[1][0] == 'p' && msgs[1][1] == 0 &&
+        memcmp(&msgs[1][2], au, sizeof(test_sps) + sizeof(test_pps)) == 0 &&
+        sizes[2] == header_size + payload_size && msgs[2][0] == 'd' &&
+        msgs[2][1] == 2 && msgs[2][2] == expected_flags &&
+        msgs[2][3] == expected_nals &&
+        memcmp(&msgs[2][header_size], payload, payload_size) == 0;
+
+    for (int i = 0; i < 3; i++) {
+        if (sizes[i] != 0) {
+            free(msgs[i]);
+        }
+    }
+
+    printf("parameter sets: %s: %s\n", name, ok ? "ok" : "mismatch");
+    return ok;
+}
+
+// parameter sets are sent in a dedicated message and, when requested,
+// removed from the frames.
+static bool test_parameter_sets() {
+    bool ok = true;
+    ok &= check_parameter_sets(false);
+    ok &= check_parameter_sets(true);
+    return ok;
+}
+
+static void *pipe_reader(void *userdata) {
+    int fd = *(int *)userdata;
+    static uint8_t buf[64 * 1024];
+    uint64_t *total = malloc(sizeof(uint64_t));
+    *total = 0;
+
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        *total += n;
+    }
+
+    return total;
+}
+
+// write frames into a pipe that is drained by another thread and return
+// the throughput in MB/s, or -1.
+static double pipe_throughput(const uint8_t *frame, bool splice,
+                              bool *spliced) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    pipe_set_size(fds[1]);
+
+    pthread_t reader;
+    pthread_create(&reader, NULL, pipe_reader, &fds[0]);
+
+    uint8_t header[PIPE_DATA_HEADER_MAX_SIZE];
+    uint32_t header_size =
+        pipe_data_header(header, 1, 0, 0, NULL, 0, frame, 0, 0);
+
+    uint64_t written = 0;
+    uint64_t start = monotonic_us();
+
+    for (int i = 0; i < PIPE_TEST_FRAMES; i++) {
+        if (splice) {
+            written += pipe_splice_data(fds[1], header, header_size, frame,
+                                        PIPE_TEST_FRAME_SIZE, spliced);
+        } else {
+            written += pipe_write_data(fds[1], header, header_size, frame,
+                                       PIPE_TEST_FRAME_SIZE);
+        }
+    }
+
+    // spliced pages are copied by the reader, therefore the time includes
+    // the time needed to consume them.
+    close(fds[1]);
+    uint64_t *total;
+    pthread_join(reader, (void **)&total);
+    uint64_t duration = monotonic_us() - start;
+    close(fds[0]);
+
+    bool ok = (*total == written &&
+               written == (uint64_t)PIPE_TEST_FRAMES *
+                              (sizeof(uint32_t) + header_size +
+                               PIPE_TEST_FRAME_SIZE));
+    free(total);
+    if (!ok || duration == 0) {
+        return -1;
+    }
+
+    return (double)written / duration;
+}
+
+// compare the throughput of copied and spliced frames.
+static bool test_splice() {
+    // vmsplice() references whole pages.
+    uint8_t *frame = aligned_alloc(4096, PIPE_TEST_FRAME_SIZE);
+    memset(frame, 0x55, PIPE_TEST_FRAME_SIZE);
+
+    bool spliced = false;
+    double copy = pipe_throughput(frame, false, NULL);
+    double splice = pipe_throughput(frame, true, &spliced);
+    free(frame);
+
+    if (copy < 0 || splice < 0) {
+        printf("splice: frames were not received entirely\n");
+        return false;
+    }
+
+    printf("splice: copy %.0f MB/s, splice %.0f MB/s%s\n", copy, splice,
+           spliced ? "" : " (fallback to copy)");
+    return true;
+}
+
+// the ready message carries the durations of startup phases, and frames
+// written before it are discarded.
+static bool test_ready_report() {
+    static const char *expected = "StartupCamera:1 StartupText:2 "
+                                  "StartupEncoders:3 StartupStart:4 "
+                                  "StartupTotal:10";
+
+    stats_startup_t startup = {
+        .camera = 1,
+        .text = 2,
+        .encoders = 3,
+        .start = 4,
+        .total = 10,
+    };
+    char report[256];
+    stats_startup_report(report, sizeof(report), &startup);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        printf("ready report: pipe() failed\n");
+        return false;
+    }
+
+    parameters_t params;
+    memset(&params, 0, sizeof(params));
+
+    output_t *out;
+    if (!output_create(&params, fds[1], on_output_release, &out)) {
+        printf("ready report: output_create(): %s\n", output_get_error());
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    output_write_data(out, 0, test_idr, sizeof(test_idr), 0, 0,
+                      ENCODER_OUTPUT_KEYFRAME, NULL, 0);
+    output_write_ready(out, report);
+    output_stop(out);
+    output_destroy(out);
+    close(fds[1]);
+
+    uint8_t *msg;
+    uint32_t size = pipe_read(fds[0], &msg);
+    bool ok = (size == 1 + strlen(expected) && msg[0] == 'r' &&
+               memcmp(&msg[1], expected, strlen(expected)) == 0);
+    if (size != 0) {
+        free(msg);
+    }
+
+    // nothing follows the ready message.
+    if (ok && pipe_read(fds[0], &msg) != 0) {
+        free(msg);
+        ok = false;
+    }
+    close(fds[0]);
+
+    printf("ready report: %s\n", ok ? "ok" : "mismatch");
+    return ok;
+}
+
+bool test_run() {
+    bool ok = true;
+    ok &= test_dma_heap();
+    ok &= test_scaler();
+    ok &= test_parameter_sets();
+    ok &= test_splice();
+    ok &= test_ready_report();
+    return ok;
+}
@@ -0,0 +1,8 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdbool.h>
+
+bool test_run();
+
+#endif
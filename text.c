@@ -1,4 +1,4 @@
-#include <pthread.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #include <ft2build.h>
@@ -83,37 +83,76 @@ static bool load_library(FT_Library *plibrary, FT_Face *pface) {
     return true;
 }
 
+// settings of the overlay. A new state is created when parameters are
+// reloaded, and is picked up by text_draw() through an atomic pointer swap,
+// so that drawing never waits for a reload. The previous state is handed back
+// to the main thread, that frees it.
 typedef struct {
-    pthread_mutex_t mutex;
     char *text_overlay;
+    // NULL when the overlay is disabled.
+    FT_Face face;
+} text_state_t;
+
+typedef struct {
     int stride;
     int height;
+    // loaded by the main thread once, when the overlay is enabled, and kept
+    // until the overlay is destroyed, since it is shared by states.
     FT_Library library;
     FT_Face face;
+    // accessed by the thread that draws only.
+    text_state_t *state;
+    // published by text_reload_params() and not yet picked up.
+    _Atomic(text_state_t *) pending;
+    // a state that is not used anymore.
+    _Atomic(text_state_t *) spare;
 } text_priv_t;
 
+static void state_destroy(text_state_t *state) {
+    if (state != NULL) {
+        free(state->text_overlay);
+        free(state);
+    }
+}
+
+// called by the main thread only.
+static bool state_create(text_priv_t *textp, const parameters_t *params,
+                         text_state_t **state) {
+    if (params->text_overlay_enable && textp->library == NULL) {
+        bool ok = load_library(&textp->library, &textp->face);
+        if (!ok) {
+            textp->library = NULL;
+            return false;
+        }
+    }
+
+    state_destroy(atomic_exchange(&textp->spare, NULL));
+
+    *state = malloc(sizeof(text_state_t));
+    (*state)->text_overlay = strdup(params->text_overlay);
+    (*state)->face = params->text_overlay_enable ? textp->face : NULL;
+
+    return true;
+}
+
 bool text_create(const parameters_t *params, int stride, text_t **text) {
     *text = malloc(sizeof(text_priv_t));
     text_priv_t *textp = (text_priv_t *)(*text);
     memset(textp, 0, sizeof(text_priv_t));
 
-    textp->text_overlay = strdup(params->text_overlay);
     textp->stride = stride;
     textp->height = params->height;
+    atomic_init(&textp->pending, NULL);
+    atomic_init(&textp->spare, NULL);
 
-    if (params->text_overlay_enable) {
-        bool ok = load_library(&textp->library, &textp->face);
-        if (!ok) {
-            goto failed;
-        }
+    bool ok = state_create(textp, params, &textp->state);
+    if (!ok) {
+        goto failed;
     }
 
-    pthread_mutex_init(&textp->mutex, NULL);
-
     return true;
 
 failed:
-    free(textp->text_overlay);
     free(textp);
 
     return false;
@@ -193,74 +232,75 @@ static int get_text_width(FT_Face face, const char *text) {
 void text_reload_params(text_t *text, const parameters_t *params) {
     text_priv_t *textp = (text_priv_t *)text;
 
-    pthread_mutex_lock(&textp->mutex);
-
-    free(textp->text_overlay);
-    textp->text_overlay = strdup(params->text_overlay);
-
-    if (params->text_overlay_enable && textp->library == NULL) {
-        bool ok = load_library(&textp->library, &textp->face);
-        if (!ok) {
-            textp->face = NULL;
-            textp->library = NULL;
-        }
-    } else if (!params->text_overlay_enable && textp->library != NULL) {
-        FT_Done_Face(textp->face);
-        FT_Done_FreeType(textp->library);
-        textp->face = NULL;
-        textp->library = NULL;
+    // FreeType and the font are loaded only when the overlay is enabled for
+    // the first time.
+    text_state_t *state;
+    bool ok = state_create(textp, params, &state);
+    if (!ok) {
+        return;
     }
 
-    pthread_mutex_unlock(&textp->mutex);
+    // a state that has not been picked up yet is replaced.
+    state_destroy(atomic_exchange(&textp->pending, state));
 }
 
 void text_destroy(text_t *text) {
     text_priv_t *textp = (text_priv_t *)text;
 
+    state_destroy(atomic_load(&textp->pending));
+    state_destroy(atomic_load(&textp->spare));
+    state_destroy(textp->state);
+
     if (textp->library != NULL) {
         FT_Done_Face(textp->face);
         FT_Done_FreeType(textp->library);
     }
 
-    free(textp->text_overlay);
-    pthread_mutex_destroy(&textp->mutex);
     free(textp);
 }
 
 void text_draw(text_t *text, uint8_t *buf, uint64_t ntp) {
     text_priv_t *textp = (text_priv_t *)text;
 
-    pthread_mutex_lock(&textp->mutex);
+    if (atomic_load_explicit(&textp->pending, memory_order_relaxed) != NULL) {
+        text_state_t *state = atomic_exchange(&textp->pending, NULL);
+        if (state != NULL) {
+            // the previous state is freed by the main thread, unless the
+            // previous spare has not been reused yet.
+            state_destroy(atomic_exchange(&textp->spare, textp->state));
+            textp->state = state;
+        }
+    }
 
-    if (textp->library != NULL) {
+    text_state_t *state = textp->state;
+
+    if (state->face != NULL) {
         struct timeval tv = {
             .tv_sec = ntp / 1000000,
             .tv_usec = ntp % 1000000,
         };
 
         char buffer[256];
-        extended_strftime(buffer, 256, textp->text_overlay, &tv);
+        extended_strftime(buffer, 256, state->text_overlay, &tv);
 
         draw_rect(buf, textp->stride, textp->height, 7, 7,
-                  get_text_width(textp->face, buffer) + 10, 34);
+                  get_text_width(state->face, buffer) + 10, 34);
 
         int x = 12;
         int y = 33;
 
         for (const char *ptr = buffer; *ptr != 0x00; ptr++) {
-            int error = FT_Load_Char(textp->face, *ptr, FT_LOAD_RENDER);
+            int error = FT_Load_Char(state->face, *ptr, FT_LOAD_RENDER);
             if (error) {
                 continue;
             }
 
             draw_bitmap(buf, textp->stride, textp->height,
-                        &textp->face->glyph->bitmap,
-                        x + textp->face->glyph->bitmap_left,
-                        y - textp->face->glyph->bitmap_top);
+                        &state->face->glyph->bitmap,
+                        x + state->face->glyph->bitmap_left,
+                        y - state->face->glyph->bitmap_top);
 
-            x += textp->face->glyph->advance.x >> 6;
+            x += state->face->glyph->advance.x >> 6;
         }
     }
-
-    pthread_mutex_unlock(&textp->mutex);
 }